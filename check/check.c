@@ -0,0 +1,455 @@
+/*
+** Native replacement for check.py.
+**
+** Compares the av_vels and final_state files written by d2q9-bgk
+** against reference results, printing the same report and exiting
+** with the same codes as the Python script:
+**
+**   0  both files within tolerance
+**   1  a file is out of tolerance or the files do not line up
+**   2  bad command line
+**
+** The files are read in one go and walked with a streaming tokenizer,
+** only converting the columns that are compared, so the 1024x1024
+** reference (91 MB) takes a fraction of a second rather than minutes.
+**
+** Usage:
+**
+**   check/check --ref-av-vels-file=FILE --ref-final-state-file=FILE
+**               --av-vels-file=FILE --final-state-file=FILE [--tolerance=PCT]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* a column of values read from a results file */
+typedef struct
+{
+  double* vals;
+  size_t  n;
+  size_t  capacity;
+} t_column;
+
+/* the statistics check.py reports for each file */
+typedef struct
+{
+  size_t max_diff_step;  /* index of the largest percentage difference */
+  double max_diff;
+  double max_diff_pcnt;
+  double sim_val;
+  double ref_val;
+  double total;          /* sum of absolute differences */
+} t_diffs;
+
+void  usage(const char* exe);
+char* read_file(const char* filename, size_t* len);
+void  push(t_column* col, double val);
+int   load_av_vels(const char* filename, t_column* vals);
+int   load_final_state(const char* filename, t_column* ii, t_column* jj, t_column* vals);
+double pairwise_sum(const double* a, size_t n);
+t_diffs get_diff_values(const double* ref_vals, const double* sim_vals, size_t n);
+
+int main(int argc, char* argv[])
+{
+  const char* names[4] = { "--ref-av-vels-file", "--ref-final-state-file",
+                           "--av-vels-file", "--final-state-file" };
+  const char* files[4] = { NULL, NULL, NULL, NULL };
+  double   tolerance = 1.0;   /* percentage tolerance, as check.py */
+  t_column av_ref = { 0 }, av_sim = { 0 };
+  t_column ii_ref = { 0 }, jj_ref = { 0 }, fs_ref = { 0 };
+  t_column ii_sim = { 0 }, jj_sim = { 0 }, fs_sim = { 0 };
+  t_diffs  av_diffs, fs_diffs;
+  int      final_state_failed, av_vels_failed;
+
+  /* accept both --name=value and --name value, like argparse */
+  for (int i = 1; i < argc; i++)
+  {
+    const char* value = NULL;
+    int         which = -1;
+
+    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+    {
+      usage(argv[0]);
+      return 0;
+    }
+
+    for (int ff = 0; ff < 5; ff++)
+    {
+      const char* name = (ff < 4) ? names[ff] : "--tolerance";
+      const size_t len = strlen(name);
+
+      if (strncmp(argv[i], name, len) == 0)
+      {
+        if (argv[i][len] == '=') value = argv[i] + len + 1;
+        else if (argv[i][len] == '\0' && i + 1 < argc) value = argv[++i];
+        else continue;
+
+        which = ff;
+        break;
+      }
+    }
+
+    if (which < 0 || value == NULL)
+    {
+      usage(argv[0]);
+      fprintf(stderr, "%s: error: unrecognized arguments: %s\n", argv[0], argv[i]);
+      return 2;
+    }
+
+    if (which < 4) files[which] = value;
+    else tolerance = atof(value);
+  }
+
+  for (int ff = 0; ff < 4; ff++)
+  {
+    if (files[ff] == NULL)
+    {
+      usage(argv[0]);
+      fprintf(stderr, "%s: error: the following arguments are required: %s\n", argv[0], names[ff]);
+      return 2;
+    }
+  }
+
+  /* open reference and input files */
+  load_av_vels(files[0], &av_ref);
+  load_final_state(files[1], &ii_ref, &jj_ref, &fs_ref);
+  load_av_vels(files[2], &av_sim);
+  load_final_state(files[3], &ii_sim, &jj_sim, &fs_sim);
+
+  /* make sure the coordinates are in the right order */
+  if (fs_ref.n != fs_sim.n
+      || memcmp(ii_ref.vals, ii_sim.vals, sizeof(double) * fs_ref.n) != 0
+      || memcmp(jj_ref.vals, jj_sim.vals, sizeof(double) * fs_ref.n) != 0)
+  {
+    printf("Final state files coordinates were not the same\n");
+    return 1;
+  }
+
+  /* make sure the av_vels have the same number of steps */
+  if (av_ref.n != av_sim.n)
+  {
+    printf("Different number of steps in av_vels files\n");
+    return 1;
+  }
+
+  av_diffs = get_diff_values(av_ref.vals, av_sim.vals, av_ref.n);
+  printf("Total difference in av_vels : %.12E\n", av_diffs.total);
+  printf("Biggest difference (at step %zu) : %.12E\n", av_diffs.max_diff_step, av_diffs.max_diff);
+  printf("  %.12E vs. %.12E = %.2g%%\n", av_diffs.sim_val, av_diffs.ref_val, av_diffs.max_diff_pcnt);
+  printf("\n");
+
+  /* we want the location of the biggest difference */
+  fs_diffs = get_diff_values(fs_ref.vals, fs_sim.vals, fs_ref.n);
+  printf("Total difference in final_state : %.12E\n", fs_diffs.total);
+  printf("Biggest difference (at coord (%d,%d)) : %.12E\n",
+         (int)ii_sim.vals[fs_diffs.max_diff_step], (int)jj_sim.vals[fs_diffs.max_diff_step],
+         fs_diffs.max_diff);
+  printf("  %.12E vs. %.12E = %.2g%%\n", fs_diffs.sim_val, fs_diffs.ref_val, fs_diffs.max_diff_pcnt);
+  printf("\n");
+
+  /* find out if either of them failed */
+  final_state_failed = !isfinite(fs_diffs.max_diff_pcnt) || fabs(fs_diffs.max_diff_pcnt) > tolerance;
+  av_vels_failed     = !isfinite(av_diffs.max_diff_pcnt) || fabs(av_diffs.max_diff_pcnt) > tolerance;
+
+  if (final_state_failed) printf("final state failed check\n");
+  if (av_vels_failed) printf("av_vels failed check\n");
+
+  /* return 1 on failure */
+  if (final_state_failed || av_vels_failed)
+  {
+    return 1;
+  }
+
+  printf("Both tests passed!\n");
+
+  return 0;
+}
+
+void usage(const char* exe)
+{
+  fprintf(stderr, "usage: %s [-h] [--tolerance TOLERANCE] --ref-av-vels-file\n"
+                  "       REF_AV_VELS_FILE --ref-final-state-file REF_FINAL_STATE_FILE\n"
+                  "       --av-vels-file AV_VELS_FILE --final-state-file FINAL_STATE_FILE\n", exe);
+}
+
+char* read_file(const char* filename, size_t* len)
+{
+  FILE* fp = fopen(filename, "rb");
+  char* buf;
+  long  size;
+
+  if (fp == NULL)
+  {
+    fprintf(stderr, "could not open %s\n", filename);
+    exit(1);
+  }
+
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+
+  /* NUL terminated so strtod can never run off the end */
+  buf = (char*)malloc(size + 1);
+
+  if (buf == NULL || fread(buf, 1, size, fp) != (size_t)size)
+  {
+    fprintf(stderr, "could not read %s\n", filename);
+    exit(1);
+  }
+
+  buf[size] = '\0';
+  *len = size;
+  fclose(fp);
+
+  return buf;
+}
+
+void push(t_column* col, double val)
+{
+  if (col->n == col->capacity)
+  {
+    col->capacity = col->capacity ? 2 * col->capacity : 65536;
+    col->vals = (double*)realloc(col->vals, sizeof(double) * col->capacity);
+
+    if (col->vals == NULL)
+    {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+
+  col->vals[col->n++] = val;
+}
+
+/* advance p past the next whitespace separated token, returning its start */
+static char* next_token(char** p, char* end)
+{
+  char* tok;
+
+  while (*p < end && (**p == ' ' || **p == '\t' || **p == '\r')) (*p)++;
+
+  if (*p >= end || **p == '\n') return NULL;
+
+  tok = *p;
+  while (*p < end && **p != ' ' && **p != '\t' && **p != '\r' && **p != '\n') (*p)++;
+
+  return tok;
+}
+
+/* coordinates are plain integers, which are much cheaper to convert than with strtod */
+static double parse_coord(const char* tok)
+{
+  long v = 0;
+  const char* p = tok;
+
+  while (*p >= '0' && *p <= '9') v = 10 * v + (*p++ - '0');
+
+  if (p == tok || (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '\0'))
+  {
+    return strtod(tok, NULL);
+  }
+
+  return (double)v;
+}
+
+/*
+** The solver writes values with %.12E, i.e. at most 13 significant digits.
+** Such a mantissa is exact in a double, and so is 10^k for k <= 22, so one
+** multiply or divide gives the correctly rounded result (Clinger's fast path)
+** and matches strtod bit for bit. Anything else falls back to strtod.
+*/
+static double parse_value(const char* tok)
+{
+  static const double pow10[23] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+  const char* p = tok;
+  int  negative = 0, digits = 0, scale = 0, exponent = 0, exp_negative = 0;
+  long long mantissa = 0;
+  double value;
+
+  if (*p == '-' || *p == '+') negative = (*p++ == '-');
+
+  for (; *p >= '0' && *p <= '9'; p++, digits++) mantissa = 10 * mantissa + (*p - '0');
+
+  if (*p == '.')
+  {
+    for (p++; *p >= '0' && *p <= '9'; p++, digits++, scale--) mantissa = 10 * mantissa + (*p - '0');
+  }
+
+  if (*p == 'E' || *p == 'e')
+  {
+    const char* e = ++p;
+    if (*p == '-' || *p == '+') exp_negative = (*p++ == '-');
+    for (; *p >= '0' && *p <= '9'; p++) exponent = 10 * exponent + (*p - '0');
+    if (p == e) return strtod(tok, NULL);
+  }
+
+  scale += exp_negative ? -exponent : exponent;
+
+  if (digits == 0 || digits > 15 || scale < -22 || scale > 22
+      || (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '\0'))
+  {
+    return strtod(tok, NULL);
+  }
+
+  value = (double)mantissa;
+  value = (scale < 0) ? value / pow10[-scale] : value * pow10[scale];
+
+  return negative ? -value : value;
+}
+
+/* skip to the start of the next line */
+static void next_line(char** p, char* end)
+{
+  while (*p < end && **p != '\n') (*p)++;
+  if (*p < end) (*p)++;
+}
+
+int load_av_vels(const char* filename, t_column* vals)
+{
+  size_t len;
+  char*  buf = read_file(filename, &len);
+  char*  end = buf + len;
+  char*  p = buf;
+
+  /* lines look like "123:\t1.234567890123E-02", we want column 1 */
+  while (p < end)
+  {
+    if (next_token(&p, end) != NULL)
+    {
+      char* tok = next_token(&p, end);
+
+      if (tok == NULL)
+      {
+        fprintf(stderr, "%s: expected 2 columns\n", filename);
+        exit(1);
+      }
+
+      push(vals, parse_value(tok));
+    }
+
+    next_line(&p, end);
+  }
+
+  free(buf);
+
+  return 0;
+}
+
+int load_final_state(const char* filename, t_column* ii, t_column* jj, t_column* vals)
+{
+  size_t len;
+  char*  buf = read_file(filename, &len);
+  char*  end = buf + len;
+  char*  p = buf;
+
+  /* columns 0, 1 and 5 (the coordinates and pressure), the others are skipped unparsed */
+  while (p < end)
+  {
+    char* tok[6];
+    int   ncols = 0;
+
+    while (ncols < 6 && (tok[ncols] = next_token(&p, end)) != NULL) ncols++;
+
+    if (ncols > 0)
+    {
+      if (ncols < 6)
+      {
+        fprintf(stderr, "%s: expected at least 6 columns\n", filename);
+        exit(1);
+      }
+
+      push(ii, parse_coord(tok[0]));
+      push(jj, parse_coord(tok[1]));
+      push(vals, parse_value(tok[5]));
+    }
+
+    next_line(&p, end);
+  }
+
+  free(buf);
+
+  return 0;
+}
+
+/* numpy's pairwise summation, so totals agree with check.py to the last digit */
+double pairwise_sum(const double* a, size_t n)
+{
+  if (n < 8)
+  {
+    double res = 0.;
+
+    for (size_t i = 0; i < n; i++) res += a[i];
+
+    return res;
+  }
+  else if (n <= 128)
+  {
+    double r[8], res;
+    size_t i;
+
+    for (i = 0; i < 8; i++) r[i] = a[i];
+
+    for (i = 8; i < n - (n % 8); i += 8)
+    {
+      for (int k = 0; k < 8; k++) r[k] += a[i + k];
+    }
+
+    res = ((r[0] + r[1]) + (r[2] + r[3])) + ((r[4] + r[5]) + (r[6] + r[7]));
+
+    for (; i < n; i++) res += a[i];
+
+    return res;
+  }
+  else
+  {
+    size_t n2 = n / 2;
+    n2 -= n2 % 8;
+    return pairwise_sum(a, n2) + pairwise_sum(a + n2, n - n2);
+  }
+}
+
+t_diffs get_diff_values(const double* ref_vals, const double* sim_vals, size_t n)
+{
+  t_diffs diffs;
+  double* abs_diff = (double*)malloc(sizeof(double) * (n ? n : 1));
+  double  biggest = -1.;
+  int     found_nan = 0;
+
+  memset(&diffs, 0, sizeof(t_diffs));
+
+  if (abs_diff == NULL)
+  {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < n; i++)
+  {
+    /* get the differences between the original and reference results */
+    const double diff = ref_vals[i] - sim_vals[i];
+    const double diff_pcnt = 100.0 * (diff / (ref_vals[i] - diff));
+    const double mag = fabs(diff_pcnt);
+
+    abs_diff[i] = fabs(diff);
+
+    /* np.argmax: first maximum, and the first NaN beats everything */
+    if (!found_nan && (isnan(mag) || mag > biggest))
+    {
+      found_nan = isnan(mag);
+      biggest = mag;
+      diffs.max_diff_step = i;
+      diffs.max_diff = diff;
+      diffs.max_diff_pcnt = diff_pcnt;
+      diffs.sim_val = sim_vals[i];
+      diffs.ref_val = ref_vals[i];
+    }
+  }
+
+  diffs.total = pairwise_sum(abs_diff, n);
+  free(abs_diff);
+
+  return diffs;
+}
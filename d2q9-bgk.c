@@ -47,8 +47,53 @@
 **
 ** Be sure to adjust the grid dimensions in the parameter file
 ** if you choose a different obstacle file.
+**
+** The solver itself is libd2q9 (d2q9.c, API in d2q9.h); this
+** file is its command line front end.
+**
+** Optional flags may follow the two file names, e.g.:
+**
+**   ./d2q9-bgk input.params obstacles.dat --checkpoint-every=1000
+**
+** Periodic output is handed to a writer thread so the
+** timestep loop does not stall on the file system.
+** Field snapshots are legacy VTK files which ParaView
+** opens directly, and images of |u| are rendered straight
+** to PNG or PPM without going through final_state.dat.
+** Snapshots and checkpoints can be compressed (losslessly or
+** within an absolute error bound) and restored with:
+**
+**   ./d2q9-bgk --unpack snapshot_001000.d2z snapshot_001000.vtk
+**
+** A parameter sweep runs many variants of the parameter file
+** against one obstacle map in a single process:
+**
+**   ./d2q9-bgk input.params obstacles.dat --sweep=sweep.txt --sweep-jobs=0
+**
+** With --ensemble the cases of a sweep are interleaved, one per
+** SIMD lane, so every cell is updated for ENSEMBLE_WIDTH cases
+** at once with the same (shared) obstacle test.
+**
+** Steady flows can stop before maxIters once av_vels or the
+** velocity field has stopped changing:
+**
+**   ./d2q9-bgk input.params obstacles.dat --converge=1e-6 --converge-window=1000
+**
+** and can start from a coarser solution, run first on a lattice
+** 1/F the size or loaded from a checkpoint, instead of a fluid at rest:
+**
+**   ./d2q9-bgk input.params obstacles.dat --warm-start-factor=4
+**
+** With --jit the kernel is compiled again for the run's nx, ny and
+** omega by the system compiler, and cached for later runs. The
+** library's other kernels are chosen by name with --kernel, and two
+** of them can be timed against each other on the same input:
+**
+**   ./d2q9-bgk input.params obstacles.dat --ab=aos,soa --ab-steps=1000
 */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
@@ -57,82 +102,290 @@
 #include <sys/resource.h>
 
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "d2q9.h"
 
-#define NSPEEDS         9
+#define NSPEEDS         D2Q9_NSPEEDS
 #define FINALSTATEFILE  "final_state.dat"
 #define AVVELSFILE      "av_vels.dat"
+#define CHECKPOINTFILE  "checkpoint.dat"
+#define SNAPSHOTFILE    "snapshot_%06d.vtk"
+#define NFIELDS         4    /* u_x, u_y, |u| and pressure in a snapshot */
+#define FRAMEFILE       "frame_%06d"
+#define IMAGEFILE       "final_state"
+#define ZIPMAGIC        "D2Q9ZIP1"
+#define ZIPSUFFIX       ".d2z"
+#define ZBLOCKROWS      64   /* rows per independently compressed block */
+#define SWEEPFINALSTATEFILE "final_state_%03d.dat"
+#define SWEEPAVVELSFILE     "av_vels_%03d.dat"
+#define JITDIR          "d2q9"   /* under $XDG_CACHE_HOME or ~/.cache */
+#ifndef ENSEMBLE_WIDTH
+#define ENSEMBLE_WIDTH  8    /* ensemble members per cell, one per SIMD lane */
+#endif
+
+/* how snapshots and checkpoints are compressed */
+enum
+{
+  COMPRESS_NONE,
+  COMPRESS_LOSSLESS,    /* XOR-delta, byte planes, deflate */
+  COMPRESS_LOSSY        /* Lorenzo prediction, error-bounded quantisation, byte planes, deflate */
+};
 //#define DEBUG
 
-/* struct to hold the parameter values */
+/* DEBUG as a value, for tests that must still compile without it */
+#ifdef DEBUG
+#define DEBUG_BUILD 1
+#else
+#define DEBUG_BUILD 0
+#endif
+
+/* the parameter values, as the library holds them */
+typedef d2q9_params t_param;
+
+/* struct to hold the command line options */
 typedef struct
 {
-  int    nx;            /* no. of cells in x-direction */
-  int    ny;            /* no. of cells in y-direction */
-  int    maxIters;      /* no. of iterations */
-  int    reynolds_dim;  /* dimension for Reynolds number */
-  float density;       /* density per link */
-  float accel;         /* density redistribution */
-  float omega;         /* relaxation parameter */
-} t_param;
+  int    checkpoint_every; /* write the lattice every n steps (0 = never) */
+  int    flush_every;      /* append av_vels to file every n steps (0 = at the end) */
+  int    snapshot_every;   /* write a VTK field snapshot every n steps (0 = never) */
+  int    render;           /* render |u| to IMAGEFILE at the end */
+  int    render_every;     /* render |u| to FRAMEFILE every n steps (0 = never) */
+  int    render_ppm;       /* write PPM rather than PNG images */
+  float  render_max;       /* |u| mapped to the top of the colour map (0 = per image max) */
+  int    compress;         /* COMPRESS_NONE, COMPRESS_LOSSLESS or COMPRESS_LOSSY */
+  float  compress_eb;      /* lossy: max absolute error of any value */
+  int    compress_threads; /* row-blocks compressed concurrently */
+  const char* sweep;       /* file of parameter variants to run (NULL = single run) */
+  int    sweep_jobs;       /* cases run concurrently (0 = one per core) */
+  int    ensemble;         /* run sweep cases ENSEMBLE_WIDTH at a time in SIMD lanes */
+  float  converge_tol;     /* stop when av_vels moves less than this (relative) over the window (0 = off) */
+  int    converge_window;  /* steps between the av_vels values compared */
+  float  converge_l2;      /* stop when the L2 change of u between samples is below this (0 = off) */
+  int    converge_every;   /* steps between velocity field samples */
+  int    converge_pad;     /* after an early stop: 1 = repeat the last av_vels to maxIters, 0 = truncate */
+  const char* warm_start;  /* checkpoint to interpolate the initial state from (NULL = none) */
+  int    warm_factor;      /* run a coarse lattice 1/F the size first (0 = none) */
+  int    warm_iters;       /* steps of the coarse run (0 = maxIters) */
+  int    jit;              /* step with a kernel compiled for this run's nx, ny and omega */
+  const char* jit_dir;     /* cache of compiled kernels (NULL = JITDIR under the user's cache) */
+  const char* kernel;      /* registered kernel to step with (NULL = the library's choice) */
+  char   ab[2][32];        /* kernels compared by --ab (empty = no comparison) */
+  int    ab_steps;         /* steps run by each of them (0 = maxIters) */
+  float  ab_tol;           /* largest difference in any speed for them to agree */
+  int    threads;          /* threads stepping the lattice (0 = one per core) */
+  const char* pin;         /* pinning of those threads (NULL = none) */
+  const char* numa;        /* placement of the lattice on NUMA nodes (NULL = local) */
+  int    tile;             /* rows in a tile of the task scheduler (0 = a block per thread) */
+} t_opts;
+
+/* kinds of job handled by the writer thread */
+typedef enum
+{
+  JOB_AV_VELS,          /* append a chunk of av_vels to AVVELSFILE */
+  JOB_CHECKPOINT,       /* dump all speeds to CHECKPOINTFILE */
+  JOB_SNAPSHOT,         /* write derived fields to SNAPSHOTFILE */
+  JOB_RENDER            /* colour map |u| into FRAMEFILE or IMAGEFILE */
+} t_job_kind;
 
-/* struct to hold the 'speed' values */
+/* one half of the writer's double buffer */
+typedef struct
+{
+  t_job_kind kind;
+  int    step;          /* timestep the data was captured after */
+  int    first;         /* av_vels: index of the first value in the chunk */
+  int    count;         /* av_vels: no. of values in the chunk */
+  int    last;          /* render: final image rather than an animation frame */
+  const float* values;  /* av_vels: handed off, not copied */
+  float* data;          /* checkpoint/snapshot: staging copy of the speeds or fields */
+  size_t capacity;      /* no. of floats allocated in data */
+} t_slot;
+
+/* asynchronous writer: the solver fills one slot while the thread writes the other */
+typedef struct
+{
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  t_param         params;
+  t_opts          opts;
+  const int*      obstacles; /* constant for the whole run, so shared not copied */
+  t_slot          slots[2];
+  int             full[2];  /* slot is queued or being written */
+  int             fill;     /* slot the solver fills next */
+  int             drain;    /* slot the writer takes next */
+  int             quit;     /* no more jobs will be queued */
+  FILE*           av_fp;    /* AVVELSFILE, kept open between flushes */
+  double          stall;    /* seconds the solver waited for a free slot */
+  double          zraw;     /* bytes handed to the compressor */
+  double          zout;     /* bytes it produced */
+  double          ztime;    /* seconds spent compressing */
+} t_writer;
+
+/* one compressed row-block of one plane */
 typedef struct
 {
-  float speeds[NSPEEDS];
-} t_speed;
+  unsigned char* buf;   /* 4 byte raw length then the deflate stream */
+  size_t len;
+} t_zblock;
 
-/*
-** function prototypes
-*/
+/* work shared by the compression threads */
+typedef struct
+{
+  const float* data;    /* nplanes planes of nx*ny floats */
+  float*    out;        /* decompression target */
+  t_zblock* blocks;
+  int       nx, ny;
+  int       nblocks;    /* total over all planes */
+  int       mode;
+  float     eb;
+  int       stride;     /* no. of threads */
+  int       first;      /* this thread's first block */
+  int       failed;
+} t_zjob;
+
+/* one line of a parameter sweep */
+typedef struct
+{
+  t_param params;
+  float   reynolds;     /* filled in once the case has run */
+  double  elapsed;
+} t_case;
 
-/* load params, allocate memory, load obstacles & initialise fluid particle densities */
-// int initialise(const char* paramfile, const char* obstaclefile,
-//                t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-//                int** obstacles_ptr, float** av_vels_ptr);
+/* cases shared by the sweep workers, which claim them in order */
+typedef struct
+{
+  pthread_mutex_t lock;
+  t_case* cases;
+  int     ncases;
+  int     next;         /* first unclaimed case */
+  int     max_iters;    /* longest case, to size av_vels */
+  int     ensemble;     /* claim cases in batches of up to ENSEMBLE_WIDTH */
+  int*    obstacles;    /* loaded once for every case */
+} t_sweep;
 
+/*
+** ENSEMBLE_WIDTH independent simulations sharing one obstacle map.
+** Speeds are interleaved so the lanes of a cell are contiguous:
+** grid[kk][(ii + jj*nx)*ENSEMBLE_WIDTH + lane]
+*/
+typedef struct
+{
+  t_param params;                     /* nx, ny and maxIters shared by every lane */
+  int     nlanes;                     /* lanes holding real cases, the rest repeat the last */
+  float   omega[ENSEMBLE_WIDTH];
+  float   density[ENSEMBLE_WIDTH];
+  float   accel_w1[ENSEMBLE_WIDTH];   /* density * accel / 9 */
+  float   accel_w2[ENSEMBLE_WIDTH];   /* density * accel / 36 */
+} t_ensemble;
+
+/* state of the steady-state test between timesteps */
+typedef struct
+{
+  float* u_prev;        /* u_x, u_y at the last field sample */
+  int    sampled;       /* u_prev holds a sample */
+  int    l2_ok;         /* the last two samples were within converge_l2 */
+} t_converge;
 
-int initialise(const char* paramfile, const char* obstaclefile,
-               t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-               int** obstacles_ptr, float** av_vels_ptr,float*** grid_ptr,float*** tmp_grid_ptr,float*** o_grid_ptr);
+/* a sweep worker and the buffers it reuses for all its cases */
+typedef struct
+{
+  t_sweep*  sweep;
+  pthread_t thread;
+  d2q9_ctx* ctx;        /* reset for each case */
+  float*    av_vels;
+  float**   e_grid;     /* ensemble lattices, allocated on first use */
+  float**   e_o_grid;
+  float*    e_av_vels;  /* maxIters values per lane */
+} t_sweeper;
 
 /*
-** The main calculation methods.
-** timestep calls, in order, the functions:
-** accelerate_flow(), propagate(), rebound() & collision()
+** function prototypes
 */
 
-int timestep(const t_param params,int* obstacles,float** restrict grid,float** restrict tmp_grid, float** restrict o_grid);
-//int accelerate_flow(const t_param params, t_speed* cells, int* obstacles);
-int accelerate_flow(const t_param params,  int* obstacles,float** restrict grid);
-int propagate(const t_param params, t_speed* cells, t_speed* tmp_cells);
-int rebound(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
-int collision(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
-int write_values(const t_param params, float** grid, int* obstacles, float* av_vels);
+/* load params and obstacles, and create the lattice; die on any error */
+int initialise(const char* paramfile, const char* obstaclefile,
+               t_param* params, int** obstacles_ptr, float** av_vels_ptr, d2q9_ctx** ctx_ptr);
 
+int write_values(const t_param params, float** grid, int* obstacles, float* av_vels,
+                 const char* final_state_file, const char* av_vels_file);
 
-//float fushion(const t_param params, t_speed** cells_ptr, t_speed** tmp_cells_ptr, int* obstacles,t_speed** output_ptr,float*** grid_ptr,float*** tmp_grid_ptr,float*** o_grid_ptr);
-float fushion(const t_param params,  int* obstacles,float** restrict grid ,float** restrict tmp_grid ,float** restrict o_grid );
 /* finalise, including freeing up allocated memory */
-int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-             int** obstacles_ptr, float** av_vels_ptr);
-
-/* Sum all the densities in the grid.
-** The total should remain constant from one timestep to the next. */
-
-float total_density(const t_param params, float** grid);
-
-/* compute average velocity */
-//float av_velocity(const t_param params, t_speed* cells, int* obstacles);
-//float av_velocity(const t_param params, t_speed* cells, int* obstacles,float** grid);
-float av_velocity(const t_param params, int* obstacles,float** grid);
-
-/* calculate Reynolds number */
-
-float calc_reynolds(const t_param params, int* obstacles,float** grid);
+int finalise(d2q9_ctx** ctx_ptr, int** obstacles_ptr, float** av_vels_ptr);
+
+/* asynchronous output: start the thread, borrow a free slot, queue it, drain and join */
+int writer_start(t_writer* writer, const t_param params, const t_opts opts, const int* obstacles);
+t_slot* writer_acquire(t_writer* writer, size_t nfloats);
+int writer_commit(t_writer* writer);
+int writer_stop(t_writer* writer);
+void* writer_main(void* arg);
+int queue_fields(t_writer* writer, const t_job_kind kind, const int step, const int last,
+                 const t_param params, int* obstacles, float** grid);
+int write_checkpoint(const t_param params, const t_slot* slot, const char* filename);
+int write_snapshot(const t_param params, t_slot* slot, const char* filename);
+
+/* error-bounded float compression, multithreaded over row-blocks */
+size_t encode_block(const float* in, int nx, int nrows, int mode, float eb, unsigned char** out);
+int decode_block(const unsigned char* in, size_t len, int nx, int nrows, int mode, float eb, float* out);
+void* zjob_main(void* arg);
+int run_zjobs(t_zjob* job, int nthreads);
+int write_compressed(const t_param params, const t_opts opts, const t_slot* slot, const int nplanes,
+                     const char* filename, double* zraw, double* zout);
+int unpack_file(const char* in, const char* out);
+int write_image(const t_param params, const t_opts opts, const int* obstacles, const t_slot* slot);
+void colour_map(float x, unsigned char* rgb);
+
+/* u_x, u_y, |u| and pressure for every cell in a single pass, one plane each */
+int compute_fields(const t_param params, int* obstacles, float** grid, float* fields);
+
+/* coarse-to-fine warm start: run or load a coarse solution and interpolate it onto grid */
+int warm_start(const t_param params, const t_opts opts, int* obstacles, float** grid);
+
+/* switch ctx to a kernel compiled for it, or report why it keeps the built-in one */
+int start_jit(const t_opts opts, d2q9_ctx* ctx);
+
+/* select a registered kernel by name, dying if it cannot be used */
+int use_kernel(const t_opts opts, d2q9_ctx* ctx, const char* name);
+int list_kernels(void);
+
+/* rewrite an obstacle file run-length encoded */
+int pack_obstacles(const char* paramfile, const char* obstaclefile, const char* out);
+long file_size(const char* filename);
+
+/* split the steps over threads, as --threads, --pin, --numa and --tile ask */
+int start_threads(const t_opts opts, d2q9_ctx* ctx);
+
+/* time two kernels on the same input and check that they agree */
+int run_ab(const t_opts opts, const t_param params, int* obstacles);
+int interpolate_grid(const t_param cparams, int* cobstacles, float** cgrid,
+                     const t_param params, int* obstacles, float** grid);
+
+/* steps from tt to the next one that output or a convergence test needs to see */
+int next_chunk(const t_param params, const t_opts opts, const int tt);
+
+/* steady-state test after step tt: 1 once every enabled criterion holds */
+int converged(const t_param params, const t_opts opts, int* obstacles, float** grid,
+              const float* av_vels, const int tt, t_converge* conv);
 
 /* utility functions */
 void die(const char* message, const int line, const char* file);
 void usage(const char* exe);
+int parse_options(int argc, char* argv[], t_opts* opts);
+
+/* parameter sweeps: read the variants, then run them over a pool of reused lattices */
+int load_sweep(const char* sweepfile, const t_param base, t_sweep* sweep);
+int run_sweep(const t_opts opts, t_sweep* sweep, d2q9_ctx* ctx, float** av_vels_ptr);
+void* sweep_main(void* arg);
+int run_case(const int index, t_case* job, t_sweeper* worker);
+
+/* ensemble mode: one timestep of every lane, and a batch of sweep cases run that way */
+int ensemble_accelerate(const t_ensemble* e, int* obstacles, float** restrict grid);
+int ensemble_fushion(const t_ensemble* e, int* obstacles, float** restrict grid, float** restrict o_grid);
+int ensemble_av_velocity(const t_ensemble* e, int* obstacles, float** grid, float* av_vels);
+int run_ensemble(const int first, const int count, t_sweep* sweep, t_sweeper* worker);
+double wtime(void);
 
 /*
 ** main program:
@@ -143,18 +396,36 @@ int main(int argc, char* argv[])
   char*    paramfile = NULL;    /* name of the input parameter file */
   char*    obstaclefile = NULL; /* name of a the input obstacle file */
   t_param  params;              /* struct to hold parameter values */
-  t_speed* cells     = NULL;    /* grid containing fluid densities */
-  t_speed* tmp_cells = NULL;    /* scratch space */
+  d2q9_ctx* ctx      = NULL;    /* the lattice, held by the library */
   int*     obstacles = NULL;    /* grid indicating which cells are blocked */
   float* av_vels   = NULL;     /* a record of the av. velocity computed for each timestep */
   struct timeval timstr;                                                             /* structure to hold elapsed time */
   double tot_tic, tot_toc, init_tic, init_toc, comp_tic, comp_toc, col_tic, col_toc; /* floating point numbers to calculate elapsed wallclock time */
 
-  float** grid = NULL;
-  float** tmp_grid = NULL;
-  float** o_grid = NULL;
+  float**  grid = NULL;         /* the library's speed planes */
+  t_opts   opts;                /* optional command line flags */
+  double   zraw = 0.0, zout = 0.0, ztime = 0.0; /* compression totals from the writer */
+  t_writer writer;              /* asynchronous output thread */
+  int      use_writer;          /* any periodic output requested */
+  int      flushed = 0;         /* av_vels already written up to this step */
+  int      stop_step = 0;       /* steps run before converging (0 = ran to maxIters) */
+  t_converge conv;              /* steady-state test state */
+  double   stall = 0.0;         /* time the loop spent waiting on the writer */
+
   /* parse the command line */
-  if (argc != 3)
+  if (argc == 4 && strcmp(argv[1], "--unpack") == 0)
+  {
+    return unpack_file(argv[2], argv[3]);
+  }
+  else if (argc == 2 && strcmp(argv[1], "--list-kernels") == 0)
+  {
+    return list_kernels();
+  }
+  else if (argc == 5 && strcmp(argv[1], "--pack-obstacles") == 0)
+  {
+    return pack_obstacles(argv[2], argv[3], argv[4]);
+  }
+  else if (argc < 3)
   {
     usage(argv[0]);
   }
@@ -162,6 +433,7 @@ int main(int argc, char* argv[])
   {
     paramfile = argv[1];
     obstaclefile = argv[2];
+    parse_options(argc - 3, argv + 3, &opts);
   }
 
   /* Total/init time starts here: initialise our data structures and load values from file */
@@ -169,39 +441,132 @@ int main(int argc, char* argv[])
   tot_tic = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
   init_tic=tot_tic;
 
-  initialise(paramfile, obstaclefile, &params, &cells, &tmp_cells, &obstacles, &av_vels,&grid,&tmp_grid,&o_grid);
+  initialise(paramfile, obstaclefile, &params, &obstacles, &av_vels, &ctx);
+  grid = d2q9_speeds(ctx);
+
+  if (opts.ab[0][0] != '\0')
+  {
+    int status = run_ab(opts, params, obstacles);
+    finalise(&ctx, &obstacles, &av_vels);
+    return status;
+  }
+
+  if (opts.kernel != NULL) use_kernel(opts, ctx, opts.kernel);
+  else if (opts.jit) start_jit(opts, ctx);
+  start_threads(opts, ctx);
+
+  if (opts.warm_start != NULL || opts.warm_factor > 0) warm_start(params, opts, obstacles, grid);
+
+  /* a sweep runs its own loop over the cases, reusing the lattice, obstacles and av_vels */
+  if (opts.sweep != NULL)
+  {
+    t_sweep sweep;
+    load_sweep(opts.sweep, params, &sweep);
+    sweep.obstacles = obstacles;
+    sweep.ensemble  = opts.ensemble;
+    run_sweep(opts, &sweep, ctx, &av_vels);
+
+    finalise(&ctx, &obstacles, &av_vels);
+    return EXIT_SUCCESS;
+  }
 
   /* Init time stops here, compute time starts*/
   gettimeofday(&timstr, NULL);
   init_toc = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
   comp_tic=init_toc;
 
+  use_writer = opts.checkpoint_every > 0 || opts.flush_every > 0 || opts.snapshot_every > 0
+               || opts.render || opts.render_every > 0;
+  if (use_writer) writer_start(&writer, params, opts, obstacles);
+
+  memset(&conv, 0, sizeof(t_converge));
 
   for (int tt = 0; tt < params.maxIters; tt++)
   {
-    timestep(params, obstacles,grid,tmp_grid,o_grid);
-
-    //temp code till i can workout the pointer swapping
+    /* one call up to the next output, so that threads can run ahead of each other; tt is then its last step */
+    const int chunk = next_chunk(params, opts, tt);
+    d2q9_step(ctx, chunk, &av_vels[tt]);
+    tt += chunk - 1;
+
+    /* on a steady state this becomes the last step, so final output happens here */
+    if ((opts.converge_tol > 0.f || opts.converge_l2 > 0.f) && tt + 1 < params.maxIters
+        && converged(params, opts, obstacles, grid, av_vels, tt, &conv))
+    {
+      stop_step = tt + 1;
+      if (opts.converge_pad)
+      {
+        for (int ii = tt + 1; ii < params.maxIters; ii++) av_vels[ii] = av_vels[tt];
+      }
+      else
+      {
+        params.maxIters = stop_step;
+      }
+    }
 
-    for (int jj = 0; jj < params.ny; jj++)
+    /* hand periodic output to the writer and carry on stepping */
+    if (opts.flush_every > 0 && (tt + 1) % opts.flush_every == 0)
     {
-    for (int ii = 0; ii < params.nx; ii++)
+      t_slot* slot = writer_acquire(&writer, 0);
+      slot->kind   = JOB_AV_VELS;
+      slot->step   = tt;
+      slot->first  = flushed;
+      slot->count  = tt + 1 - flushed;
+      slot->values = av_vels + flushed;
+      writer_commit(&writer);
+      flushed = tt + 1;
+    }
+    if (opts.checkpoint_every > 0 && (tt + 1) % opts.checkpoint_every == 0)
     {
+      const size_t ncells = (size_t)params.nx * params.ny;
+      t_slot* slot = writer_acquire(&writer, NSPEEDS * ncells);
+      slot->kind = JOB_CHECKPOINT;
+      slot->step = tt;
       for (int kk = 0; kk < NSPEEDS; kk++)
       {
-        grid[kk][ii + jj*params.nx]= o_grid[kk][ii + jj*params.nx];
+        memcpy(slot->data + kk * ncells, grid[kk], sizeof(float) * ncells);
       }
+      writer_commit(&writer);
+    }
+    if (opts.snapshot_every > 0
+        && ((tt + 1) % opts.snapshot_every == 0 || tt + 1 == params.maxIters || stop_step))
+    {
+      queue_fields(&writer, JOB_SNAPSHOT, tt, 0, params, obstacles, grid);
+    }
+    if (opts.render_every > 0 && (tt + 1) % opts.render_every == 0)
+    {
+      queue_fields(&writer, JOB_RENDER, tt, 0, params, obstacles, grid);
+    }
+    if (opts.render && (tt + 1 == params.maxIters || stop_step))
+    {
+      queue_fields(&writer, JOB_RENDER, tt, 1, params, obstacles, grid);
     }
-
-  }
-
-
-    av_vels[tt] = av_velocity(params,obstacles,grid);
 #ifdef DEBUG
     printf("==timestep: %d==\n", tt);
     printf("av velocity: %.12E\n", av_vels[tt]);
-    printf("tot density: %.12E\n", total_density(params, grid));
+    printf("tot density: %.12E\n", d2q9_total_density(ctx));
 #endif
+    if (stop_step) break;
+  }
+  free(conv.u_prev);
+
+  /* queue what is left of av_vels and wait for the writer to finish */
+  if (use_writer)
+  {
+    if (opts.flush_every > 0 && flushed < params.maxIters)
+    {
+      t_slot* slot = writer_acquire(&writer, 0);
+      slot->kind   = JOB_AV_VELS;
+      slot->step   = params.maxIters - 1;
+      slot->first  = flushed;
+      slot->count  = params.maxIters - flushed;
+      slot->values = av_vels + flushed;
+      writer_commit(&writer);
+    }
+    writer_stop(&writer);
+    stall = writer.stall;
+    zraw  = writer.zraw;
+    zout  = writer.zout;
+    ztime = writer.ztime;
   }
 
   /* Compute time stops here, collate time starts*/
@@ -218,759 +583,2075 @@ int main(int argc, char* argv[])
 
   /* write final values and free memory */
   printf("==done==\n");
-  printf("Reynolds number:\t\t%.12E\n", calc_reynolds(params, obstacles,grid));
+  printf("Reynolds number:\t\t%.12E\n", d2q9_reynolds(ctx));
+  if (opts.converge_tol > 0.f || opts.converge_l2 > 0.f)
+  {
+    if (stop_step) printf("Converged at step:\t\t\t%d (av_vels %s)\n", stop_step, opts.converge_pad ? "padded" : "truncated");
+    else printf("Converged at step:\t\t\tnone (ran %d steps)\n", params.maxIters);
+  }
   printf("Elapsed Init time:\t\t\t%.6lf (s)\n",    init_toc - init_tic);
   printf("Elapsed Compute time:\t\t\t%.6lf (s)\n", comp_toc - comp_tic);
   printf("Elapsed Collate time:\t\t\t%.6lf (s)\n", col_toc  - col_tic);
   printf("Elapsed Total time:\t\t\t%.6lf (s)\n",   tot_toc  - tot_tic);
-  write_values(params, grid, obstacles, av_vels);
-  finalise(&params, &cells, &tmp_cells, &obstacles, &av_vels);
+  if (use_writer) printf("Elapsed Writer stall time:\t\t%.6lf (s)\n", stall);
+  {
+    const char* backing;
+    const size_t bytes = d2q9_memory(ctx, &backing);
+    printf("Lattice memory:\t\t\t\t%.1f MB (%s)\n", bytes / 1e6, backing);
+    if (d2q9_kernel_memory(ctx) > 0) printf("Kernel memory:\t\t\t\t%.1f MB (%s)\n", d2q9_kernel_memory(ctx) / 1e6, d2q9_get_kernel(ctx));
+  }
+  printf("Threads:\t\t\t\t%s\n", d2q9_topology(ctx));
+  if (opts.threads != 1) printf("Elapsed Thread wait time:\t\t%.6lf (s, all threads)\n", d2q9_thread_wait(ctx));
+  if (opts.tile > 0)
+  {
+    long stepped;
+    const long steals = d2q9_steals(ctx, &stepped);
+    printf("Tiles stepped:\t\t\t\t%ld (%ld stolen)\n", stepped, steals);
+  }
+  if (zout > 0.0)
+  {
+    printf("Compression ratio:\t\t\t%.2f (%.1f MB -> %.1f MB)\n", zraw / zout, zraw / 1e6, zout / 1e6);
+    printf("Compression throughput:\t\t\t%.1f (MB/s)\n", zraw / 1e6 / ztime);
+  }
+  /* av_vels has already gone out through the writer when flushing */
+  write_values(params, grid, obstacles, (opts.flush_every > 0) ? NULL : av_vels,
+               FINALSTATEFILE, AVVELSFILE);
+  finalise(&ctx, &obstacles, &av_vels);
 
   return EXIT_SUCCESS;
 }
 
-int timestep(const t_param params,int* obstacles,float** restrict grid,float** restrict tmp_grid, float** restrict o_grid)
+int initialise(const char* paramfile, const char* obstaclefile,
+               t_param* params, int** obstacles_ptr, float** av_vels_ptr, d2q9_ctx** ctx_ptr)
 {
-  accelerate_flow(params, obstacles,grid);
-  fushion(params, obstacles,grid,tmp_grid,o_grid);
+  char message[1024];  /* message buffer */
+  int  status;         /* from the library */
 
+  status = d2q9_read_params(paramfile, params);
 
-  return EXIT_SUCCESS;
-}
+  if (status != D2Q9_OK)
+  {
+    sprintf(message, "could not read param file %.900s: %s", paramfile, d2q9_strerror(status));
+    die(message, __LINE__, __FILE__);
+  }
 
-int accelerate_flow(const t_param params,  int* obstacles,float** restrict grid)
-{
-  /* compute weighting factors */
-  float w1 = params.density * params.accel / 9.f;
-  float w2 = params.density * params.accel / 36.f;
+  /* the map of obstacles */
+  *obstacles_ptr = malloc(sizeof(int) * (params->ny * params->nx));
 
-  /* modify the 2nd row of the grid */
-  int jj = params.ny - 2;
+  if (*obstacles_ptr == NULL) die("cannot allocate column memory for obstacles", __LINE__, __FILE__);
+
+  status = d2q9_read_obstacles(obstaclefile, params, *obstacles_ptr);
 
-  for (int ii = 0; ii < params.nx; ii++)
+  if (status != D2Q9_OK)
   {
-    /* if the cell is not occupied and
-    ** we don't send a negative density */
-    if (!obstacles[ii + jj*params.nx]
-        && (grid[3][ii + jj*params.nx] - w1) > 0.f
-        && (grid[6][ii + jj*params.nx] - w2) > 0.f
-        && (grid[7][ii + jj*params.nx] - w2) > 0.f)
-    {
-      /* increase 'east-side' densities */
-      grid[1][ii + jj*params.nx] += w1;
-      grid[5][ii + jj*params.nx] += w2;
-      grid[8][ii + jj*params.nx] += w2;
-      /* decrease 'west-side' densities */
-      grid[3][ii + jj*params.nx] -= w1;
-      grid[6][ii + jj*params.nx] -= w2;
-      grid[7][ii + jj*params.nx] -= w2;
+    sprintf(message, "could not read obstacles file %.900s: %s", obstaclefile, d2q9_strerror(status));
+    die(message, __LINE__, __FILE__);
+  }
 
+  /* the lattice, at rest */
+  status = d2q9_create(params, *obstacles_ptr, ctx_ptr);
 
-    }
-  }
+  if (status != D2Q9_OK) die(d2q9_strerror(status), __LINE__, __FILE__);
 
-  return EXIT_SUCCESS;
-}
+  /*
+  ** allocate space to hold a record of the avarage velocities computed
+  ** at each timestep
+  */
+  *av_vels_ptr = (float*)malloc(sizeof(float) * params->maxIters);
 
-int propagate(const t_param params, t_speed* cells, t_speed* tmp_cells)
-{
-  /* loop over _all_ cells */
-  for (int jj = 0; jj < params.ny; jj++)
-  {
-    for (int ii = 0; ii < params.nx; ii++)
-    {
-      /* determine indices of axis-direction neighbours
-      ** respecting periodic boundary conditions (wrap around) */
-      int y_n = (jj + 1) % params.ny;
-      int x_e = (ii + 1) % params.nx;
-      int y_s = (jj == 0) ? (jj + params.ny - 1) : (jj - 1);
-      int x_w = (ii == 0) ? (ii + params.nx - 1) : (ii - 1);
-      /* propagate densities from neighbouring cells, following
-      ** appropriate directions of travel and writing into
-      ** scratch space grid */
-      tmp_cells[ii + jj*params.nx].speeds[0] = cells[ii + jj*params.nx].speeds[0]; /* central cell, no movement */
-      tmp_cells[ii + jj*params.nx].speeds[1] = cells[x_w + jj*params.nx].speeds[1]; /* east */
-      tmp_cells[ii + jj*params.nx].speeds[2] = cells[ii + y_s*params.nx].speeds[2]; /* north */
-      tmp_cells[ii + jj*params.nx].speeds[3] = cells[x_e + jj*params.nx].speeds[3]; /* west */
-      tmp_cells[ii + jj*params.nx].speeds[4] = cells[ii + y_n*params.nx].speeds[4]; /* south */
-      tmp_cells[ii + jj*params.nx].speeds[5] = cells[x_w + y_s*params.nx].speeds[5]; /* north-east */
-      tmp_cells[ii + jj*params.nx].speeds[6] = cells[x_e + y_s*params.nx].speeds[6]; /* north-west */
-      tmp_cells[ii + jj*params.nx].speeds[7] = cells[x_e + y_n*params.nx].speeds[7]; /* south-west */
-      tmp_cells[ii + jj*params.nx].speeds[8] = cells[x_w + y_n*params.nx].speeds[8]; /* south-east */
-    }
-  }
+  if (*av_vels_ptr == NULL) die("cannot allocate memory for av_vels", __LINE__, __FILE__);
 
   return EXIT_SUCCESS;
 }
 
-int rebound(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+int finalise(d2q9_ctx** ctx_ptr, int** obstacles_ptr, float** av_vels_ptr)
 {
-  /* loop over the cells in the grid */
-  for (int jj = 0; jj < params.ny; jj++)
-  {
-    for (int ii = 0; ii < params.nx; ii++)
-    {
-      /* if the cell contains an obstacle */
-      if (obstacles[jj*params.nx + ii])
-      {
-        /* called after propagate, so taking values from scratch space
-        ** mirroring, and writing into main grid */
-        cells[ii + jj*params.nx].speeds[1] = tmp_cells[ii + jj*params.nx].speeds[3];
-        cells[ii + jj*params.nx].speeds[2] = tmp_cells[ii + jj*params.nx].speeds[4];
-        cells[ii + jj*params.nx].speeds[3] = tmp_cells[ii + jj*params.nx].speeds[1];
-        cells[ii + jj*params.nx].speeds[4] = tmp_cells[ii + jj*params.nx].speeds[2];
-        cells[ii + jj*params.nx].speeds[5] = tmp_cells[ii + jj*params.nx].speeds[7];
-        cells[ii + jj*params.nx].speeds[6] = tmp_cells[ii + jj*params.nx].speeds[8];
-        cells[ii + jj*params.nx].speeds[7] = tmp_cells[ii + jj*params.nx].speeds[5];
-        cells[ii + jj*params.nx].speeds[8] = tmp_cells[ii + jj*params.nx].speeds[6];
-      }
-    }
-  }
+  /*
+  ** free up allocated memory
+  */
+
+  d2q9_destroy(*ctx_ptr);
+  *ctx_ptr = NULL;
+
+  free(*obstacles_ptr);
+  *obstacles_ptr = NULL;
+
+  free(*av_vels_ptr);
+  *av_vels_ptr = NULL;
 
   return EXIT_SUCCESS;
 }
 
-int collision(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+int write_values(const t_param params, float** grid, int* obstacles, float* av_vels,
+                 const char* final_state_file, const char* av_vels_file)
 {
-  const float c_sq = 1.f / 3.f; /* square of speed of sound */
-  const float w0 = 4.f / 9.f;  /* weighting factor */
-  const float w1 = 1.f / 9.f;  /* weighting factor */
-  const float w2 = 1.f / 36.f; /* weighting factor */
+  FILE* fp;                     /* file pointer */
+  const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
+  float local_density;         /* per grid cell sum of densities */
+  float pressure;              /* fluid pressure in grid cell */
+  float u_x;                   /* x-component of velocity in grid cell */
+  float u_y;                   /* y-component of velocity in grid cell */
+  float u;                     /* norm--root of summed squares--of u_x and u_y */
+
+  fp = fopen(final_state_file, "w");
+
+  if (fp == NULL)
+  {
+    die("could not open file output file", __LINE__, __FILE__);
+  }
 
-  /* loop over the cells in the grid
-  ** NB the collision step is called after
-  ** the propagate step and so values of interest
-  ** are in the scratch-space grid */
   for (int jj = 0; jj < params.ny; jj++)
   {
     for (int ii = 0; ii < params.nx; ii++)
     {
-      /* don't consider occupied cells */
-      if (!obstacles[ii + jj*params.nx])
+      /* an occupied cell */
+      if (obstacles[ii + jj*params.nx])
+      {
+        u_x = u_y = u = 0.f;
+        pressure = params.density * c_sq;
+      }
+      /* no obstacle */
+      else
       {
-        /* compute local density total */
-        float local_density = 0.f;
+        local_density = 0.f;
 
         for (int kk = 0; kk < NSPEEDS; kk++)
         {
-          local_density += tmp_cells[ii + jj*params.nx].speeds[kk];
+          local_density += grid[kk][ii + jj*params.nx];
         }
 
         /* compute x velocity component */
-        float u_x = (tmp_cells[ii + jj*params.nx].speeds[1]
-                      + tmp_cells[ii + jj*params.nx].speeds[5]
-                      + tmp_cells[ii + jj*params.nx].speeds[8]
-                      - (tmp_cells[ii + jj*params.nx].speeds[3]
-                         + tmp_cells[ii + jj*params.nx].speeds[6]
-                         + tmp_cells[ii + jj*params.nx].speeds[7]))
-                     / local_density;
+        u_x = (grid[1][ii + jj*params.nx]
+               + grid[5][ii + jj*params.nx]
+               + grid[8][ii + jj*params.nx]
+               - (grid[3][ii + jj*params.nx]
+                  + grid[6][ii + jj*params.nx]
+                  + grid[7][ii + jj*params.nx]))
+              / local_density;
         /* compute y velocity component */
-        float u_y = (tmp_cells[ii + jj*params.nx].speeds[2]
-                      + tmp_cells[ii + jj*params.nx].speeds[5]
-                      + tmp_cells[ii + jj*params.nx].speeds[6]
-                      - (tmp_cells[ii + jj*params.nx].speeds[4]
-                         + tmp_cells[ii + jj*params.nx].speeds[7]
-                         + tmp_cells[ii + jj*params.nx].speeds[8]))
-                     / local_density;
-
-        /* velocity squared */
-        float u_sq = u_x * u_x + u_y * u_y;
-
-        /* directional velocity components */
-        float u[NSPEEDS];
-        u[1] =   u_x;        /* east */
-        u[2] =         u_y;  /* north */
-        u[3] = - u_x;        /* west */
-        u[4] =       - u_y;  /* south */
-        u[5] =   u_x + u_y;  /* north-east */
-        u[6] = - u_x + u_y;  /* north-west */
-        u[7] = - u_x - u_y;  /* south-west */
-        u[8] =   u_x - u_y;  /* south-east */
-
-        /* equilibrium densities */
-        float d_equ[NSPEEDS];
-        /* zero velocity density: weight w0 */
-        d_equ[0] = w0 * local_density
-                   * (1.f - u_sq / (2.f * c_sq));
-        /* axis speeds: weight w1 */
-        d_equ[1] = w1 * local_density * (1.f + u[1] / c_sq
-                                         + (u[1] * u[1]) / (2.f * c_sq * c_sq)
-                                         - u_sq / (2.f * c_sq));
-        d_equ[2] = w1 * local_density * (1.f + u[2] / c_sq
-                                         + (u[2] * u[2]) / (2.f * c_sq * c_sq)
-                                         - u_sq / (2.f * c_sq));
-        d_equ[3] = w1 * local_density * (1.f + u[3] / c_sq
-                                         + (u[3] * u[3]) / (2.f * c_sq * c_sq)
-                                         - u_sq / (2.f * c_sq));
-        d_equ[4] = w1 * local_density * (1.f + u[4] / c_sq
-                                         + (u[4] * u[4]) / (2.f * c_sq * c_sq)
-                                         - u_sq / (2.f * c_sq));
-        /* diagonal speeds: weight w2 */
-        d_equ[5] = w2 * local_density * (1.f + u[5] / c_sq
-                                         + (u[5] * u[5]) / (2.f * c_sq * c_sq)
-                                         - u_sq / (2.f * c_sq));
-        d_equ[6] = w2 * local_density * (1.f + u[6] / c_sq
-                                         + (u[6] * u[6]) / (2.f * c_sq * c_sq)
-                                         - u_sq / (2.f * c_sq));
-        d_equ[7] = w2 * local_density * (1.f + u[7] / c_sq
-                                         + (u[7] * u[7]) / (2.f * c_sq * c_sq)
-                                         - u_sq / (2.f * c_sq));
-        d_equ[8] = w2 * local_density * (1.f + u[8] / c_sq
-                                         + (u[8] * u[8]) / (2.f * c_sq * c_sq)
-                                         - u_sq / (2.f * c_sq));
-
-        /* relaxation step */
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
-          cells[ii + jj*params.nx].speeds[kk] = tmp_cells[ii + jj*params.nx].speeds[kk]
-                                                  + params.omega
-                                                  * (d_equ[kk] - tmp_cells[ii + jj*params.nx].speeds[kk]);
-        }
+        u_y = (grid[2][ii + jj*params.nx]
+               + grid[5][ii + jj*params.nx]
+               + grid[6][ii + jj*params.nx]
+               - (grid[4][ii + jj*params.nx]
+                  + grid[7][ii + jj*params.nx]
+                  + grid[8][ii + jj*params.nx]))
+              / local_density;
+        /* compute norm of velocity */
+        u = sqrtf((u_x * u_x) + (u_y * u_y));
+        /* compute pressure */
+        pressure = local_density * c_sq;
       }
+
+      /* write to file */
+      fprintf(fp, "%d %d %.12E %.12E %.12E %.12E %d\n", ii, jj, u_x, u_y, u, pressure, obstacles[ii * params.nx + jj]);
     }
   }
 
+  fclose(fp);
+
+  if (av_vels == NULL) return EXIT_SUCCESS;
+
+  fp = fopen(av_vels_file, "w");
+
+  if (fp == NULL)
+  {
+    die("could not open file output file", __LINE__, __FILE__);
+  }
+
+  for (int ii = 0; ii < params.maxIters; ii++)
+  {
+    fprintf(fp, "%d:\t%.12E\n", ii, av_vels[ii]);
+  }
+
+  fclose(fp);
 
   return EXIT_SUCCESS;
 }
 
-float av_velocity(const t_param params, int* obstacles,float** grid)
+int load_sweep(const char* sweepfile, const t_param base, t_sweep* sweep)
 {
-  int    tot_cells = 0;  /* no. of cells used in calculation */
-  float tot_u;          /* accumulated magnitudes of velocity for each cell */
+  char  line[1024];
+  char  message[1024];
+  FILE* fp;
+  int   lineno = 0;
 
-  /* initialise */
-  tot_u = 0.f;
+  memset(sweep, 0, sizeof(t_sweep));
+  fp = fopen(sweepfile, "r");
 
-  /* loop over all non-blocked cells */
-  for (int jj = 0; jj < params.ny; jj++)
+  if (fp == NULL)
   {
-    for (int ii = 0; ii < params.nx; ii++)
+    sprintf(message, "could not open sweep file: %s", sweepfile);
+    die(message, __LINE__, __FILE__);
+  }
+
+  /* one case per line as key=value overrides of the parameter file, '#' starts a comment */
+  while (fgets(line, sizeof(line), fp) != NULL)
+  {
+    t_param params = base;
+    char*   hash = strchr(line, '#');
+    char*   tok;
+    int     ntok = 0;
+
+    lineno++;
+    if (hash != NULL) *hash = '\0';
+
+    for (tok = strtok(line, " \t\r\n"); tok != NULL; tok = strtok(NULL, " \t\r\n"), ntok++)
     {
-      /* ignore occupied cells */
-      if (!obstacles[ii + jj*params.nx])
-      {
-        /* local density total */
-        float local_density = 0.f;
+      if (sscanf(tok, "omega=%f", &params.omega) == 1) continue;
+      if (sscanf(tok, "accel=%f", &params.accel) == 1) continue;
+      if (sscanf(tok, "density=%f", &params.density) == 1) continue;
+      if (sscanf(tok, "maxIters=%d", &params.maxIters) == 1) continue;
+      if (sscanf(tok, "reynolds_dim=%d", &params.reynolds_dim) == 1) continue;
+
+      sprintf(message, "sweep file line %d: expected omega=, accel=, density=, maxIters= or reynolds_dim=, got '%.900s'", lineno, tok);
+      die(message, __LINE__, __FILE__);
+    }
 
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
+    if (ntok == 0) continue;
 
-          local_density += grid[kk][ii + jj*params.nx];
-        }
+    if (params.maxIters < 1) die("sweep case needs maxIters of at least 1", __LINE__, __FILE__);
 
+    sweep->cases = (t_case*)realloc(sweep->cases, sizeof(t_case) * (sweep->ncases + 1));
 
+    if (sweep->cases == NULL) die("cannot allocate memory for sweep cases", __LINE__, __FILE__);
 
-       /* x-component of velocity */
-       float u_x = (grid[1][ii + jj*params.nx]
-                     + grid[5][ii + jj*params.nx]
-                     + grid[8][ii + jj*params.nx]
-                     - (grid[3][ii + jj*params.nx]
-                        + grid[6][ii + jj*params.nx]
-                        + grid[7][ii + jj*params.nx]))
-                    / local_density;
-
-       /* compute y velocity component */
-       float u_y = (grid[2][ii + jj*params.nx]
-                     + grid[5][ii + jj*params.nx]
-                     + grid[6][ii + jj*params.nx]
-                     - (grid[4][ii + jj*params.nx]
-                        + grid[7][ii + jj*params.nx]
-                        + grid[8][ii + jj*params.nx]))
-                    / local_density;
-        /* accumulate the norm of x- and y- velocity components */
-        tot_u += sqrtf((u_x * u_x) + (u_y * u_y));
-        /* increase counter of inspected cells */
-        ++tot_cells;
-      }
-    }
+    memset(&sweep->cases[sweep->ncases], 0, sizeof(t_case));
+    sweep->cases[sweep->ncases].params = params;
+    if (params.maxIters > sweep->max_iters) sweep->max_iters = params.maxIters;
+    sweep->ncases++;
   }
 
-  return tot_u / (float)tot_cells;
-}
-void swap( t_speed **A, t_speed **B){
-    t_speed*temp = *A;
-    *A = *B;
-    *B = temp;
+  fclose(fp);
+
+  if (sweep->ncases == 0) die("sweep file has no cases", __LINE__, __FILE__);
+
+  return EXIT_SUCCESS;
 }
-// void swap(t_speed *x,t_speed *y)
-// {
-//     t_speed t;
-//      t   = *x;
-//     *x   = *y;
-//     *y   =  t;
-// }
-float fushion(const t_param params,  int* obstacles,float** restrict grid ,float** restrict tmp_grid ,float** restrict o_grid )
+
+int run_case(const int index, t_case* job, t_sweeper* worker)
 {
-  //CONSTS FROM COLLISION
-  const float c_sq = 1.f / 3.f; /* square of speed of sound */
-  const float w0 = 4.f / 9.f;  /* weighting factor */
-  const float w1 = 1.f / 9.f;  /* weighting factor */
-  const float w2 = 1.f / 36.f; /* weighting factor */
+  const t_param params = job->params;
+  char   final_state_file[64];
+  char   av_vels_file[64];
+  double tic = wtime();
+  int    status;
 
-  #pragma omp simd
-  /* loop over _all_ cells */
-  for (int jj = 0; jj < params.ny; jj++)
-  {
-    for (int ii = 0; ii < params.nx; ii++)
-    {
-      //PROPAGATE
-      /* determine indices of axis-direction neighbours
-      ** respecting periodic boundary conditions (wrap around) */
-      int y_n = (jj + 1) % params.ny;
-      int x_e = (ii + 1) % params.nx;
-      int y_s = (jj == 0) ? (jj + params.ny - 1) : (jj - 1);
-      int x_w = (ii == 0) ? (ii + params.nx - 1) : (ii - 1);
-      /* propagate densities from neighbouring cells, following
-      ** appropriate directions of travel and writing into
-      ** scratch space grid */
-
-
-      tmp_grid[0][ii + jj*params.nx] = grid[0][ii + jj*params.nx]; /* central cell, no movement */
-      tmp_grid[1][ii + jj*params.nx] = grid[1][x_w + jj*params.nx]; /* east */
-      tmp_grid[2][ii + jj*params.nx] = grid[2][ii + y_s*params.nx]; /* north */
-      tmp_grid[3][ii + jj*params.nx] = grid[3][x_e + jj*params.nx]; /* west */
-      tmp_grid[4][ii + jj*params.nx] = grid[4][ii + y_n*params.nx]; /* south */
-      tmp_grid[5][ii + jj*params.nx] = grid[5][x_w + y_s*params.nx]; /* north-east */
-      tmp_grid[6][ii + jj*params.nx] = grid[6][x_e + y_s*params.nx]; /* north-west */
-      tmp_grid[7][ii + jj*params.nx] = grid[7][x_e + y_n*params.nx]; /* south-west */
-      tmp_grid[8][ii + jj*params.nx] = grid[8][x_w + y_n*params.nx]; /* south-east */
-    // }}
-    //
-    //   for (int jj = 0; jj < params.ny; jj++)
-    //   {
-    //     for (int ii = 0; ii < params.nx; ii++)
-    //     {
-
-      //REBOUND
-      /* if the cell contains an obstacle */
-      if (obstacles[jj*params.nx + ii])
-      {
-        /* called after propagate, so taking values from scratch space
-        ** mirroring, and writing into main grid */
+  status = d2q9_reset(worker->ctx, &params);
 
-        o_grid[0][ii + jj*params.nx]= tmp_grid[0][ii + jj*params.nx];//move the centre cell in
+  if (status != D2Q9_OK) die(d2q9_strerror(status), __LINE__, __FILE__);
 
-        o_grid[1][ii + jj*params.nx] = tmp_grid[3][ii + jj*params.nx];
-        o_grid[2][ii + jj*params.nx] = tmp_grid[4][ii + jj*params.nx];
-        o_grid[3][ii + jj*params.nx] = tmp_grid[1][ii + jj*params.nx];
-        o_grid[4][ii + jj*params.nx] = tmp_grid[2][ii + jj*params.nx];
-        o_grid[5][ii + jj*params.nx] = tmp_grid[7][ii + jj*params.nx];
-        o_grid[6][ii + jj*params.nx] = tmp_grid[8][ii + jj*params.nx];
-        o_grid[7][ii + jj*params.nx] = tmp_grid[5][ii + jj*params.nx];
-        o_grid[8][ii + jj*params.nx] = tmp_grid[6][ii + jj*params.nx];
+  d2q9_step(worker->ctx, params.maxIters, worker->av_vels);
 
+  job->elapsed  = wtime() - tic;
+  job->reynolds = d2q9_reynolds(worker->ctx);
 
+  sprintf(final_state_file, SWEEPFINALSTATEFILE, index);
+  sprintf(av_vels_file, SWEEPAVVELSFILE, index);
+  write_values(params, d2q9_speeds(worker->ctx), worker->sweep->obstacles, worker->av_vels,
+               final_state_file, av_vels_file);
 
+  return EXIT_SUCCESS;
+}
 
-      }
+void* sweep_main(void* arg)
+{
+  t_sweeper* worker = (t_sweeper*)arg;
+  t_sweep*   sweep = worker->sweep;
 
+  for (;;)
+  {
+    int index;
+    int count = 1;
 
-      //COLLISION
-      /* don't consider occupied cells */
-      if (!obstacles[ii + jj*params.nx])
+    /* an ensemble batch is consecutive cases with the same no. of iterations */
+    pthread_mutex_lock(&sweep->lock);
+    index = sweep->next;
+    if (sweep->ensemble)
+    {
+      while (index + count < sweep->ncases && count < ENSEMBLE_WIDTH
+             && sweep->cases[index + count].params.maxIters == sweep->cases[index].params.maxIters)
+      {
+        count++;
+      }
+    }
+    sweep->next += count;
+    pthread_mutex_unlock(&sweep->lock);
+
+    if (index >= sweep->ncases) break;
+
+    if (sweep->ensemble)
+    {
+      run_ensemble(index, count, sweep, worker);
+    }
+    else
+    {
+      run_case(index, &sweep->cases[index], worker);
+    }
+  }
+
+  /* the ensemble lattices only live as long as the sweep */
+  if (worker->e_grid != NULL)
+  {
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      free(worker->e_grid[kk]);
+      free(worker->e_o_grid[kk]);
+    }
+    free(worker->e_grid);
+    free(worker->e_o_grid);
+    free(worker->e_av_vels);
+    worker->e_grid = worker->e_o_grid = NULL;
+  }
+
+  return NULL;
+}
+
+int run_ensemble(const int first, const int count, t_sweep* sweep, t_sweeper* worker)
+{
+  const t_param params = sweep->cases[first].params;
+  const size_t  ncells = (size_t)params.nx * params.ny;
+  const int     W = ENSEMBLE_WIDTH;
+  t_ensemble    e;
+  double        tic = wtime();
+
+  if (worker->e_grid == NULL)
+  {
+    worker->e_grid    = (float**)malloc(sizeof(float*) * NSPEEDS);
+    worker->e_o_grid  = (float**)malloc(sizeof(float*) * NSPEEDS);
+    worker->e_av_vels = (float*)malloc(sizeof(float) * W * sweep->max_iters);
+
+    if (worker->e_grid == NULL || worker->e_o_grid == NULL || worker->e_av_vels == NULL)
+    {
+      die("cannot allocate memory for ensemble", __LINE__, __FILE__);
+    }
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      worker->e_grid[kk]   = (float*)aligned_alloc(64, sizeof(float) * W * ncells);
+      worker->e_o_grid[kk] = (float*)aligned_alloc(64, sizeof(float) * W * ncells);
+
+      if (worker->e_grid[kk] == NULL || worker->e_o_grid[kk] == NULL)
+      {
+        die("cannot allocate memory for ensemble", __LINE__, __FILE__);
+      }
+    }
+  }
+
+  /* spare lanes repeat the last case, so every lane does valid arithmetic */
+  memset(&e, 0, sizeof(t_ensemble));
+  e.params = params;
+  e.nlanes = count;
+
+  for (int ll = 0; ll < W; ll++)
+  {
+    const t_param p = sweep->cases[first + ((ll < count) ? ll : count - 1)].params;
+    e.omega[ll]    = p.omega;
+    e.density[ll]  = p.density;
+    e.accel_w1[ll] = p.density * p.accel / 9.f;
+    e.accel_w2[ll] = p.density * p.accel / 36.f;
+  }
+
+  /* same initial densities as init_grid(), per lane */
+  for (size_t ii = 0; ii < ncells; ii++)
+  {
+    for (int ll = 0; ll < W; ll++)
+    {
+      worker->e_grid[0][ii*W + ll] = e.density[ll] * 4.f / 9.f;
+      for (int kk = 1; kk < 5; kk++) worker->e_grid[kk][ii*W + ll] = e.density[ll] / 9.f;
+      for (int kk = 5; kk < NSPEEDS; kk++) worker->e_grid[kk][ii*W + ll] = e.density[ll] / 36.f;
+    }
+  }
+
+  for (int tt = 0; tt < params.maxIters; tt++)
+  {
+    float** swap_grid;
+
+    ensemble_accelerate(&e, sweep->obstacles, worker->e_grid);
+    ensemble_fushion(&e, sweep->obstacles, worker->e_grid, worker->e_o_grid);
+
+    /* every cell of o_grid is written, so the grids can simply trade places */
+    swap_grid = worker->e_grid;
+    worker->e_grid = worker->e_o_grid;
+    worker->e_o_grid = swap_grid;
+
+    ensemble_av_velocity(&e, sweep->obstacles, worker->e_grid, worker->e_av_vels + (size_t)tt * W);
+  }
+
+  /* pull each lane back out into the worker's own lattice to reuse the usual output code */
+  for (int ll = 0; ll < count; ll++)
+  {
+    t_case*   job = &sweep->cases[first + ll];
+    float**   grid = d2q9_speeds(worker->ctx);
+    char      final_state_file[64];
+    char      av_vels_file[64];
+    int       status;
+
+    /* for the lane's parameters, which d2q9_reynolds() uses; the planes are overwritten */
+    status = d2q9_reset(worker->ctx, &job->params);
+
+    if (status != D2Q9_OK) die(d2q9_strerror(status), __LINE__, __FILE__);
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      for (size_t ii = 0; ii < ncells; ii++)
+      {
+        grid[kk][ii] = worker->e_grid[kk][ii*W + ll];
+      }
+    }
+
+    for (int tt = 0; tt < params.maxIters; tt++)
+    {
+      worker->av_vels[tt] = worker->e_av_vels[(size_t)tt * W + ll];
+    }
+
+    job->elapsed  = wtime() - tic;
+    job->reynolds = d2q9_reynolds(worker->ctx);
+
+    sprintf(final_state_file, SWEEPFINALSTATEFILE, first + ll);
+    sprintf(av_vels_file, SWEEPAVVELSFILE, first + ll);
+    write_values(job->params, grid, sweep->obstacles, worker->av_vels, final_state_file, av_vels_file);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int ensemble_accelerate(const t_ensemble* e, int* obstacles, float** restrict grid)
+{
+  const int W = ENSEMBLE_WIDTH;
+  const int nx = e->params.nx;
+
+  /* modify the 2nd row of the grid */
+  int jj = e->params.ny - 2;
+
+  for (int ii = 0; ii < nx; ii++)
+  {
+    /* the obstacle test is the same for every lane */
+    if (obstacles[ii + jj*nx]) continue;
+
+    float* restrict g1 = grid[1] + (size_t)(ii + jj*nx) * W;
+    float* restrict g3 = grid[3] + (size_t)(ii + jj*nx) * W;
+    float* restrict g5 = grid[5] + (size_t)(ii + jj*nx) * W;
+    float* restrict g6 = grid[6] + (size_t)(ii + jj*nx) * W;
+    float* restrict g7 = grid[7] + (size_t)(ii + jj*nx) * W;
+    float* restrict g8 = grid[8] + (size_t)(ii + jj*nx) * W;
+
+    /* the negative density test differs per lane, so select rather than branch */
+    for (int ll = 0; ll < W; ll++)
+    {
+      const int   ok = ((g3[ll] - e->accel_w1[ll]) > 0.f)
+                       & ((g6[ll] - e->accel_w2[ll]) > 0.f)
+                       & ((g7[ll] - e->accel_w2[ll]) > 0.f);
+      const float w1 = ok ? e->accel_w1[ll] : 0.f;
+      const float w2 = ok ? e->accel_w2[ll] : 0.f;
+
+      g1[ll] += w1;
+      g5[ll] += w2;
+      g8[ll] += w2;
+      g3[ll] -= w1;
+      g6[ll] -= w2;
+      g7[ll] -= w2;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int ensemble_fushion(const t_ensemble* e, int* obstacles, float** restrict grid, float** restrict o_grid)
+{
+  const float c_sq = 1.f / 3.f; /* square of speed of sound */
+  const float w0 = 4.f / 9.f;  /* weighting factor */
+  const float w1 = 1.f / 9.f;  /* weighting factor */
+  const float w2 = 1.f / 36.f; /* weighting factor */
+  const int   W = ENSEMBLE_WIDTH;
+  const int   nx = e->params.nx;
+  const int   ny = e->params.ny;
+
+  for (int jj = 0; jj < ny; jj++)
+  {
+    for (int ii = 0; ii < nx; ii++)
+    {
+      /* neighbours with periodic wrap, as in fushion() */
+      const int y_n = (jj + 1) % ny;
+      const int x_e = (ii + 1) % nx;
+      const int y_s = (jj == 0) ? (jj + ny - 1) : (jj - 1);
+      const int x_w = (ii == 0) ? (ii + nx - 1) : (ii - 1);
+
+      /* pull the lanes of every speed into locals, which nothing else can alias */
+      float f[NSPEEDS][ENSEMBLE_WIDTH];
+      memcpy(f[0], grid[0] + (size_t)(ii  + jj*nx)  * W, sizeof(f[0]));
+      memcpy(f[1], grid[1] + (size_t)(x_w + jj*nx)  * W, sizeof(f[0]));
+      memcpy(f[2], grid[2] + (size_t)(ii  + y_s*nx) * W, sizeof(f[0]));
+      memcpy(f[3], grid[3] + (size_t)(x_e + jj*nx)  * W, sizeof(f[0]));
+      memcpy(f[4], grid[4] + (size_t)(ii  + y_n*nx) * W, sizeof(f[0]));
+      memcpy(f[5], grid[5] + (size_t)(x_w + y_s*nx) * W, sizeof(f[0]));
+      memcpy(f[6], grid[6] + (size_t)(x_e + y_s*nx) * W, sizeof(f[0]));
+      memcpy(f[7], grid[7] + (size_t)(x_e + y_n*nx) * W, sizeof(f[0]));
+      memcpy(f[8], grid[8] + (size_t)(x_w + y_n*nx) * W, sizeof(f[0]));
+
+      const size_t c = (size_t)(ii + jj*nx) * W;
+
+      if (obstacles[ii + jj*nx])
+      {
+        /* rebound, for all lanes at once */
+        memcpy(o_grid[0] + c, f[0], sizeof(f[0]));
+        memcpy(o_grid[1] + c, f[3], sizeof(f[0]));
+        memcpy(o_grid[2] + c, f[4], sizeof(f[0]));
+        memcpy(o_grid[3] + c, f[1], sizeof(f[0]));
+        memcpy(o_grid[4] + c, f[2], sizeof(f[0]));
+        memcpy(o_grid[5] + c, f[7], sizeof(f[0]));
+        memcpy(o_grid[6] + c, f[8], sizeof(f[0]));
+        memcpy(o_grid[7] + c, f[5], sizeof(f[0]));
+        memcpy(o_grid[8] + c, f[6], sizeof(f[0]));
+        continue;
+      }
+
+      /* collide; the arithmetic matches fushion() term for term */
+      float out[NSPEEDS][ENSEMBLE_WIDTH];
+      for (int ll = 0; ll < W; ll++)
+      {
+        const float t0 = f[0][ll], t1 = f[1][ll], t2 = f[2][ll];
+        const float t3 = f[3][ll], t4 = f[4][ll], t5 = f[5][ll];
+        const float t6 = f[6][ll], t7 = f[7][ll], t8 = f[8][ll];
+
+        const float local_density = 0.f + t0 + t1 + t2 + t3 + t4 + t5 + t6 + t7 + t8;
+
+        const float u_x = (t1 + t5 + t8 - (t3 + t6 + t7)) / local_density;
+        const float u_y = (t2 + t5 + t6 - (t4 + t7 + t8)) / local_density;
+        const float u_sq = u_x * u_x + u_y * u_y;
+
+        const float u1 =   u_x;        /* east */
+        const float u2 =         u_y;  /* north */
+        const float u3 = - u_x;        /* west */
+        const float u4 =       - u_y;  /* south */
+        const float u5 =   u_x + u_y;  /* north-east */
+        const float u6 = - u_x + u_y;  /* north-west */
+        const float u7 = - u_x - u_y;  /* south-west */
+        const float u8 =   u_x - u_y;  /* south-east */
+
+        const float e0 = w0 * local_density * (1.f - u_sq / (2.f * c_sq));
+        const float e1 = w1 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u1)+(u1*u1)-(u_sq*c_sq))/(2.f*c_sq*c_sq);
+        const float e2 = w1 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u2)+(u2*u2)-(u_sq*c_sq))/(2.f*c_sq*c_sq);
+        const float e3 = w1 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u3)+(u3*u3)-(u_sq*c_sq))/(2.f*c_sq*c_sq);
+        const float e4 = w1 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u4)+(u4*u4)-(u_sq*c_sq))/(2.f*c_sq*c_sq);
+        const float e5 = w2 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u5)+(u5*u5)-(u_sq*c_sq))/(2.f*c_sq*c_sq);
+        const float e6 = w2 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u6)+(u6*u6)-(u_sq*c_sq))/(2.f*c_sq*c_sq);
+        const float e7 = w2 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u7)+(u7*u7)-(u_sq*c_sq))/(2.f*c_sq*c_sq);
+        const float e8 = w2 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u8)+(u8*u8)-(u_sq*c_sq))/(2.f*c_sq*c_sq);
+
+        const float omega = e->omega[ll];
+        out[0][ll] = t0 + omega * (e0 - t0);
+        out[1][ll] = t1 + omega * (e1 - t1);
+        out[2][ll] = t2 + omega * (e2 - t2);
+        out[3][ll] = t3 + omega * (e3 - t3);
+        out[4][ll] = t4 + omega * (e4 - t4);
+        out[5][ll] = t5 + omega * (e5 - t5);
+        out[6][ll] = t6 + omega * (e6 - t6);
+        out[7][ll] = t7 + omega * (e7 - t7);
+        out[8][ll] = t8 + omega * (e8 - t8);
+      }
+
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        memcpy(o_grid[kk] + c, out[kk], sizeof(out[0]));
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int ensemble_av_velocity(const t_ensemble* e, int* obstacles, float** grid, float* av_vels)
+{
+  const int W = ENSEMBLE_WIDTH;
+  const size_t ncells = (size_t)e->params.nx * e->params.ny;
+  int   tot_cells = 0;
+  float tot_u[ENSEMBLE_WIDTH];
+
+  for (int ll = 0; ll < W; ll++) tot_u[ll] = 0.f;
+
+  /* cells in the same order as av_velocity(), so each lane sums identically */
+  for (size_t ii = 0; ii < ncells; ii++)
+  {
+    if (obstacles[ii]) continue;
+
+    float f[NSPEEDS][ENSEMBLE_WIDTH];
+    for (int kk = 0; kk < NSPEEDS; kk++) memcpy(f[kk], grid[kk] + ii*W, sizeof(f[0]));
+
+    for (int ll = 0; ll < W; ll++)
+    {
+      const float local_density = 0.f + f[0][ll] + f[1][ll] + f[2][ll] + f[3][ll] + f[4][ll]
+                                  + f[5][ll] + f[6][ll] + f[7][ll] + f[8][ll];
+
+      const float u_x = (f[1][ll] + f[5][ll] + f[8][ll] - (f[3][ll] + f[6][ll] + f[7][ll])) / local_density;
+      const float u_y = (f[2][ll] + f[5][ll] + f[6][ll] - (f[4][ll] + f[7][ll] + f[8][ll])) / local_density;
+
+      tot_u[ll] += sqrtf((u_x * u_x) + (u_y * u_y));
+    }
+
+    ++tot_cells;
+  }
+
+  for (int ll = 0; ll < W; ll++) av_vels[ll] = tot_u[ll] / (float)tot_cells;
+
+  return EXIT_SUCCESS;
+}
+
+int run_sweep(const t_opts opts, t_sweep* sweep, d2q9_ctx* ctx, float** av_vels_ptr)
+{
+  int nworkers = (opts.sweep_jobs > 0) ? opts.sweep_jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  t_sweeper* workers;
+  double tic = wtime();
+
+  if (nworkers > sweep->ncases) nworkers = sweep->ncases;
+  if (nworkers < 1) nworkers = 1;
+
+  workers = (t_sweeper*)calloc(nworkers, sizeof(t_sweeper));
+
+  if (workers == NULL) die("cannot allocate memory for sweep workers", __LINE__, __FILE__);
+
+  pthread_mutex_init(&sweep->lock, NULL);
+
+  /* the main thread works too, with the lattice and av_vels initialise() already allocated */
+  *av_vels_ptr = (float*)realloc(*av_vels_ptr, sizeof(float) * sweep->max_iters);
+
+  if (*av_vels_ptr == NULL) die("cannot allocate memory for av_vels", __LINE__, __FILE__);
+
+  for (int ww = 0; ww < nworkers; ww++)
+  {
+    workers[ww].sweep = sweep;
+
+    if (ww == 0)
+    {
+      workers[ww].ctx     = ctx;
+      workers[ww].av_vels = *av_vels_ptr;
+      continue;
+    }
+
+    if (d2q9_create(d2q9_get_params(ctx), sweep->obstacles, &workers[ww].ctx) != D2Q9_OK)
+    {
+      die("cannot allocate a lattice for a sweep worker", __LINE__, __FILE__);
+    }
+
+    workers[ww].av_vels = (float*)malloc(sizeof(float) * sweep->max_iters);
+
+    if (workers[ww].av_vels == NULL) die("cannot allocate memory for av_vels", __LINE__, __FILE__);
+
+    if (pthread_create(&workers[ww].thread, NULL, sweep_main, &workers[ww]) != 0)
+    {
+      die("could not start sweep worker", __LINE__, __FILE__);
+    }
+  }
+
+  sweep_main(&workers[0]);
+
+  for (int ww = 1; ww < nworkers; ww++)
+  {
+    pthread_join(workers[ww].thread, NULL);
+    d2q9_destroy(workers[ww].ctx);
+    free(workers[ww].av_vels);
+  }
+
+  printf("==done==\n");
+
+  for (int cc = 0; cc < sweep->ncases; cc++)
+  {
+    const t_param p = sweep->cases[cc].params;
+    printf("Case %3d: omega %g accel %g density %g maxIters %d\tReynolds number: %.12E\t(%.6lf s)\n",
+           cc, p.omega, p.accel, p.density, p.maxIters, sweep->cases[cc].reynolds, sweep->cases[cc].elapsed);
+  }
+
+  printf("Sweep workers:\t\t\t\t%d\n", nworkers);
+  if (sweep->ensemble) printf("Ensemble width:\t\t\t\t%d\n", ENSEMBLE_WIDTH);
+  printf("Elapsed Sweep time:\t\t\t%.6lf (s)\n", wtime() - tic);
+
+  pthread_mutex_destroy(&sweep->lock);
+  free(workers);
+  free(sweep->cases);
+
+  return EXIT_SUCCESS;
+}
+
+int writer_start(t_writer* writer, const t_param params, const t_opts opts, const int* obstacles)
+{
+  memset(writer, 0, sizeof(t_writer));
+  writer->params    = params;
+  writer->opts      = opts;
+  writer->obstacles = obstacles;
+
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->cond, NULL);
+
+  if (pthread_create(&writer->thread, NULL, writer_main, writer) != 0)
+  {
+    die("could not start writer thread", __LINE__, __FILE__);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+t_slot* writer_acquire(t_writer* writer, size_t nfloats)
+{
+  t_slot* slot = &writer->slots[writer->fill];
+
+  /* only blocks if the writer is still busy with the job before last */
+  pthread_mutex_lock(&writer->lock);
+  if (writer->full[writer->fill])
+  {
+    double tic = wtime();
+    while (writer->full[writer->fill]) pthread_cond_wait(&writer->cond, &writer->lock);
+    writer->stall += wtime() - tic;
+  }
+  pthread_mutex_unlock(&writer->lock);
+
+  /* the staging buffer is allocated on first use and then reused */
+  if (nfloats > slot->capacity)
+  {
+    free(slot->data);
+    slot->data = (float*)malloc(sizeof(float) * nfloats);
+
+    if (slot->data == NULL) die("cannot allocate writer staging buffer", __LINE__, __FILE__);
+
+    slot->capacity = nfloats;
+  }
+
+  return slot;
+}
+
+int writer_commit(t_writer* writer)
+{
+  pthread_mutex_lock(&writer->lock);
+  writer->full[writer->fill] = 1;
+  writer->fill ^= 1;
+  pthread_cond_broadcast(&writer->cond);
+  pthread_mutex_unlock(&writer->lock);
+
+  return EXIT_SUCCESS;
+}
+
+int writer_stop(t_writer* writer)
+{
+  pthread_mutex_lock(&writer->lock);
+  writer->quit = 1;
+  pthread_cond_broadcast(&writer->cond);
+  pthread_mutex_unlock(&writer->lock);
+
+  pthread_join(writer->thread, NULL);
+
+  if (writer->av_fp != NULL) fclose(writer->av_fp);
+
+  for (int i = 0; i < 2; i++)
+  {
+    free(writer->slots[i].data);
+    writer->slots[i].data = NULL;
+  }
+
+  pthread_cond_destroy(&writer->cond);
+  pthread_mutex_destroy(&writer->lock);
+
+  return EXIT_SUCCESS;
+}
+
+int queue_fields(t_writer* writer, const t_job_kind kind, const int step, const int last,
+                 const t_param params, int* obstacles, float** grid)
+{
+  t_slot* slot = writer_acquire(writer, NFIELDS * (size_t)params.nx * params.ny);
+  slot->kind = kind;
+  slot->step = step;
+  slot->last = last;
+  compute_fields(params, obstacles, grid, slot->data);
+
+  return writer_commit(writer);
+}
+
+void* writer_main(void* arg)
+{
+  t_writer* writer = (t_writer*)arg;
+
+  for (;;)
+  {
+    t_slot* slot = &writer->slots[writer->drain];
+
+    /* wait for the next job in order, leaving once everything is written */
+    pthread_mutex_lock(&writer->lock);
+    while (!writer->full[writer->drain] && !writer->quit) pthread_cond_wait(&writer->cond, &writer->lock);
+    if (!writer->full[writer->drain])
+    {
+      pthread_mutex_unlock(&writer->lock);
+      break;
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    if (slot->kind == JOB_AV_VELS)
+    {
+      if (writer->av_fp == NULL) writer->av_fp = fopen(AVVELSFILE, "w");
+
+      if (writer->av_fp == NULL) die("could not open file output file", __LINE__, __FILE__);
+
+      for (int ii = 0; ii < slot->count; ii++)
+      {
+        fprintf(writer->av_fp, "%d:\t%.12E\n", slot->first + ii, slot->values[ii]);
+      }
+      fflush(writer->av_fp);
+    }
+    else if (slot->kind == JOB_CHECKPOINT || slot->kind == JOB_SNAPSHOT)
+    {
+      char filename[64];
+
+      if (slot->kind == JOB_CHECKPOINT) sprintf(filename, CHECKPOINTFILE);
+      else sprintf(filename, SNAPSHOTFILE, slot->step + 1);
+
+      if (writer->opts.compress != COMPRESS_NONE)
+      {
+        double tic = wtime();
+        /* swap the file extension for the compressed one */
+        strcpy(strrchr(filename, '.'), ZIPSUFFIX);
+        write_compressed(writer->params, writer->opts, slot,
+                         (slot->kind == JOB_CHECKPOINT) ? NSPEEDS : NFIELDS,
+                         filename, &writer->zraw, &writer->zout);
+        writer->ztime += wtime() - tic;
+      }
+      else if (slot->kind == JOB_CHECKPOINT) write_checkpoint(writer->params, slot, filename);
+      else write_snapshot(writer->params, slot, filename);
+    }
+    else if (slot->kind == JOB_RENDER)
+    {
+      write_image(writer->params, writer->opts, writer->obstacles, slot);
+    }
+
+    /* give the slot back to the solver */
+    pthread_mutex_lock(&writer->lock);
+    writer->full[writer->drain] = 0;
+    writer->drain ^= 1;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+  }
+
+  return NULL;
+}
+
+int write_checkpoint(const t_param params, const t_slot* slot, const char* filename)
+{
+  const size_t ncells = (size_t)params.nx * params.ny;
+  const float* planes[NSPEEDS];
+  char message[1024];
+  int  status;
+
+  for (int kk = 0; kk < NSPEEDS; kk++) planes[kk] = slot->data + kk * ncells;
+
+  /* the library owns the format, and writes aside and renames */
+  status = d2q9_write_lattice(filename, params.nx, params.ny, slot->step + 1, planes);
+
+  if (status != D2Q9_OK)
+  {
+    sprintf(message, "could not write checkpoint file %.900s: %s", filename, d2q9_strerror(status));
+    die(message, __LINE__, __FILE__);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int compute_fields(const t_param params, int* obstacles, float** grid, float* fields)
+{
+  const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
+  const size_t ncells = (size_t)params.nx * params.ny;
+  float* restrict f_ux = fields;
+  float* restrict f_uy = fields + ncells;
+  float* restrict f_u  = fields + 2 * ncells;
+  float* restrict f_p  = fields + 3 * ncells;
+
+  for (size_t ii = 0; ii < ncells; ii++)
+  {
+    /* an occupied cell, matching write_values() */
+    if (obstacles[ii])
+    {
+      f_ux[ii] = f_uy[ii] = f_u[ii] = 0.f;
+      f_p[ii] = params.density * c_sq;
+    }
+    else
+    {
+      float local_density = 0.f;
+
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        local_density += grid[kk][ii];
+      }
+
+      const float u_x = (grid[1][ii] + grid[5][ii] + grid[8][ii]
+                         - (grid[3][ii] + grid[6][ii] + grid[7][ii]))
+                        / local_density;
+      const float u_y = (grid[2][ii] + grid[5][ii] + grid[6][ii]
+                         - (grid[4][ii] + grid[7][ii] + grid[8][ii]))
+                        / local_density;
+
+      f_ux[ii] = u_x;
+      f_uy[ii] = u_y;
+      f_u[ii]  = sqrtf((u_x * u_x) + (u_y * u_y));
+      f_p[ii]  = local_density * c_sq;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int warm_start(const t_param params, const t_opts opts, int* obstacles, float** grid)
+{
+  t_param   cparams = params;
+  d2q9_ctx* cctx;
+  int*      cobstacles;
+  int       steps = 0;
+  int       status;
+  char      message[1024];
+  double    tic = wtime();
+
+  if (opts.warm_start != NULL)
+  {
+    status = d2q9_lattice_info(opts.warm_start, &cparams.nx, &cparams.ny, NULL);
+
+    if (status != D2Q9_OK)
+    {
+      sprintf(message, "could not read checkpoint %.900s: %s (compressed ones need --unpack first)",
+              opts.warm_start, d2q9_strerror(status));
+      die(message, __LINE__, __FILE__);
+    }
+  }
+  else
+  {
+    if (params.nx % opts.warm_factor != 0 || params.ny % opts.warm_factor != 0)
+    {
+      die("grid dimensions must be divisible by the warm start factor", __LINE__, __FILE__);
+    }
+    cparams.nx = params.nx / opts.warm_factor;
+    cparams.ny = params.ny / opts.warm_factor;
+    /* a coarse run that has not settled is a poor start, so by default
+    ** it gets the full maxIters and relies on --converge to stop early */
+    cparams.maxIters = (opts.warm_iters > 0) ? opts.warm_iters : params.maxIters;
+  }
+
+  /* a coarse cell is solid if any fine cell under it is */
+  cobstacles = (int*)calloc((size_t)cparams.nx * cparams.ny, sizeof(int));
+  if (cobstacles == NULL) die("cannot allocate memory for coarse obstacles", __LINE__, __FILE__);
+
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      if (obstacles[ii + jj*params.nx])
+      {
+        cobstacles[(int)((long)ii * cparams.nx / params.nx) + (int)((long)jj * cparams.ny / params.ny) * cparams.nx] = 1;
+      }
+    }
+  }
+
+  status = d2q9_create(&cparams, cobstacles, &cctx);
+
+  if (status != D2Q9_OK) die(d2q9_strerror(status), __LINE__, __FILE__);
+
+  if (opts.warm_start != NULL)
+  {
+    status = d2q9_restore(cctx, opts.warm_start);
+
+    if (status != D2Q9_OK) die(d2q9_strerror(status), __LINE__, __FILE__);
+
+    steps = d2q9_steps_done(cctx);
+  }
+  else
+  {
+    float*     cav_vels = (float*)malloc(sizeof(float) * cparams.maxIters);
+    t_converge conv;
+
+    if (cav_vels == NULL) die("cannot allocate memory for coarse av_vels", __LINE__, __FILE__);
+
+    memset(&conv, 0, sizeof(t_converge));
+
+    /* the coarse run stops on the same steady-state test as the fine one */
+    for (steps = 0; steps < cparams.maxIters; )
+    {
+      d2q9_step(cctx, 1, &cav_vels[steps]);
+      steps++;
+
+      if ((opts.converge_tol > 0.f || opts.converge_l2 > 0.f)
+          && converged(cparams, opts, cobstacles, d2q9_speeds(cctx), cav_vels, steps - 1, &conv)) break;
+    }
+
+    free(conv.u_prev);
+    free(cav_vels);
+  }
+
+  interpolate_grid(cparams, cobstacles, d2q9_speeds(cctx), params, obstacles, grid);
+
+  printf("Warm start:\t\t\t\t%dx%d %s, %d steps (%.6lf s)\n", cparams.nx, cparams.ny,
+         (opts.warm_start != NULL) ? opts.warm_start : "coarse run", steps, wtime() - tic);
+
+  d2q9_destroy(cctx);
+  free(cobstacles);
+
+  return EXIT_SUCCESS;
+}
+
+int interpolate_grid(const t_param cparams, int* cobstacles, float** cgrid,
+                     const t_param params, int* obstacles, float** grid)
+{
+  const float c_sq = 1.f / 3.f; /* square of speed of sound */
+  const int   cx[NSPEEDS] = { 0, 1, 0, -1,  0, 1, -1, -1,  1 };
+  const int   cy[NSPEEDS] = { 0, 0, 1,  0, -1, 1,  1, -1, -1 };
+  const float wt[NSPEEDS] = { 4.f / 9.f, 1.f / 9.f, 1.f / 9.f, 1.f / 9.f, 1.f / 9.f,
+                              1.f / 36.f, 1.f / 36.f, 1.f / 36.f, 1.f / 36.f };
+  const size_t cncells = (size_t)cparams.nx * cparams.ny;
+  /* non-equilibrium parts follow the velocity gradients, which shrink with the cell size */
+  const float  neq_scale = (float)cparams.nx / params.nx;
+  float* moments = (float*)malloc(sizeof(float) * (3 + NSPEEDS) * cncells);
+
+  if (moments == NULL) die("cannot allocate memory for warm start", __LINE__, __FILE__);
+
+  /* density, velocity and f - f_eq of every coarse fluid cell */
+  for (size_t ii = 0; ii < cncells; ii++)
+  {
+    float* m = moments + (3 + NSPEEDS) * ii;
+    float  rho = 0.f, u_x = 0.f, u_y = 0.f;
+
+    if (cobstacles[ii]) continue;
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      rho += cgrid[kk][ii];
+      u_x += cx[kk] * cgrid[kk][ii];
+      u_y += cy[kk] * cgrid[kk][ii];
+    }
+    u_x /= rho;
+    u_y /= rho;
+
+    m[0] = rho;
+    m[1] = u_x;
+    m[2] = u_y;
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      const float cu = cx[kk] * u_x + cy[kk] * u_y;
+      const float f_eq = wt[kk] * rho * (1.f + cu / c_sq + (cu * cu) / (2.f * c_sq * c_sq)
+                                         - (u_x * u_x + u_y * u_y) / (2.f * c_sq));
+      m[3 + kk] = cgrid[kk][ii] - f_eq;
+    }
+  }
+
+  /* the fine lattice is fresh from d2q9_create(), so solid cells are already at rest */
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      float  acc[3 + NSPEEDS] = { 0.f };
+      float  wsum = 0.f;
+
+      if (obstacles[ii + jj*params.nx]) continue;
+
+      /* bilinear over the four nearest coarse cells, periodic like the lattice */
+      const float x = (ii + 0.5f) * cparams.nx / params.nx - 0.5f;
+      const float y = (jj + 0.5f) * cparams.ny / params.ny - 0.5f;
+      const int   x0 = (int)floorf(x);
+      const int   y0 = (int)floorf(y);
+      const float fx = x - x0;
+      const float fy = y - y0;
+
+      for (int corner = 0; corner < 4; corner++)
       {
-        /* compute local density total */
-        float local_density = 0.f;
+        const int   xc = ((x0 + (corner & 1)) % cparams.nx + cparams.nx) % cparams.nx;
+        const int   yc = ((y0 + (corner >> 1)) % cparams.ny + cparams.ny) % cparams.ny;
+        const float w = ((corner & 1) ? fx : 1.f - fx) * ((corner >> 1) ? fy : 1.f - fy);
+        const size_t c = xc + (size_t)yc * cparams.nx;
+
+        /* only fluid cells carry meaningful moments */
+        if (cobstacles[c] || w <= 0.f) continue;
+
+        for (int mm = 0; mm < 3 + NSPEEDS; mm++) acc[mm] += w * moments[(3 + NSPEEDS) * c + mm];
+        wsum += w;
+      }
+
+      /* no fluid neighbour on the coarse grid: leave the rest state */
+      if (wsum <= 0.f) continue;
+
+      const float rho = acc[0] / wsum;
+      const float u_x = acc[1] / wsum;
+      const float u_y = acc[2] / wsum;
+
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        const float cu = cx[kk] * u_x + cy[kk] * u_y;
+        const float f_eq = wt[kk] * rho * (1.f + cu / c_sq + (cu * cu) / (2.f * c_sq * c_sq)
+                                           - (u_x * u_x + u_y * u_y) / (2.f * c_sq));
+        grid[kk][ii + jj*params.nx] = f_eq + neq_scale * acc[3 + kk] / wsum;
+      }
+    }
+  }
+
+  free(moments);
+
+  return EXIT_SUCCESS;
+}
+
+int next_chunk(const t_param params, const t_opts opts, const int tt)
+{
+  const int every[] = { opts.flush_every, opts.checkpoint_every, opts.snapshot_every, opts.render_every };
+  int       next = params.maxIters;
+
+  /* DEBUG prints every step, and convergence tests every step */
+  if (DEBUG_BUILD || opts.converge_tol > 0.f || opts.converge_l2 > 0.f) return 1;
+
+  for (int ii = 0; ii < (int)(sizeof(every) / sizeof(every[0])); ii++)
+  {
+    if (every[ii] > 0 && (tt / every[ii] + 1) * every[ii] < next) next = (tt / every[ii] + 1) * every[ii];
+  }
+
+  return next - tt;
+}
+
+int converged(const t_param params, const t_opts opts, int* obstacles, float** grid,
+              const float* av_vels, const int tt, t_converge* conv)
+{
+  const size_t ncells = (size_t)params.nx * params.ny;
+  int window_ok = 1;
+
+  /* relative change of av_vels across the window */
+  if (opts.converge_tol > 0.f)
+  {
+    window_ok = tt >= opts.converge_window
+                && fabsf(av_vels[tt] - av_vels[tt - opts.converge_window])
+                   <= opts.converge_tol * fabsf(av_vels[tt]);
+  }
+
+  /* L2 change of the velocity field since the previous sample, relative to its norm */
+  if (opts.converge_l2 > 0.f && (tt + 1) % opts.converge_every == 0)
+  {
+    double diff = 0.0, norm = 0.0;
+
+    if (conv->u_prev == NULL)
+    {
+      conv->u_prev = (float*)calloc(2 * ncells, sizeof(float));
+      if (conv->u_prev == NULL) die("cannot allocate memory for convergence test", __LINE__, __FILE__);
+    }
+
+    for (size_t ii = 0; ii < ncells; ii++)
+    {
+      if (obstacles[ii]) continue;
+
+      float local_density = 0.f;
+
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        local_density += grid[kk][ii];
+      }
+
+      const float u_x = (grid[1][ii] + grid[5][ii] + grid[8][ii]
+                         - (grid[3][ii] + grid[6][ii] + grid[7][ii]))
+                        / local_density;
+      const float u_y = (grid[2][ii] + grid[5][ii] + grid[6][ii]
+                         - (grid[4][ii] + grid[7][ii] + grid[8][ii]))
+                        / local_density;
+      const double d_x = u_x - conv->u_prev[2 * ii];
+      const double d_y = u_y - conv->u_prev[2 * ii + 1];
+
+      diff += d_x * d_x + d_y * d_y;
+      norm += (double)u_x * u_x + (double)u_y * u_y;
+      conv->u_prev[2 * ii]     = u_x;
+      conv->u_prev[2 * ii + 1] = u_y;
+    }
+
+    conv->l2_ok   = conv->sampled && sqrt(diff) <= opts.converge_l2 * sqrt(norm);
+    conv->sampled = 1;
+  }
+
+  return window_ok && (opts.converge_l2 <= 0.f || conv->l2_ok);
+}
+
+int write_snapshot(const t_param params, t_slot* slot, const char* filename)
+{
+  FILE* fp;
+  const char* names[NFIELDS] = { "u_x", "u_y", "u", "pressure" };
+  const size_t ncells = (size_t)params.nx * params.ny;
+  const unsigned int one = 1;
+
+  /* legacy VTK binary data is big-endian; swap in place, the slot is ours */
+  if (*(const unsigned char*)&one == 1)
+  {
+    unsigned int* words = (unsigned int*)slot->data;
+
+    for (size_t ii = 0; ii < NFIELDS * ncells; ii++)
+    {
+      const unsigned int w = words[ii];
+      words[ii] = (w >> 24) | ((w >> 8) & 0xff00u) | ((w << 8) & 0xff0000u) | (w << 24);
+    }
+  }
+
+  fp = fopen(filename, "wb");
+
+  if (fp == NULL) die("could not open snapshot file", __LINE__, __FILE__);
+
+  fprintf(fp, "# vtk DataFile Version 3.0\n");
+  fprintf(fp, "d2q9-bgk step %d\n", slot->step + 1);
+  fprintf(fp, "BINARY\n");
+  fprintf(fp, "DATASET STRUCTURED_POINTS\n");
+  fprintf(fp, "DIMENSIONS %d %d 1\n", params.nx, params.ny);
+  fprintf(fp, "ORIGIN 0 0 0\n");
+  fprintf(fp, "SPACING 1 1 1\n");
+  fprintf(fp, "POINT_DATA %zu\n", ncells);
+
+  for (int ff = 0; ff < NFIELDS; ff++)
+  {
+    fprintf(fp, "SCALARS %s float 1\n", names[ff]);
+    fprintf(fp, "LOOKUP_TABLE default\n");
+
+    if (fwrite(slot->data + ff * ncells, sizeof(float), ncells, fp) != ncells)
+    {
+      die("could not write snapshot file", __LINE__, __FILE__);
+    }
+
+    fprintf(fp, "\n");
+  }
+
+  fclose(fp);
+
+  return EXIT_SUCCESS;
+}
+
+size_t encode_block(const float* in, int nx, int nrows, int mode, float eb, unsigned char** out)
+{
+  const size_t n = (size_t)nx * nrows;
+  uint32_t* words = (uint32_t*)malloc(sizeof(uint32_t) * n);
+  float* rec = NULL;            /* lossy: values as the decoder will see them */
+  size_t nraw = 4 * n;          /* byte planes, then any unpredictable values */
+  unsigned char* raw;
+  uLongf zlen;
+
+  raw = (unsigned char*)malloc(8 * n); /* worst case: every value unpredictable */
+
+  if (words == NULL || raw == NULL) die("cannot allocate compression buffers", __LINE__, __FILE__);
+
+  if (mode == COMPRESS_LOSSLESS)
+  {
+    /* XOR with the previous value leaves mostly zero high bytes in smooth fields */
+    uint32_t prev = 0;
+
+    for (size_t ii = 0; ii < n; ii++)
+    {
+      uint32_t bits;
+      memcpy(&bits, &in[ii], 4);
+      words[ii] = bits ^ prev;
+      prev = bits;
+    }
+  }
+  else
+  {
+    const float step = 2.f * eb;
+    rec = (float*)malloc(sizeof(float) * n);
+
+    if (rec == NULL) die("cannot allocate compression buffers", __LINE__, __FILE__);
+
+    for (int jj = 0; jj < nrows; jj++)
+    {
+      for (int ii = 0; ii < nx; ii++)
+      {
+        const size_t idx = ii + (size_t)jj * nx;
+        /* 2D Lorenzo predictor on already reconstructed neighbours */
+        float pred = 0.f;
+        if (ii > 0 && jj > 0) pred = rec[idx - 1] + rec[idx - nx] - rec[idx - nx - 1];
+        else if (ii > 0)      pred = rec[idx - 1];
+        else if (jj > 0)      pred = rec[idx - nx];
+
+        const float qf = (in[idx] - pred) / step;
+        int ok = 0;
+
+        if (fabsf(qf) < 1e9f)
+        {
+          const int32_t q = (int32_t)lrintf(qf);
+          const float r = pred + step * (float)q;
+
+          if (fabsf(in[idx] - r) <= eb)
+          {
+            /* zigzag so small magnitudes of either sign have zero high bytes, 0 marks an outlier */
+            words[idx] = (((uint32_t)q << 1) ^ (uint32_t)(q >> 31)) + 1;
+            rec[idx] = r;
+            ok = 1;
+          }
+        }
+
+        if (!ok)
+        {
+          /* keep the exact value after the byte planes */
+          words[idx] = 0;
+          rec[idx] = in[idx];
+          memcpy(raw + nraw, &in[idx], 4);
+          nraw += 4;
+        }
+      }
+    }
+  }
+
+  /* byte-plane packing: all low bytes, then the next byte of every word, ... */
+  for (int bb = 0; bb < 4; bb++)
+  {
+    unsigned char* plane = raw + bb * n;
+
+    for (size_t ii = 0; ii < n; ii++)
+    {
+      plane[ii] = (unsigned char)(words[ii] >> (8 * bb));
+    }
+  }
+
+  zlen = compressBound(nraw);
+  *out = (unsigned char*)malloc(4 + zlen);
+
+  if (*out == NULL) die("cannot allocate compression buffers", __LINE__, __FILE__);
+
+  (*out)[0] = (unsigned char)nraw;
+  (*out)[1] = (unsigned char)(nraw >> 8);
+  (*out)[2] = (unsigned char)(nraw >> 16);
+  (*out)[3] = (unsigned char)(nraw >> 24);
+
+  if (compress2(*out + 4, &zlen, raw, nraw, 1) != Z_OK) die("could not deflate block", __LINE__, __FILE__);
+
+  free(rec);
+  free(raw);
+  free(words);
 
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
-          //local_density += tmp_cells[ii + jj*params.nx].speeds[kk];
-          local_density += tmp_grid[kk][ii + jj*params.nx];
-        }
+  return 4 + zlen;
+}
 
+int decode_block(const unsigned char* in, size_t len, int nx, int nrows, int mode, float eb, float* out)
+{
+  const size_t n = (size_t)nx * nrows;
+  uLongf nraw;
+  unsigned char* raw;
+  const unsigned char* outliers;
 
+  /* the length, then a word per cell and at most an outlier per cell, all from the file */
+  if (len < 4) return EXIT_FAILURE;
+  nraw = in[0] | (in[1] << 8) | (in[2] << 16) | ((uLongf)in[3] << 24);
+  if (nraw < 4 * n || nraw > 8 * n) return EXIT_FAILURE;
 
-        /* compute x velocity component */
-       const float u_x = (tmp_grid[1][ii + jj*params.nx]
-                     + tmp_grid[5][ii + jj*params.nx]
-                     + tmp_grid[8][ii + jj*params.nx]
-                     - (tmp_grid[3][ii + jj*params.nx]
-                        + tmp_grid[6][ii + jj*params.nx]
-                        + tmp_grid[7][ii + jj*params.nx]))
-                    / local_density;
+  raw = (unsigned char*)malloc(nraw);
 
+  if (raw == NULL) die("cannot allocate compression buffers", __LINE__, __FILE__);
 
-        /* compute x velocity component */
-       const float u_y = (tmp_grid[2][ii + jj*params.nx]
-                     + tmp_grid[5][ii + jj*params.nx]
-                     + tmp_grid[6][ii + jj*params.nx]
-                     - (tmp_grid[4][ii + jj*params.nx]
-                        + tmp_grid[7][ii + jj*params.nx]
-                        + tmp_grid[8][ii + jj*params.nx]))
-                    / local_density;
+  if (uncompress(raw, &nraw, in + 4, len - 4) != Z_OK || nraw < 4 * n)
+  {
+    free(raw);
+    return EXIT_FAILURE;
+  }
 
+  outliers = raw + 4 * n;
 
-        /* velocity squared */
-        const float u_sq = u_x * u_x + u_y * u_y;
+  if (mode == COMPRESS_LOSSLESS)
+  {
+    uint32_t prev = 0;
 
-        /* directional velocity components */
-        float u[NSPEEDS];
-        u[1] =   u_x;        /* east */
-        u[2] =         u_y;  /* north */
-        u[3] = - u_x;        /* west */
-        u[4] =       - u_y;  /* south */
-        u[5] =   u_x + u_y;  /* north-east */
-        u[6] = - u_x + u_y;  /* north-west */
-        u[7] = - u_x - u_y;  /* south-west */
-        u[8] =   u_x - u_y;  /* south-east */
-
-        /* equilibrium densities */
-        float d_equ[NSPEEDS];
-        /* zero velocity density: weight w0 */
-        d_equ[0] = w0 * local_density
-                   * (1.f - u_sq / (2.f * c_sq));
-        /* axis speeds: weight w1 */
-        d_equ[1] = w1 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u[1])+(u[1]*u[1])-(u_sq*c_sq))/(2.f*c_sq*c_sq);
-        d_equ[2] = w1 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u[2])+(u[2]*u[2])-(u_sq*c_sq))/(2.f*c_sq*c_sq);
-        d_equ[3] = w1 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u[3])+(u[3]*u[3])-(u_sq*c_sq))/(2.f*c_sq*c_sq);
-        d_equ[4] = w1 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u[4])+(u[4]*u[4])-(u_sq*c_sq))/(2.f*c_sq*c_sq);
-        d_equ[5] = w2 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u[5])+(u[5]*u[5])-(u_sq*c_sq))/(2.f*c_sq*c_sq);
-        d_equ[6] = w2 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u[6])+(u[6]*u[6])-(u_sq*c_sq))/(2.f*c_sq*c_sq);
-        d_equ[7] = w2 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u[7])+(u[7]*u[7])-(u_sq*c_sq))/(2.f*c_sq*c_sq);
-        d_equ[8] = w2 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u[8])+(u[8]*u[8])-(u_sq*c_sq))/(2.f*c_sq*c_sq);
-
-
-        /* relaxation step */
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
+    for (size_t ii = 0; ii < n; ii++)
+    {
+      const uint32_t bits = prev ^ (raw[ii] | (raw[n + ii] << 8) | (raw[2 * n + ii] << 16)
+                                    | ((uint32_t)raw[3 * n + ii] << 24));
+      memcpy(&out[ii], &bits, 4);
+      prev = bits;
+    }
+  }
+  else
+  {
+    const float step = 2.f * eb;
 
-          o_grid[kk][ii + jj*params.nx] = tmp_grid[kk][ii + jj*params.nx]
-                                                  + params.omega
-                                                  * (d_equ[kk] - tmp_grid[kk][ii + jj*params.nx]);
+    for (int jj = 0; jj < nrows; jj++)
+    {
+      for (int ii = 0; ii < nx; ii++)
+      {
+        const size_t idx = ii + (size_t)jj * nx;
+        const uint32_t word = raw[idx] | (raw[n + idx] << 8) | (raw[2 * n + idx] << 16)
+                              | ((uint32_t)raw[3 * n + idx] << 24);
 
+        if (word == 0)
+        {
+          if (outliers + 4 > raw + nraw)
+          {
+            free(raw);
+            return EXIT_FAILURE;
+          }
+          memcpy(&out[idx], outliers, 4);
+          outliers += 4;
         }
+        else
+        {
+          /* must mirror encode_block() exactly to rebuild the same predictions */
+          float pred = 0.f;
+          if (ii > 0 && jj > 0) pred = out[idx - 1] + out[idx - nx] - out[idx - nx - 1];
+          else if (ii > 0)      pred = out[idx - 1];
+          else if (jj > 0)      pred = out[idx - nx];
+
+          const uint32_t z = word - 1;
+          const int32_t q = (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+          out[idx] = pred + step * (float)q;
+        }
+      }
+    }
+  }
 
+  free(raw);
 
+  return EXIT_SUCCESS;
+}
 
+void* zjob_main(void* arg)
+{
+  t_zjob* job = (t_zjob*)arg;
+  const int per_plane = (job->ny + ZBLOCKROWS - 1) / ZBLOCKROWS;
+  const size_t plane_size = (size_t)job->nx * job->ny;
 
+  /* blocks are dealt round-robin so every thread gets a share of every plane */
+  for (int bb = job->first; bb < job->nblocks; bb += job->stride)
+  {
+    const int pp = bb / per_plane;
+    const int j0 = (bb % per_plane) * ZBLOCKROWS;
+    const int nrows = (j0 + ZBLOCKROWS > job->ny) ? job->ny - j0 : ZBLOCKROWS;
+    const size_t offset = pp * plane_size + (size_t)j0 * job->nx;
 
-
-      }
+    if (job->out == NULL)
+    {
+      job->blocks[bb].len = encode_block(job->data + offset, job->nx, nrows, job->mode, job->eb,
+                                         &job->blocks[bb].buf);
+    }
+    else if (decode_block(job->blocks[bb].buf, job->blocks[bb].len, job->nx, nrows,
+                          job->mode, job->eb, job->out + offset) != EXIT_SUCCESS)
+    {
+      job->failed = 1;
     }
   }
 
+  return NULL;
+}
+
+int run_zjobs(t_zjob* job, int nthreads)
+{
+  pthread_t threads[64];
+  t_zjob    jobs[64];
+  int       failed = 0;
 
+  if (nthreads < 1) nthreads = 1;
+  if (nthreads > 64) nthreads = 64;
+  if (nthreads > job->nblocks) nthreads = job->nblocks;
 
+  for (int tt = 0; tt < nthreads; tt++)
+  {
+    jobs[tt] = *job;
+    jobs[tt].stride = nthreads;
+    jobs[tt].first  = tt;
+    jobs[tt].failed = 0;
 
+    if (tt > 0 && pthread_create(&threads[tt], NULL, zjob_main, &jobs[tt]) != 0)
+    {
+      die("could not start compression thread", __LINE__, __FILE__);
+    }
+  }
 
-return EXIT_SUCCESS;
+  /* the calling thread takes the first share itself */
+  zjob_main(&jobs[0]);
 
+  for (int tt = 0; tt < nthreads; tt++)
+  {
+    if (tt > 0) pthread_join(threads[tt], NULL);
+    failed |= jobs[tt].failed;
+  }
 
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
+int write_compressed(const t_param params, const t_opts opts, const t_slot* slot, const int nplanes,
+                     const char* filename, double* zraw, double* zout)
+{
+  FILE*  fp;
+  char   tmpfile[256];
+  t_zjob job;
+  const int per_plane = (params.ny + ZBLOCKROWS - 1) / ZBLOCKROWS;
+  const int kind = (nplanes == NSPEEDS) ? JOB_CHECKPOINT : JOB_SNAPSHOT;
+  int    header[8];
+  size_t total = 0;
+
+  memset(&job, 0, sizeof(t_zjob));
+  job.data    = slot->data;
+  job.nx      = params.nx;
+  job.ny      = params.ny;
+  job.nblocks = nplanes * per_plane;
+  job.mode    = opts.compress;
+  job.eb      = opts.compress_eb;
+  job.blocks  = (t_zblock*)calloc(job.nblocks, sizeof(t_zblock));
+
+  if (job.blocks == NULL) die("cannot allocate compression buffers", __LINE__, __FILE__);
+
+  run_zjobs(&job, opts.compress_threads);
+
+  /* header, block lengths, then the blocks in plane order */
+  header[0] = kind;
+  header[1] = params.nx;
+  header[2] = params.ny;
+  header[3] = slot->step + 1;
+  header[4] = nplanes;
+  header[5] = opts.compress;
+  header[6] = ZBLOCKROWS;
+  memcpy(&header[7], &opts.compress_eb, sizeof(float));
+
+  snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", filename);
+  fp = fopen(tmpfile, "wb");
+
+  if (fp == NULL) die("could not open compressed output file", __LINE__, __FILE__);
+
+  fwrite(ZIPMAGIC, 1, 8, fp);
+  fwrite(header, sizeof(int), 8, fp);
+
+  for (int bb = 0; bb < job.nblocks; bb++)
+  {
+    const uint64_t len = job.blocks[bb].len;
+    fwrite(&len, sizeof(uint64_t), 1, fp);
+  }
 
+  for (int bb = 0; bb < job.nblocks; bb++)
+  {
+    fwrite(job.blocks[bb].buf, 1, job.blocks[bb].len, fp);
+    total += job.blocks[bb].len;
+    free(job.blocks[bb].buf);
+  }
 
+  if (ferror(fp)) die("could not write compressed output file", __LINE__, __FILE__);
 
+  fclose(fp);
+  free(job.blocks);
 
+  if (rename(tmpfile, filename) != 0) die("could not rename compressed output file", __LINE__, __FILE__);
 
+  *zraw += (double)sizeof(float) * nplanes * params.nx * params.ny;
+  *zout += (double)total;
 
+  return EXIT_SUCCESS;
 }
 
-
-int initialise(const char* paramfile, const char* obstaclefile,
-               t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-               int** obstacles_ptr, float** av_vels_ptr,float*** grid_ptr,float*** tmp_grid_ptr,float*** o_grid_ptr)
+int unpack_file(const char* in, const char* out)
 {
-  char   message[1024];  /* message buffer */
-  FILE*   fp;            /* file pointer */
-  int    xx, yy;         /* generic array indices */
-  int    blocked;        /* indicates whether a cell is blocked by an obstacle */
-  int    retval;         /* to hold return value for checking */
+  FILE*   fp;
+  char    magic[8];
+  int     header[8];
+  t_zjob  job;
+  t_slot  slot;
+  t_param params;
+  int     per_plane;
 
-  /* open the parameter file */
-  fp = fopen(paramfile, "r");
+  fp = fopen(in, "rb");
 
-  if (fp == NULL)
+  if (fp == NULL) die("could not open compressed input file", __LINE__, __FILE__);
+
+  if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, ZIPMAGIC, 8) != 0
+      || fread(header, sizeof(int), 8, fp) != 8)
   {
-    sprintf(message, "could not open input parameter file: %s", paramfile);
-    die(message, __LINE__, __FILE__);
+    die("not a compressed d2q9-bgk file", __LINE__, __FILE__);
   }
 
-  /* read in the parameter values */
-  retval = fscanf(fp, "%d\n", &(params->nx));
+  if (header[6] != ZBLOCKROWS) die("compressed file uses a different block size", __LINE__, __FILE__);
 
-  if (retval != 1) die("could not read param file: nx", __LINE__, __FILE__);
+  /* nothing in the header is trusted: the sizes go into allocations and loops */
+  if ((header[0] != JOB_CHECKPOINT && header[0] != JOB_SNAPSHOT)
+      || header[1] < 1 || header[2] < 1
+      || header[4] != ((header[0] == JOB_CHECKPOINT) ? NSPEEDS : NFIELDS)
+      || (header[5] != COMPRESS_LOSSLESS && header[5] != COMPRESS_LOSSY))
+  {
+    die("corrupt compressed file header", __LINE__, __FILE__);
+  }
 
-  retval = fscanf(fp, "%d\n", &(params->ny));
+  memset(&params, 0, sizeof(t_param));
+  params.nx = header[1];
+  params.ny = header[2];
+  per_plane = (params.ny + ZBLOCKROWS - 1) / ZBLOCKROWS;
 
-  if (retval != 1) die("could not read param file: ny", __LINE__, __FILE__);
+  memset(&job, 0, sizeof(t_zjob));
+  job.nx      = params.nx;
+  job.ny      = params.ny;
+  job.nblocks = header[4] * per_plane;
+  job.mode    = header[5];
+  memcpy(&job.eb, &header[7], sizeof(float));
+  job.blocks  = (t_zblock*)calloc(job.nblocks, sizeof(t_zblock));
 
-  retval = fscanf(fp, "%d\n", &(params->maxIters));
+  memset(&slot, 0, sizeof(t_slot));
+  slot.step = header[3] - 1;
+  slot.data = (float*)malloc(sizeof(float) * header[4] * (size_t)params.nx * params.ny);
+  job.out   = slot.data;
 
-  if (retval != 1) die("could not read param file: maxIters", __LINE__, __FILE__);
+  if (job.blocks == NULL || slot.data == NULL) die("cannot allocate compression buffers", __LINE__, __FILE__);
 
-  retval = fscanf(fp, "%d\n", &(params->reynolds_dim));
+  for (int bb = 0; bb < job.nblocks; bb++)
+  {
+    uint64_t len;
+    if (fread(&len, sizeof(uint64_t), 1, fp) != 1) die("truncated compressed file", __LINE__, __FILE__);
+    job.blocks[bb].len = len;
+  }
 
-  if (retval != 1) die("could not read param file: reynolds_dim", __LINE__, __FILE__);
+  for (int bb = 0; bb < job.nblocks; bb++)
+  {
+    job.blocks[bb].buf = (unsigned char*)malloc(job.blocks[bb].len);
 
-  retval = fscanf(fp, "%f\n", &(params->density));
+    if (job.blocks[bb].buf == NULL
+        || fread(job.blocks[bb].buf, 1, job.blocks[bb].len, fp) != job.blocks[bb].len)
+    {
+      die("truncated compressed file", __LINE__, __FILE__);
+    }
+  }
 
-  if (retval != 1) die("could not read param file: density", __LINE__, __FILE__);
+  fclose(fp);
 
-  retval = fscanf(fp, "%f\n", &(params->accel));
+  if (run_zjobs(&job, (int)sysconf(_SC_NPROCESSORS_ONLN)) != EXIT_SUCCESS)
+  {
+    die("corrupt compressed file", __LINE__, __FILE__);
+  }
 
-  if (retval != 1) die("could not read param file: accel", __LINE__, __FILE__);
+  /* back to the format the file would have had uncompressed */
+  if (header[0] == JOB_CHECKPOINT) write_checkpoint(params, &slot, out);
+  else write_snapshot(params, &slot, out);
 
-  retval = fscanf(fp, "%f\n", &(params->omega));
+  for (int bb = 0; bb < job.nblocks; bb++) free(job.blocks[bb].buf);
+  free(job.blocks);
+  free(slot.data);
 
-  if (retval != 1) die("could not read param file: omega", __LINE__, __FILE__);
+  return EXIT_SUCCESS;
+}
 
-  /* and close up the file */
-  fclose(fp);
+void colour_map(float x, unsigned char* rgb)
+{
+  /* gnuplot's default pm3d palette (rgbformulae 7,5,15), as final_state.plt used */
+  const float pi = 3.14159265f;
+  float r, g, b;
+
+  x = (x < 0.f) ? 0.f : (x > 1.f) ? 1.f : x;
+  r = sqrtf(x);
+  g = x * x * x;
+  b = sinf(2.f * pi * x);
+  b = (b < 0.f) ? 0.f : b;
+
+  rgb[0] = (unsigned char)(255.f * r + 0.5f);
+  rgb[1] = (unsigned char)(255.f * g + 0.5f);
+  rgb[2] = (unsigned char)(255.f * b + 0.5f);
+}
 
-  /*
-  ** Allocate memory.
-  **
-  ** Remember C is pass-by-value, so we need to
-  ** pass pointers into the initialise function.
-  **
-  ** NB we are allocating a 1D array, so that the
-  ** memory will be contiguous.  We still want to
-  ** index this memory as if it were a (row major
-  ** ordered) 2D array, however.  We will perform
-  ** some arithmetic using the row and column
-  ** coordinates, inside the square brackets, when
-  ** we want to access elements of this array.
-  **
-  ** Note also that we are using a structure to
-  ** hold an array of 'speeds'.  We will allocate
-  ** a 1D array of these structs.
-  */
+/* PNG stores lengths and checksums big-endian */
+static void put_be32(unsigned char* p, unsigned long v)
+{
+  p[0] = (unsigned char)(v >> 24);
+  p[1] = (unsigned char)(v >> 16);
+  p[2] = (unsigned char)(v >> 8);
+  p[3] = (unsigned char)v;
+}
 
-  /* Main Grid SoA*/
+static int write_png_chunk(FILE* fp, const char* type, const unsigned char* data, unsigned long len)
+{
+  unsigned char word[4];
+  unsigned long crc = crc32(0L, (const Bytef*)type, 4);
 
-  *grid_ptr  = (float**)malloc(sizeof(float*) * NSPEEDS);
+  if (len > 0) crc = crc32(crc, data, len);
 
-  for(int i = 0; i<NSPEEDS;i++){
-    (*grid_ptr)[i] = (float*)aligned_alloc(sizeof(float) * (params->ny * params->nx),16);
-  }
-  /* Temp Grid SoA*/
-  *tmp_grid_ptr  = (float**)malloc(sizeof(float*) * NSPEEDS);
+  put_be32(word, len);
+  fwrite(word, 1, 4, fp);
+  fwrite(type, 1, 4, fp);
+  if (len > 0) fwrite(data, 1, len, fp);
+  put_be32(word, crc);
+  fwrite(word, 1, 4, fp);
 
-  for(int i = 0; i<NSPEEDS;i++){
-    (*tmp_grid_ptr)[i] = (float*)aligned_alloc(sizeof(float) * (params->ny * params->nx),16);
-  }
-  /* output Grid SoA*/
-  *o_grid_ptr  = (float**)malloc(sizeof(float*) * NSPEEDS);
+  return ferror(fp) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
-  for(int i = 0; i<NSPEEDS;i++){
-    (*o_grid_ptr)[i] = (float*)aligned_alloc(sizeof(float) * (params->ny * params->nx),1);
+int write_image(const t_param params, const t_opts opts, const int* obstacles, const t_slot* slot)
+{
+  FILE* fp;
+  char  filename[64];
+  const size_t ncells = (size_t)params.nx * params.ny;
+  const float* speed = slot->data + 2 * ncells; /* |u| plane from compute_fields() */
+  const unsigned char solid[3] = { 96, 96, 96 };
+  const size_t rowbytes = 1 + 3 * (size_t)params.nx; /* PNG filter byte + RGB */
+  unsigned char* pixels;
+  float umax = opts.render_max;
+
+  if (umax <= 0.f)
+  {
+    for (size_t ii = 0; ii < ncells; ii++)
+    {
+      if (!obstacles[ii] && speed[ii] > umax) umax = speed[ii];
+    }
+    if (umax <= 0.f) umax = 1.f;
   }
 
+  pixels = (unsigned char*)malloc(rowbytes * params.ny);
 
-  /* initialise densities */
-  float w0 = params->density * 4.f / 9.f;
-  float w1 = params->density      / 9.f;
-  float w2 = params->density      / 36.f;
+  if (pixels == NULL) die("cannot allocate image buffer", __LINE__, __FILE__);
 
-  //__assume_aligned((*grid_ptr), 64);
-  for (int jj = 0; jj < params->ny; jj++)
+  /* image rows run top to bottom, so flip y to keep the origin bottom-left */
+  for (int jj = 0; jj < params.ny; jj++)
   {
-    for (int ii = 0; ii < params->nx; ii++)
+    unsigned char* row = pixels + rowbytes * (params.ny - 1 - jj);
+    row[0] = 0; /* PNG filter type: none */
+
+    for (int ii = 0; ii < params.nx; ii++)
     {
-      /* centre */
-      (*grid_ptr)[0][ii + jj*params->nx] = w0;
-      /* axis directions */
-      (*grid_ptr)[1][ii + jj*params->nx] = w1;
-      (*grid_ptr)[2][ii + jj*params->nx] = w1;
-      (*grid_ptr)[3][ii + jj*params->nx] = w1;
-      (*grid_ptr)[4][ii + jj*params->nx] = w1;
-      /* diagonals */
-      (*grid_ptr)[5][ii + jj*params->nx] = w2;
-      (*grid_ptr)[6][ii + jj*params->nx] = w2;
-      (*grid_ptr)[7][ii + jj*params->nx] = w2;
-      (*grid_ptr)[8][ii + jj*params->nx] = w2;
+      unsigned char* rgb = row + 1 + 3 * ii;
 
+      if (obstacles[ii + jj*params.nx]) memcpy(rgb, solid, 3);
+      else colour_map(speed[ii + jj*params.nx] / umax, rgb);
     }
   }
 
+  if (slot->last) sprintf(filename, IMAGEFILE ".%s", opts.render_ppm ? "ppm" : "png");
+  else sprintf(filename, FRAMEFILE ".%s", slot->step + 1, opts.render_ppm ? "ppm" : "png");
 
+  fp = fopen(filename, "wb");
 
-  /* the map of obstacles */
-  *obstacles_ptr = malloc(sizeof(int) * (params->ny * params->nx));
-
-  if (*obstacles_ptr == NULL) die("cannot allocate column memory for obstacles", __LINE__, __FILE__);
+  if (fp == NULL) die("could not open image file", __LINE__, __FILE__);
 
+  if (opts.render_ppm)
+  {
+    fprintf(fp, "P6\n%d %d\n255\n", params.nx, params.ny);
 
+    for (int jj = 0; jj < params.ny; jj++)
+    {
+      fwrite(pixels + rowbytes * jj + 1, 1, rowbytes - 1, fp);
+    }
+  }
+  else
+  {
+    const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    unsigned char ihdr[13];
+    uLongf zlen = compressBound(rowbytes * params.ny);
+    unsigned char* zbuf = (unsigned char*)malloc(zlen);
 
+    if (zbuf == NULL) die("cannot allocate image buffer", __LINE__, __FILE__);
 
-  /* first set all cells in obstacle array to zero */
-  for (int jj = 0; jj < params->ny; jj++)
-  {
-    for (int ii = 0; ii < params->nx; ii++)
+    /* the 'up' filter would need a copy, 'none' already compresses smooth fields well */
+    if (compress2(zbuf, &zlen, pixels, rowbytes * params.ny, 6) != Z_OK)
     {
-      (*obstacles_ptr)[ii + jj*params->nx] = 0;
+      die("could not compress image", __LINE__, __FILE__);
     }
+
+    put_be32(ihdr, params.nx);
+    put_be32(ihdr + 4, params.ny);
+    ihdr[8]  = 8; /* bit depth */
+    ihdr[9]  = 2; /* truecolour */
+    ihdr[10] = 0; /* deflate */
+    ihdr[11] = 0; /* adaptive filtering */
+    ihdr[12] = 0; /* no interlace */
+
+    fwrite(signature, 1, 8, fp);
+    write_png_chunk(fp, "IHDR", ihdr, 13);
+    write_png_chunk(fp, "IDAT", zbuf, zlen);
+    write_png_chunk(fp, "IEND", NULL, 0);
+
+    free(zbuf);
   }
 
-  /* open the obstacle data file */
-  fp = fopen(obstaclefile, "r");
+  if (ferror(fp)) die("could not write image file", __LINE__, __FILE__);
 
-  if (fp == NULL)
+  fclose(fp);
+  free(pixels);
+
+  return EXIT_SUCCESS;
+}
+
+int start_jit(const t_opts opts, d2q9_ctx* ctx)
+{
+  char        dir[4096];
+  const char* base;
+  double      tic = wtime();
+  int         status;
+
+  if (opts.jit_dir != NULL)
   {
-    sprintf(message, "could not open input obstacles file: %s", obstaclefile);
-    die(message, __LINE__, __FILE__);
+    snprintf(dir, sizeof(dir), "%s", opts.jit_dir);
   }
-
-  /* read-in the blocked cells list */
-  while ((retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF)
+  else if ((base = getenv("XDG_CACHE_HOME")) != NULL && base[0] != '\0')
+  {
+    snprintf(dir, sizeof(dir), "%s/%s", base, JITDIR);
+  }
+  else if ((base = getenv("HOME")) != NULL && base[0] != '\0')
+  {
+    snprintf(dir, sizeof(dir), "%s/.cache/%s", base, JITDIR);
+  }
+  else
   {
-    /* some checks */
-    if (retval != 3) die("expected 3 values per line in obstacle file", __LINE__, __FILE__);
+    snprintf(dir, sizeof(dir), "/tmp/%s", JITDIR);
+  }
+
+  status = d2q9_jit(ctx, dir);
 
-    if (xx < 0 || xx > params->nx - 1) die("obstacle x-coord out of range", __LINE__, __FILE__);
+  /* not fatal: the built-in kernel gives the same answer, only slower */
+  if (status == D2Q9_OK) printf("JIT kernel:\t\t\t\t%s (%.6lf s)\n", dir, wtime() - tic);
+  else printf("JIT kernel:\t\t\t\tnot used, %s in %s\n", d2q9_strerror(status), dir);
 
-    if (yy < 0 || yy > params->ny - 1) die("obstacle y-coord out of range", __LINE__, __FILE__);
+  return status;
+}
 
-    if (blocked != 1) die("obstacle blocked value should be 1", __LINE__, __FILE__);
+int use_kernel(const t_opts opts, d2q9_ctx* ctx, const char* name)
+{
+  int status;
 
-    /* assign to array */
-    (*obstacles_ptr)[xx + yy*params->nx] = blocked;
+  /* a compiled kernel has to be built (or found in the cache) first */
+  if (strcmp(name, "jit") == 0)
+  {
+    status = start_jit(opts, ctx);
+  }
+  else
+  {
+    status = d2q9_set_kernel(ctx, name);
   }
 
-  /* and close the file */
-  fclose(fp);
+  if (status != D2Q9_OK)
+  {
+    fprintf(stderr, "kernel %s: %s\n", name, d2q9_strerror(status));
+    die("cannot use the requested kernel (see --list-kernels)", __LINE__, __FILE__);
+  }
 
-  /*
-  ** allocate space to hold a record of the avarage velocities computed
-  ** at each timestep
-  */
-  *av_vels_ptr = (float*)malloc(sizeof(float) * params->maxIters);
+  return EXIT_SUCCESS;
+}
+
+int list_kernels(void)
+{
+  const char* name;
+
+  for (int kk = 0; (name = d2q9_kernel_name(kk)) != NULL; kk++)
+  {
+    printf("%-12s %s\n", name, d2q9_kernel_about(kk));
+  }
 
   return EXIT_SUCCESS;
 }
 
-int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-             int** obstacles_ptr, float** av_vels_ptr)
+int pack_obstacles(const char* paramfile, const char* obstaclefile, const char* out)
 {
-  /*
-  ** free up allocated memory
-  */
+  char    message[1024];
+  t_param params;
+  int*    obstacles;
+  int     status;
 
-  free(*cells_ptr);
-  *cells_ptr = NULL;
+  status = d2q9_read_params(paramfile, &params);
 
-  free(*tmp_cells_ptr);
-  *tmp_cells_ptr = NULL;
+  if (status != D2Q9_OK)
+  {
+    sprintf(message, "could not read param file %.900s: %s", paramfile, d2q9_strerror(status));
+    die(message, __LINE__, __FILE__);
+  }
 
-  free(*obstacles_ptr);
-  *obstacles_ptr = NULL;
+  obstacles = malloc(sizeof(int) * (params.ny * params.nx));
 
-  free(*av_vels_ptr);
-  *av_vels_ptr = NULL;
+  if (obstacles == NULL) die("cannot allocate memory for obstacles", __LINE__, __FILE__);
+
+  status = d2q9_read_obstacles(obstaclefile, &params, obstacles);
+  if (status == D2Q9_OK) status = d2q9_write_obstacles(out, &params, obstacles);
+
+  if (status != D2Q9_OK)
+  {
+    sprintf(message, "could not pack %.450s into %.450s: %s", obstaclefile, out, d2q9_strerror(status));
+    die(message, __LINE__, __FILE__);
+  }
+
+  printf("%s: %ld bytes -> %s: %ld bytes\n", obstaclefile, file_size(obstaclefile), out, file_size(out));
+  free(obstacles);
 
   return EXIT_SUCCESS;
 }
 
-
-float calc_reynolds(const t_param params, int* obstacles,float** grid)
+long file_size(const char* filename)
 {
-  const float viscosity = 1.f / 6.f * (2.f / params.omega - 1.f);
+  FILE* fp = fopen(filename, "rb");
+  long  size = -1;
+
+  if (fp == NULL) return -1;
+  if (fseek(fp, 0, SEEK_END) == 0) size = ftell(fp);
+  fclose(fp);
 
-  return av_velocity(params,  obstacles,grid) * params.reynolds_dim / viscosity;
+  return size;
 }
 
-float total_density(const t_param params, float** grid)
+int start_threads(const t_opts opts, d2q9_ctx* ctx)
 {
-  float total = 0.f;  /* accumulator */
+  const int nthreads = (opts.threads > 0) ? opts.threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int status;
 
-  for (int jj = 0; jj < params.ny; jj++)
+  if (nthreads == 1 && opts.pin == NULL)
   {
-    for (int ii = 0; ii < params.nx; ii++)
-    {
-      for (int kk = 0; kk < NSPEEDS; kk++)
-      {
-        total += grid[kk][ii + jj*params.nx];
-      }
-    }
+    if (opts.tile > 0) die("--tile needs more than one thread (or --pin)", __LINE__, __FILE__);
+    return EXIT_SUCCESS;
+  }
+
+  status = d2q9_threads(ctx, nthreads, opts.pin, opts.numa);
+
+  if (status != D2Q9_OK)
+  {
+    fprintf(stderr, "threads: %s\n", d2q9_strerror(status));
+    die("cannot start the threads (check --threads, --pin and --numa; --kernel=aos and sparse step alone)", __LINE__, __FILE__);
+  }
+
+  if (opts.tile > 0 && (status = d2q9_tiles(ctx, opts.tile)) != D2Q9_OK)
+  {
+    fprintf(stderr, "tiles: %s\n", d2q9_strerror(status));
+    die("cannot set up the tiles", __LINE__, __FILE__);
   }
 
-  return total;
+  return EXIT_SUCCESS;
 }
 
-int write_values(const t_param params, float** grid, int* obstacles, float* av_vels)
+int run_ab(const t_opts opts, const t_param params, int* obstacles)
 {
-  FILE* fp;                     /* file pointer */
-  const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
-  float local_density;         /* per grid cell sum of densities */
-  float pressure;              /* fluid pressure in grid cell */
-  float u_x;                   /* x-component of velocity in grid cell */
-  float u_y;                   /* y-component of velocity in grid cell */
-  float u;                     /* norm--root of summed squares--of u_x and u_y */
+  const int    steps  = (opts.ab_steps > 0) ? opts.ab_steps : params.maxIters;
+  const size_t ncells = (size_t)params.nx * params.ny;
+  d2q9_ctx* ctx[2];
+  double    elapsed[2];
+  float     av_vel[2];
+  float     maxdiff = 0.f;
+  float**   grid[2];
+  int       status;
+
+  for (int ab = 0; ab < 2; ab++)
+  {
+    double tic;
 
-  fp = fopen(FINALSTATEFILE, "w");
+    status = d2q9_create(&params, obstacles, &ctx[ab]);
 
-  if (fp == NULL)
-  {
-    die("could not open file output file", __LINE__, __FILE__);
+    if (status != D2Q9_OK) die(d2q9_strerror(status), __LINE__, __FILE__);
+
+    use_kernel(opts, ctx[ab], opts.ab[ab]);
+    start_threads(opts, ctx[ab]);
+
+    tic = wtime();
+    d2q9_step(ctx[ab], steps, NULL);
+    elapsed[ab] = wtime() - tic;
+    av_vel[ab]  = d2q9_av_velocity(ctx[ab]);
+    grid[ab]    = d2q9_speeds(ctx[ab]);
   }
 
-  for (int jj = 0; jj < params.ny; jj++)
+  for (int kk = 0; kk < NSPEEDS; kk++)
   {
-    for (int ii = 0; ii < params.nx; ii++)
+    for (size_t ii = 0; ii < ncells; ii++)
     {
-      /* an occupied cell */
-      if (obstacles[ii + jj*params.nx])
-      {
-        u_x = u_y = u = 0.f;
-        pressure = params.density * c_sq;
-      }
-      /* no obstacle */
-      else
-      {
-        local_density = 0.f;
+      /* "sparse" leaves the inside of obstacles as it was */
+      if (obstacles[ii]) continue;
 
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
-          local_density += grid[kk][ii + jj*params.nx];
-        }
-
-        /* compute x velocity component */
-        u_x = (grid[1][ii + jj*params.nx]
-               + grid[5][ii + jj*params.nx]
-               + grid[8][ii + jj*params.nx]
-               - (grid[3][ii + jj*params.nx]
-                  + grid[6][ii + jj*params.nx]
-                  + grid[7][ii + jj*params.nx]))
-              / local_density;
-        /* compute y velocity component */
-        u_y = (grid[2][ii + jj*params.nx]
-               + grid[5][ii + jj*params.nx]
-               + grid[6][ii + jj*params.nx]
-               - (grid[4][ii + jj*params.nx]
-                  + grid[7][ii + jj*params.nx]
-                  + grid[8][ii + jj*params.nx]))
-              / local_density;
-        /* compute norm of velocity */
-        u = sqrtf((u_x * u_x) + (u_y * u_y));
-        /* compute pressure */
-        pressure = local_density * c_sq;
-      }
+      const float diff = fabsf(grid[0][kk][ii] - grid[1][kk][ii]);
 
-      /* write to file */
-      fprintf(fp, "%d %d %.12E %.12E %.12E %.12E %d\n", ii, jj, u_x, u_y, u, pressure, obstacles[ii * params.nx + jj]);
+      /* a NaN in either never compares as within tolerance */
+      if (!(diff <= maxdiff)) maxdiff = (diff == diff) ? diff : INFINITY;
     }
   }
 
-  fclose(fp);
+  printf("==A/B: %d steps==\n", steps);
+  printf("A %-8s time:\t\t\t%.6lf (s)\n", opts.ab[0], elapsed[0]);
+  printf("B %-8s time:\t\t\t%.6lf (s)\n", opts.ab[1], elapsed[1]);
+  printf("B / A time:\t\t\t\t%.3f\n", elapsed[1] / elapsed[0]);
+  printf("Av. velocity A, B:\t\t\t%.12E, %.12E\n", av_vel[0], av_vel[1]);
+  printf("Max speed difference:\t\t\t%.3E (tolerance %.1E): %s\n", maxdiff, opts.ab_tol,
+         (maxdiff <= opts.ab_tol) ? "agree" : "DIFFER");
 
-  fp = fopen(AVVELSFILE, "w");
+  d2q9_destroy(ctx[0]);
+  d2q9_destroy(ctx[1]);
 
-  if (fp == NULL)
+  return (maxdiff <= opts.ab_tol) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int parse_options(int argc, char* argv[], t_opts* opts)
+{
+  memset(opts, 0, sizeof(t_opts));
+  opts->compress_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  opts->sweep_jobs = 1;
+  opts->converge_window = 1000;
+  opts->converge_every = 100;
+  opts->converge_pad = 1;
+  opts->ab_tol = 1e-5f;
+  opts->threads = 1;
+
+  for (int i = 0; i < argc; i++)
   {
-    die("could not open file output file", __LINE__, __FILE__);
+    if (sscanf(argv[i], "--checkpoint-every=%d", &opts->checkpoint_every) == 1) continue;
+    if (sscanf(argv[i], "--flush-every=%d", &opts->flush_every) == 1) continue;
+    if (sscanf(argv[i], "--snapshot-every=%d", &opts->snapshot_every) == 1) continue;
+    if (sscanf(argv[i], "--render-every=%d", &opts->render_every) == 1) continue;
+    if (sscanf(argv[i], "--render-max=%f", &opts->render_max) == 1) continue;
+    if (strcmp(argv[i], "--render") == 0) { opts->render = 1; continue; }
+    if (strcmp(argv[i], "--render-ppm") == 0) { opts->render_ppm = 1; continue; }
+    if (strcmp(argv[i], "--compress=lossless") == 0) { opts->compress = COMPRESS_LOSSLESS; continue; }
+    if (sscanf(argv[i], "--compress=%f", &opts->compress_eb) == 1) { opts->compress = COMPRESS_LOSSY; continue; }
+    if (sscanf(argv[i], "--compress-threads=%d", &opts->compress_threads) == 1) continue;
+    if (strncmp(argv[i], "--sweep=", 8) == 0) { opts->sweep = argv[i] + 8; continue; }
+    if (sscanf(argv[i], "--sweep-jobs=%d", &opts->sweep_jobs) == 1) continue;
+    if (strcmp(argv[i], "--ensemble") == 0) { opts->ensemble = 1; continue; }
+    if (sscanf(argv[i], "--converge=%f", &opts->converge_tol) == 1) continue;
+    if (sscanf(argv[i], "--converge-window=%d", &opts->converge_window) == 1) continue;
+    if (sscanf(argv[i], "--converge-l2=%f", &opts->converge_l2) == 1) continue;
+    if (sscanf(argv[i], "--converge-every=%d", &opts->converge_every) == 1) continue;
+    if (strcmp(argv[i], "--converge-policy=pad") == 0) { opts->converge_pad = 1; continue; }
+    if (strcmp(argv[i], "--converge-policy=truncate") == 0) { opts->converge_pad = 0; continue; }
+    if (strncmp(argv[i], "--warm-start=", 13) == 0) { opts->warm_start = argv[i] + 13; continue; }
+    if (sscanf(argv[i], "--warm-start-factor=%d", &opts->warm_factor) == 1) continue;
+    if (sscanf(argv[i], "--warm-start-iters=%d", &opts->warm_iters) == 1) continue;
+    if (strcmp(argv[i], "--jit") == 0) { opts->jit = 1; continue; }
+    if (strncmp(argv[i], "--jit=", 6) == 0) { opts->jit = 1; opts->jit_dir = argv[i] + 6; continue; }
+    if (strncmp(argv[i], "--kernel=", 9) == 0) { opts->kernel = argv[i] + 9; continue; }
+    if (sscanf(argv[i], "--ab=%31[^,],%31s", opts->ab[0], opts->ab[1]) == 2) continue;
+    if (sscanf(argv[i], "--ab-steps=%d", &opts->ab_steps) == 1) continue;
+    if (sscanf(argv[i], "--ab-tol=%f", &opts->ab_tol) == 1) continue;
+    if (sscanf(argv[i], "--threads=%d", &opts->threads) == 1) continue;
+    if (strncmp(argv[i], "--pin=", 6) == 0) { opts->pin = argv[i] + 6; continue; }
+    if (strncmp(argv[i], "--numa=", 7) == 0) { opts->numa = argv[i] + 7; continue; }
+    if (sscanf(argv[i], "--tile=%d", &opts->tile) == 1) continue;
+
+    fprintf(stderr, "unknown option: %s\n", argv[i]);
+    usage("d2q9-bgk");
   }
 
-  for (int ii = 0; ii < params.maxIters; ii++)
+  if (opts->checkpoint_every < 0 || opts->flush_every < 0 || opts->snapshot_every < 0
+      || opts->render_every < 0) die("output intervals must not be negative", __LINE__, __FILE__);
+
+  if (opts->sweep != NULL && (opts->checkpoint_every > 0 || opts->flush_every > 0 || opts->snapshot_every > 0
+                             || opts->render || opts->render_every > 0))
   {
-    fprintf(fp, "%d:\t%.12E\n", ii, av_vels[ii]);
+    die("periodic output is not available in a sweep", __LINE__, __FILE__);
   }
 
-  fclose(fp);
+  if (opts->ensemble && opts->sweep == NULL) die("--ensemble needs a --sweep file", __LINE__, __FILE__);
+
+  if (opts->converge_tol < 0.f || opts->converge_l2 < 0.f) die("convergence tolerances must not be negative", __LINE__, __FILE__);
+  if (opts->converge_window < 1 || opts->converge_every < 1) die("convergence window and interval must be at least 1", __LINE__, __FILE__);
+  if (opts->sweep != NULL && (opts->converge_tol > 0.f || opts->converge_l2 > 0.f))
+  {
+    die("convergence tests are not available in a sweep", __LINE__, __FILE__);
+  }
+
+  if (opts->warm_factor < 0 || opts->warm_iters < 0) die("warm start factor and steps must not be negative", __LINE__, __FILE__);
+  if (opts->warm_start != NULL && opts->warm_factor > 0) die("use either --warm-start or --warm-start-factor", __LINE__, __FILE__);
+  if (opts->sweep != NULL && (opts->warm_start != NULL || opts->warm_factor > 0))
+  {
+    die("warm starts are not available in a sweep", __LINE__, __FILE__);
+  }
+
+  if ((opts->jit || opts->kernel != NULL) && opts->sweep != NULL) die("--jit and --kernel are not available in a sweep", __LINE__, __FILE__);
+
+  if (opts->ab[0][0] != '\0'
+      && (opts->sweep != NULL || opts->kernel != NULL || opts->warm_start != NULL || opts->warm_factor > 0
+          || opts->converge_tol > 0.f || opts->converge_l2 > 0.f || opts->checkpoint_every > 0
+          || opts->flush_every > 0 || opts->snapshot_every > 0 || opts->render || opts->render_every > 0))
+  {
+    die("--ab runs on its own, without a sweep, --kernel, warm start, convergence test or periodic output", __LINE__, __FILE__);
+  }
+  if (opts->ab_steps < 0 || !(opts->ab_tol >= 0.f)) die("--ab steps and tolerance must not be negative", __LINE__, __FILE__);
+
+  if (opts->threads < 0) die("--threads must not be negative", __LINE__, __FILE__);
+  if (opts->tile < 0) die("--tile must not be negative", __LINE__, __FILE__);
+  if ((opts->threads != 1 || opts->pin != NULL || opts->numa != NULL || opts->tile > 0) && opts->sweep != NULL)
+  {
+    die("--threads, --pin, --numa and --tile are not available in a sweep (see --sweep-jobs)", __LINE__, __FILE__);
+  }
+
+  if (opts->compress == COMPRESS_LOSSY && !(opts->compress_eb > 0.f)) die("compression error bound must be positive", __LINE__, __FILE__);
 
   return EXIT_SUCCESS;
 }
 
+double wtime(void)
+{
+  struct timeval timstr;
+  gettimeofday(&timstr, NULL);
+  return timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+}
+
 void die(const char* message, const int line, const char* file)
 {
   fprintf(stderr, "Error at line %d of file %s:\n", line, file);
@@ -981,6 +2662,45 @@ void die(const char* message, const int line, const char* file)
 
 void usage(const char* exe)
 {
-  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile>\n", exe);
+  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile> [options]\n", exe);
+  fprintf(stderr, "  --checkpoint-every=N   write all speeds to %s every N steps\n", CHECKPOINTFILE);
+  fprintf(stderr, "  --flush-every=N        append av_vels to %s every N steps\n", AVVELSFILE);
+  fprintf(stderr, "  --snapshot-every=N     write u_x, u_y, |u| and pressure to %s every N steps\n", SNAPSHOTFILE);
+  fprintf(stderr, "  --render               render |u| to %s.png at the end\n", IMAGEFILE);
+  fprintf(stderr, "  --render-every=N       render |u| to %s.png every N steps\n", FRAMEFILE);
+  fprintf(stderr, "  --render-ppm           write PPM instead of PNG images\n");
+  fprintf(stderr, "  --render-max=U         fix the top of the colour scale (default: per image max)\n");
+  fprintf(stderr, "  --compress=lossless    compress snapshots and checkpoints without loss\n");
+  fprintf(stderr, "  --compress=E           compress them to within an absolute error of E\n");
+  fprintf(stderr, "  --compress-threads=N   compress N row-blocks at a time (default: all cores)\n");
+  fprintf(stderr, "  --sweep=FILE           run every line of FILE (omega=, accel=, density=, maxIters=,\n");
+  fprintf(stderr, "                         reynolds_dim= overrides) writing %s and %s\n", SWEEPAVVELSFILE, SWEEPFINALSTATEFILE);
+  fprintf(stderr, "  --sweep-jobs=N         run N sweep cases at a time (0 = one per core, default 1)\n");
+  fprintf(stderr, "  --ensemble             run sweep cases %d at a time, one per SIMD lane\n", ENSEMBLE_WIDTH);
+  fprintf(stderr, "  --converge=TOL         stop once av_vels changes by less than TOL (relative) over the window\n");
+  fprintf(stderr, "  --converge-window=N    steps between the av_vels values compared (default 1000)\n");
+  fprintf(stderr, "  --converge-l2=TOL      stop once the relative L2 change of u between samples is below TOL\n");
+  fprintf(stderr, "  --converge-every=N     sample u for --converge-l2 every N steps (default 100)\n");
+  fprintf(stderr, "  --converge-policy=P    after an early stop, pad av_vels to maxIters with the last\n");
+  fprintf(stderr, "                         value (pad, default) or truncate it (truncate)\n");
+  fprintf(stderr, "  --warm-start=FILE      start from a (possibly coarser) %s-format checkpoint\n", CHECKPOINTFILE);
+  fprintf(stderr, "  --warm-start-factor=F  start from a run on a lattice F times coarser\n");
+  fprintf(stderr, "  --warm-start-iters=N   at most N steps of that coarse run (default maxIters)\n");
+  fprintf(stderr, "  --jit[=DIR]            compile the kernel for this nx, ny and omega, caching it in DIR\n");
+  fprintf(stderr, "                         (default $XDG_CACHE_HOME/%s or ~/.cache/%s; compiler $D2Q9_JIT_CC)\n", JITDIR, JITDIR);
+  fprintf(stderr, "  --kernel=NAME          step with kernel NAME (see --list-kernels; jit also takes --jit=DIR)\n");
+  fprintf(stderr, "  --ab=A,B               time kernels A and B from the same start instead of a normal run,\n");
+  fprintf(stderr, "                         and check that they agree\n");
+  fprintf(stderr, "  --ab-steps=N           steps for each of them (default maxIters)\n");
+  fprintf(stderr, "  --ab-tol=T             largest difference in any speed allowed (default 1e-5)\n");
+  fprintf(stderr, "  --threads=N            step blocks of rows on N threads (0 = one per core, default 1)\n");
+  fprintf(stderr, "  --pin=P                pin them: compact, scatter or a CPU list such as 0-3,8 (default none)\n");
+  fprintf(stderr, "  --numa=M               put each block's memory on its thread's node (local, default),\n");
+  fprintf(stderr, "                         interleave it over their nodes (interleave) or leave it (none)\n");
+  fprintf(stderr, "  --tile=R               step tiles of R rows as tasks the threads steal from each other,\n");
+  fprintf(stderr, "                         instead of a fixed block each (default 0 = blocks)\n");
+  fprintf(stderr, "       %s --list-kernels\n", exe);
+  fprintf(stderr, "       %s --pack-obstacles <paramfile> <obstaclefile> <out>\n", exe);
+  fprintf(stderr, "       %s --unpack <in%s> <out>\n", exe, ZIPSUFFIX);
   exit(EXIT_FAILURE);
 }
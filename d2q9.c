@@ -0,0 +1,3337 @@
+/*
+** libd2q9: the lattice Boltzmann solver behind d2q9-bgk.
+** See d2q9.h for the API; everything here reports errors as
+** D2Q9_* status codes and never exits.
+**
+** A context owns three SoA grids of NSPEEDS planes: the state,
+** the scratch space for propagation, and the output of fushion().
+** d2q9_step() swaps the state and output grids after every step
+** and, if that leaves the state in the other grid, copies it back
+** once at the end, so d2q9_speeds() always returns the same planes.
+**
+** All 27 planes are cut from one arena. A step streams through every
+** one of them at the same cell index, so if the planes were a power
+** of two bytes apart (4 MB at 1024x1024) all 27 streams would land in
+** the same cache sets and evict each other long before the cache
+** was full. Each plane therefore starts PLANESTAGGER bytes further
+** past a cache line boundary than the one before. The obstacle map
+** follows the planes in the same arena; what only one kernel uses
+** (the cells of "aos", the lists of the sparse kernels) is allocated
+** when that kernel is selected instead. Arenas of a huge page or more
+** are mapped on a huge page boundary and offered to the kernel for
+** transparent huge pages (or taken from hugetlbfs on request), since
+** at 1024x1024 the 27 streams otherwise touch ~27 000 4 kB pages.
+**
+** d2q9_threads() splits each step into blocks of rows, one per
+** thread, the caller stepping the first. The threads can be pinned to
+** CPUs, and the pages of each block moved to the NUMA node of the
+** thread that steps it (or interleaved over the nodes in use), so a
+** step draws on the memory bandwidth of every socket. The threads
+** live as long as the context. A block's step reads only the row
+** either side of it, so instead of meeting at a barrier after every
+** step each thread waits for its two neighbours alone: a thread held
+** up by a block full of obstacles (or a busy CPU) delays the blocks
+** next to it by a step, not the whole lattice, and the others run on
+** ahead. Waits spin for a while before sleeping, since at 128x128 a
+** step is only a few microseconds of work per thread.
+**
+** d2q9_tiles() cuts the rows finer, into tiles that are stepped as
+** tasks. A tile's next step is ready once it and the tiles either side
+** have finished this one; the thread that finishes the last of those
+** pushes it onto its own deque, and a thread with nothing left steals
+** from the front of another's. Blocks dense with obstacles, or threads
+** sharing a CPU, then even out without a fixed partition.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE          /* MAP_ANONYMOUS, MAP_HUGETLB and MADV_HUGEPAGE */
+#define _GNU_SOURCE              /* sched_setaffinity(), the CPU_* macros and syscall() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <linux/futex.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CPU_RELAX()     _mm_pause()
+#else
+#define CPU_RELAX()
+#endif
+#include "d2q9.h"
+
+#define NSPEEDS         D2Q9_NSPEEDS
+#define CHECKPOINTMAGIC "D2Q9CKPT"
+#define RLEMAGIC        "D2Q9RLE"  /* first word of a run-length encoded obstacle file */
+#define JITCC           "cc"                            /* unless $D2Q9_JIT_CC is set */
+#define JITFLAGS        "-std=c11 -O3 -fPIC -shared"    /* -std=c11 keeps fp-contract off */
+#define JITSYMBOL       "d2q9_jit_fushion"
+#define NGRIDS          3      /* state, scratch and output */
+#define PLANEALIGN      64     /* bytes: a cache line */
+#ifndef PLANESTAGGER
+#define PLANESTAGGER    64     /* bytes between the set offsets of consecutive planes, unless $D2Q9_PLANE_STAGGER */
+#endif
+#define HUGEPAGE        (2 * 1024 * 1024)
+#define NODEDIR         "/sys/devices/system/node"
+#define MAXNODES        64     /* NUMA nodes looked for, and bits in a node mask */
+#define SPINS           4000   /* polls of a barrier or counter before sleeping, unless $D2Q9_SPIN */
+#ifndef BLOCKSIZE
+#define BLOCKSIZE       32     /* cells along a side of a block of the "blocksparse" kernel */
+#endif
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED  1      /* as in <linux/mempolicy.h>, for bind_pages() to ignore */
+#define MPOL_INTERLEAVE 3
+#endif
+
+/* how an arena was obtained, and so how it is released */
+typedef enum
+{
+  ARENA_HEAP,         /* aligned_alloc() */
+  ARENA_MAPPED,       /* mmap(), huge page aligned */
+  ARENA_THP,          /* mmap() and madvise(MADV_HUGEPAGE) */
+  ARENA_HUGETLB       /* mmap(MAP_HUGETLB) */
+} t_arena_kind;
+
+/* cells start to end - 1 of a row of the "runs" kernel, all fluid or all obstacle */
+typedef struct
+{
+  int start, end;
+  int solid;
+} t_run;
+
+/* what the "blocksparse" kernel does with a block */
+typedef enum
+{
+  BLOCK_SOLID,        /* nothing: no fluid in it or beside it */
+  BLOCK_FLUID,        /* fluid_block(): collide every cell */
+  BLOCK_MIXED         /* mixed_block(): collide every cell, then bounce back the obstacles */
+} t_block_kind;
+
+/* where d2q9_threads() puts the lattice's pages */
+typedef enum
+{
+  PLACE_LOCAL,        /* each row block on the node of the thread stepping it */
+  PLACE_INTERLEAVE,   /* round robin over the nodes of the threads */
+  PLACE_NONE          /* wherever they were first touched */
+} t_placement;
+
+#include "d2q9_kernel.h"
+
+typedef d2q9_params t_param;
+
+/* struct to hold the 'speed' values */
+typedef struct
+{
+  float speeds[NSPEEDS];
+} t_speed;
+
+/*
+** The lattice of the "sparse" kernel: only the fluid cells, in row
+** order, and after them the obstacle cells next to the fluid, whose
+** speeds carry what bounces back into it. Each has the compact index
+** it streams each speed from, so a step never looks at the obstacle
+** map or visits a cell deep inside an obstacle.
+*/
+typedef struct
+{
+  int     nfluid;
+  int     ncompact;     /* fluid and obstacle cells listed */
+  int     accel0, accel1;  /* the fluid cells of row ny - 2 */
+  int*    cell;         /* index in the planes of each */
+  int*    source[NSPEEDS];  /* where each takes speed kk from (not kept for 0) */
+  float*  speeds[2][NSPEEDS];  /* state and output, ncompact each */
+  int*    links;        /* the storage of source[] */
+  float*  data;         /* and of speeds[][] */
+  size_t  bytes;
+} t_sparse;
+
+/* a fused propagate/rebound/collide step */
+typedef float (*t_fushion)(const t_param params, int j0, int j1, int* solid, float** restrict grid, float** restrict tmp_grid, float** restrict o_grid);
+
+/* the same step compiled by d2q9_jit(), with the parameters it needs built in */
+typedef float (*t_jit_fushion)(int j0, int j1, int* solid, float** restrict grid, float** restrict tmp_grid, float** restrict o_grid);
+
+/* the text of d2q9_kernel.h, generated by the Makefile */
+static const char kernel_source[] =
+#include "d2q9_kernel.inc"
+;
+
+/*
+** A sense-reversing barrier. Each thread flips its own sense and
+** waits for the shared one to match; the last to arrive resets the
+** count and flips the shared sense. Waiters poll it spins times and
+** then sleep on it with futex(), so short waits cost no system call
+** and long ones (between calls of d2q9_step()) no CPU.
+*/
+typedef struct
+{
+  atomic_int count;     /* threads yet to arrive */
+  atomic_int sense;
+  atomic_int sleepers;  /* threads in futex_wait() */
+  int     nthreads;
+  int     spins;
+} t_barrier;
+
+/* a tile to step, and the step it is to take */
+typedef struct
+{
+  int     tile;
+  int     step;
+} t_task;
+
+/*
+** A tile of rows for the task scheduler. need[s % 2] counts the tiles
+** (itself and the one either side) still to finish step s - 1 before
+** it can take step s; two counters, since the last of one step can
+** come after the first of the next.
+*/
+typedef struct
+{
+  _Alignas(PLANEALIGN) atomic_int need[2];
+  int     j0, j1;       /* rows j0 to j1 - 1 */
+  int     deps;         /* tiles it waits for: 3, or fewer when there are fewer tiles */
+  int     owner;        /* the thread whose block holds it, which gets its first step */
+  int     accelerates;  /* the tile holds row ny - 2 */
+} t_tile;
+
+/*
+** One thread of a pool, and the rows it steps. done counts the steps
+** of the current call it has finished (with tiles, 1 once it has left
+** the call); it leads the struct, which is cache line aligned, so that
+** polling it does not pull in another thread's counter.
+*/
+typedef struct
+{
+  _Alignas(PLANEALIGN) atomic_int done;
+  atomic_int sleepers;  /* neighbours in futex_wait() on done */
+  struct d2q9_ctx* ctx;
+  struct t_pool* pool;
+  pthread_t thread;     /* not started for worker 0, the caller */
+  int     cpu;          /* pinned to, or -1 */
+  int     node;         /* NUMA node of cpu, or -1 */
+  int     j0, j1;       /* rows j0 to j1 - 1 */
+  int     sense;        /* this thread's side of the barrier */
+  int     index;        /* in workers[] */
+  int     accelerates;  /* the block holds row ny - 2 */
+  double  wait;         /* seconds spent waiting for other threads */
+  pthread_mutex_t deque;  /* guards tasks, first and ntasks, which thieves may also peek at without it */
+  t_task* tasks;        /* ready tiles: the owner pushes and pops at the back, thieves take the front */
+  int     first;
+  atomic_int ntasks;
+  long    stepped;      /* tiles stepped by this thread */
+  long    steals;       /* of them taken from another thread */
+} t_worker;
+
+/*
+** The threads of d2q9_threads(). Between calls of d2q9_step() they wait
+** at the barrier for the caller to hand them nsteps steps, which they
+** take waiting only for their neighbours (or, with $D2Q9_SYNC=barrier,
+** for everyone after every step). The average velocity of a step is
+** summed in a ring of nparts + 1 slots, since no block (or tile) can
+** be more than nparts / 2 steps ahead of another; the last to add its
+** share to a step reduces the slot into av_vels.
+*/
+typedef struct t_pool
+{
+  int     nthreads;
+  int     started;      /* threads created besides the caller */
+  t_worker* workers;
+  t_barrier barrier;
+  int     neighbours;   /* wait for the neighbours only, not a barrier a step */
+  int     nsteps;       /* in this call of d2q9_step() */
+  float*  av_vels;      /* where their average velocities go, or NULL */
+  int     nparts;       /* blocks or tiles adding to each step's average velocity */
+  int     nslots;       /* of the ring */
+  atomic_int* arrived;  /* parts that have added to each slot */
+  float*  tot_u;        /* av_velocity() sums, nparts to a slot */
+  int*    tot_cells;
+  size_t  ring_sums;    /* room in tot_u and tot_cells */
+  t_tile* tiles;        /* of d2q9_tiles(), or NULL for a block per thread */
+  int     ntiles;
+  int     tile_rows;
+  t_task* tasks;        /* the threads' deques, ntiles each */
+  atomic_long remaining;  /* tile steps left in this call */
+  atomic_int posted;    /* bumped by every push, for idle threads to sleep on */
+  atomic_int idlers;    /* threads in futex_wait() on posted */
+  pthread_mutex_t lock;      /* guards go, while the workers are started */
+  pthread_cond_t  cond;
+  int     go;           /* all started (or not all could be) */
+  int     running;      /* the workers are in their loop */
+  int     quit;
+  cpu_set_t caller_cpus;  /* the caller's affinity before it was pinned */
+  int     pinned;
+  int     nnodes;       /* NUMA nodes in the machine */
+  char    topology[512];
+  size_t  placement;    /* length of topology up to the part describe_schedule() writes */
+} t_pool;
+
+struct d2q9_ctx
+{
+  t_param params;
+  int*    obstacles;    /* copy of the caller's map, in the arena */
+  int*    solid;        /* solid_cells() of it, which fushion() bounces back */
+  void*   arena;        /* one allocation holding the planes and obstacles */
+  size_t  arena_bytes;
+  t_arena_kind arena_kind;
+  size_t  released;     /* bytes of scratch and output planes given back while "sparse" is in use */
+  size_t  stagger;      /* bytes each plane is shifted by relative to the one before */
+  float*  planes[NGRIDS][NSPEEDS];
+  float** grid;         /* the state, always the planes handed out by d2q9_speeds() */
+  float** tmp_grid;     /* scratch space */
+  float** o_grid;       /* output of fushion() */
+  int     step;         /* steps taken */
+  const struct t_kernel* kernel; /* the fused step in use, one of kernels[] */
+  t_fushion fixed;      /* the fixed-size copy of fushion() for this lattice, or NULL */
+  t_jit_fushion jit;    /* the step loaded by d2q9_jit(), or NULL */
+  void*   jit_handle;   /* dlopen() handle of the library holding jit */
+  t_speed* cells;       /* array-of-structs state and scratch of the "aos" kernel, */
+  t_speed* tmp_cells;   /* allocated when it is selected */
+  t_sparse* sparse;     /* the cell lists of the "sparse" kernel, built when it is selected */
+  unsigned char* blocks; /* the t_block_kind of each block of the "blocksparse" kernel, likewise */
+  t_run*  runs;         /* the runs of the "runs" kernel, row jj's from row_runs[jj] to */
+  int*    row_runs;     /* row_runs[jj + 1] - 1, likewise */
+  t_pool* pool;         /* threads set by d2q9_threads(), or NULL */
+};
+
+/*
+** The registry of fused steps selectable by d2q9_set_kernel(). Each
+** takes rows j0 to j1 - 1 of grid (already accelerated) into o_grid,
+** writing every cell of them; grid and o_grid are ctx->grid and
+** ctx->o_grid, or the other way round for a thread a step ahead
+** (cells that no fluid reads from may be skipped, and then hold
+** whatever they held before). A
+** kernel that can only do the whole lattice at once is not split
+** between threads. A kernel with steps instead takes whole calls of
+** d2q9_step() on state of its own, and leaves the result in ctx->grid.
+** A new kernel is a function and a line in kernels[].
+*/
+typedef struct t_kernel
+{
+  const char* name;
+  const char* about;
+  int (*usable)(const d2q9_ctx* ctx);   /* NULL = always */
+  int (*run)(d2q9_ctx* ctx, float** grid, float** o_grid, int j0, int j1);
+  int blocks;                           /* any j0 and j1, not only 0 and ny */
+  int (*steps)(d2q9_ctx* ctx, int n, float* av_vels);   /* or NULL */
+} t_kernel;
+
+/*
+** function prototypes
+*/
+
+/* the run-length encoded obstacle files of d2q9_write_obstacles(), read a line at a time */
+int read_obstacle_runs(FILE* fp, const d2q9_params* params, int* obstacles, int* status);
+int next_number(FILE* fp, int* value);
+
+/* cut the planes of all three grids and the obstacles from one arena, and fill one with the initial densities */
+int alloc_lattice(d2q9_ctx* ctx);
+void free_lattice(d2q9_ctx* ctx);
+void* map_arena(size_t bytes, const char* hugepages, t_arena_kind* kind, size_t* mapped);
+/* give the pages of the scratch and output planes back (release = 1), or let them fault in again */
+void release_scratch(d2q9_ctx* ctx, int release);
+int init_grid(const t_param params, float** grid);
+
+/*
+** The main calculation methods.
+** timestep calls, in order, the functions:
+** accelerate_flow() and fushion(), which fuses
+** propagate(), rebound() & collision()
+*/
+
+int timestep(d2q9_ctx* ctx);
+
+/* the registered kernels and their availability tests */
+int kernel_aos(d2q9_ctx* ctx, float** grid, float** o_grid, int j0, int j1);
+int kernel_soa(d2q9_ctx* ctx, float** grid, float** o_grid, int j0, int j1);
+int kernel_fixed(d2q9_ctx* ctx, float** grid, float** o_grid, int j0, int j1);
+int kernel_jit(d2q9_ctx* ctx, float** grid, float** o_grid, int j0, int j1);
+int sparse_steps(d2q9_ctx* ctx, int n, float* av_vels);
+int kernel_blocksparse(d2q9_ctx* ctx, float** grid, float** o_grid, int j0, int j1);
+int kernel_runs(d2q9_ctx* ctx, float** grid, float** o_grid, int j0, int j1);
+int has_fixed(const d2q9_ctx* ctx);
+int has_jit(const d2q9_ctx* ctx);
+const t_kernel* find_kernel(const char* name);
+int accelerate_flow(const t_param params,  int* obstacles,float** restrict grid);
+float fushion(const t_param params, int j0, int j1, int* solid,float** restrict grid ,float** restrict tmp_grid ,float** restrict o_grid );
+
+/* the "sparse" kernel: its lists, and accelerate_flow(), fushion() and av_velocity() over them */
+int build_sparse(d2q9_ctx* ctx);
+void free_sparse(t_sparse* sp);
+int sparse_accelerate(const t_param params, const t_sparse* sp, float** restrict speeds);
+int sparse_fushion(const float omega, const t_sparse* sp, float** restrict speeds, float** restrict o_speeds);
+float sparse_velocity(const t_sparse* sp, float** speeds);
+
+/* the "blocksparse" kernel: its map of blocks, and fushion() over an all-fluid or a mixed block */
+int build_blocks(d2q9_ctx* ctx);
+int fluid_block(const t_param params, int j0, int j1, int i0, int i1, float** restrict grid, float** restrict o_grid);
+int mixed_block(const t_param params, int j0, int j1, int i0, int i1, const int* obstacles,
+                float** restrict grid, float** restrict o_grid);
+int edge_column(const t_param params, int j0, int j1, int ii, float** restrict grid, float** restrict o_grid);
+void bounce_cell(const t_param params, int ii, int jj, float** restrict grid, float** restrict o_grid);
+
+/* the "runs" kernel: the runs of each row, and the bounce-back of a solid one */
+int build_runs(d2q9_ctx* ctx);
+int solid_run(const t_param params, int jj, int i0, int i1, float** restrict grid, float** restrict o_grid);
+static inline void collide_cell(const float omega, const float* restrict tmp, float* restrict out);
+
+/* the pool of d2q9_threads(): n steps, a thread's loop and its steps, and a part's share of the average velocity */
+int pool_steps(d2q9_ctx* ctx, int n, float* av_vels);
+void* worker_main(void* arg);
+int run_steps(t_worker* worker);
+void add_velocity(t_pool* pool, int part, int j0, int j1, float** grid, int step);
+int alloc_ring(t_pool* pool, int nparts);
+void describe_schedule(t_pool* pool);
+void stop_pool(t_pool* pool);
+void free_pool(t_pool* pool);
+int pin_cpu(int cpu);
+
+/* the tile scheduler of d2q9_tiles(): a thread's loop, one task, and the deques */
+int run_tiles(t_worker* worker);
+void step_tile(t_worker* worker, t_task task);
+void push_task(t_worker* worker, t_task task);
+int pop_task(t_worker* worker, t_task* task);
+int steal_task(t_worker* worker, t_task* task);
+void wait_task(t_worker* worker, int posted);
+
+/* the pool's barrier, and a worker's progress: publish its done count, or wait for another's to reach steps */
+void barrier_init(t_barrier* barrier, int nthreads, int spins);
+void barrier_wait(t_barrier* barrier, int* sense);
+void publish_progress(t_worker* worker, int steps);
+void wait_progress(t_worker* worker, t_worker* other, int steps);
+void futex_wait(atomic_int* word, int value);
+void futex_wake(atomic_int* word);
+double clock_seconds(void);
+
+/* CPUs and NUMA nodes: the threads' CPUs, and the pages of their blocks */
+int read_cpu_list(const char* text, int* cpus, int max);
+int cpu_nodes(int* node_of, int ncpus);
+int choose_cpus(const char* pinning, const int* node_of, int* cpus, int nthreads);
+const char* place_lattice(const d2q9_ctx* ctx, t_placement placement);
+int bind_pages(void* start, void* end, int mode, const unsigned long* nodes);
+
+/*
+** fushion() is written once, over nx and ny passed as arguments.
+** Besides the generic version, it is compiled again for each of the
+** standard lattice sizes with nx and ny as constants, so the compiler
+** can fold the strides and the periodic wrap-around. d2q9_create()
+** picks the copy that matches params.nx and params.ny (the "fixed"
+** kernel), and falls back to fushion() ("soa"). Build with
+** -DNO_FIXED_SIZES to leave the copies out.
+*/
+t_fushion select_fushion(const t_param params);   /* NULL if no copy matches */
+
+/* write, compile and cache the source of d2q9_jit() */
+int jit_compile(const t_param params, const char* cachedir, const char* library);
+int make_dirs(const char* path);
+unsigned long long hash_string(unsigned long long hash, const char* text);
+
+/* the original array-of-structs steps, kept for reference */
+int propagate(const t_param params, t_speed* cells, t_speed* tmp_cells);
+int rebound(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
+int collision(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
+void swap( t_speed **A, t_speed **B);
+
+/* Sum all the densities in the grid.
+** The total should remain constant from one timestep to the next. */
+float total_density(const t_param params, float** grid);
+
+/* compute average velocity */
+float av_velocity(const t_param params, int* obstacles,float** grid);
+/* its sums over rows j0 to j1 - 1 */
+void av_velocity_rows(const t_param params, int* obstacles, float** grid, int j0, int j1, float* tot_u, int* tot_cells);
+
+/* calculate Reynolds number */
+float calc_reynolds(const t_param params, int* obstacles,float** grid);
+
+static const t_kernel kernels[] =
+{
+  { "aos",   "the original propagate(), rebound() and collision() on an array of structs, "
+             "converted from and to the planes each step", NULL, kernel_aos, 0, NULL },
+  { "soa",   "fushion(): the three steps fused over the nine planes", NULL, kernel_soa, 1, NULL },
+  { "fixed", "fushion() compiled for a standard lattice size", has_fixed, kernel_fixed, 1, NULL },
+  { "jit",   "fushion() compiled by d2q9_jit() for this nx, ny and omega", has_jit, kernel_jit, 1, NULL },
+  { "sparse", "fushion() over a list of the fluid cells and the obstacle cells beside them, with their "
+              "neighbours looked up; obstacle cells deeper in are left as they were", NULL, NULL, 0, sparse_steps },
+  { "blocksparse", "fushion() by blocks of cells: skipped when solid, without tests for obstacles when "
+                   "all fluid", NULL, kernel_blocksparse, 1, NULL },
+  { "runs",  "fushion() by runs of fluid or obstacle cells along each row, with no tests for obstacles",
+             NULL, kernel_runs, 1, NULL },
+};
+
+#define NKERNELS ((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+int d2q9_read_params(const char* paramfile, d2q9_params* params)
+{
+  FILE* fp;      /* file pointer */
+  int   ok;      /* every value was read */
+
+  if (paramfile == NULL || params == NULL) return D2Q9_ERR_ARG;
+
+  /* open the parameter file */
+  fp = fopen(paramfile, "r");
+
+  if (fp == NULL) return D2Q9_ERR_OPEN;
+
+  /* read in the parameter values */
+  ok = fscanf(fp, "%d\n", &(params->nx)) == 1
+       && fscanf(fp, "%d\n", &(params->ny)) == 1
+       && fscanf(fp, "%d\n", &(params->maxIters)) == 1
+       && fscanf(fp, "%d\n", &(params->reynolds_dim)) == 1
+       && fscanf(fp, "%f\n", &(params->density)) == 1
+       && fscanf(fp, "%f\n", &(params->accel)) == 1
+       && fscanf(fp, "%f\n", &(params->omega)) == 1;
+
+  /* and close up the file */
+  fclose(fp);
+
+  if (!ok) return D2Q9_ERR_FORMAT;
+  if (params->nx < 1 || params->ny < 3 || params->maxIters < 0) return D2Q9_ERR_ARG;
+
+  return D2Q9_OK;
+}
+
+int d2q9_read_obstacles(const char* obstaclefile, const d2q9_params* params, int* obstacles)
+{
+  FILE* fp;          /* file pointer */
+  int   xx, yy;      /* generic array indices */
+  int   blocked;     /* indicates whether a cell is blocked by an obstacle */
+  int   retval;      /* to hold return value for checking */
+
+  if (obstaclefile == NULL || params == NULL || obstacles == NULL) return D2Q9_ERR_ARG;
+
+  /* first set all cells in obstacle array to zero */
+  memset(obstacles, 0, sizeof(int) * params->nx * params->ny);
+
+  /* open the obstacle data file */
+  fp = fopen(obstaclefile, "r");
+
+  if (fp == NULL) return D2Q9_ERR_OPEN;
+
+  if (read_obstacle_runs(fp, params, obstacles, &retval))
+  {
+    fclose(fp);
+    return retval;
+  }
+
+  /* read-in the blocked cells list */
+  while ((retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF)
+  {
+    /* 3 values per line, coordinates in range and only 1 for blocked */
+    if (retval != 3 || xx < 0 || xx > params->nx - 1 || yy < 0 || yy > params->ny - 1
+        || blocked != 1)
+    {
+      fclose(fp);
+      return D2Q9_ERR_FORMAT;
+    }
+
+    /* assign to array */
+    obstacles[xx + yy*params->nx] = blocked;
+  }
+
+  /* and close the file */
+  fclose(fp);
+
+  return D2Q9_OK;
+}
+
+/* 1 with *status set if fp is a run-length encoded file, else 0 with fp rewound */
+int read_obstacle_runs(FILE* fp, const d2q9_params* params, int* obstacles, int* status)
+{
+  char magic[sizeof(RLEMAGIC)];
+  int  nx, ny;
+  int  jj, last, start, end;
+  int  retval;
+
+  if (fscanf(fp, "%7s", magic) != 1 || strcmp(magic, RLEMAGIC) != 0)
+  {
+    rewind(fp);
+    return 0;
+  }
+
+  *status = D2Q9_OK;
+
+  if (next_number(fp, &nx) != 1 || next_number(fp, &ny) != 1 || nx != params->nx || ny != params->ny
+      || next_number(fp, &jj) != 0)
+  {
+    *status = D2Q9_ERR_FORMAT;
+    return 1;
+  }
+
+  /* a line per row, or per rows jj-last that are all the same: the index,
+  ** and the cells that are blocked, start to end - 1 */
+  for (;;)
+  {
+    int c;
+
+    retval = next_number(fp, &jj);
+
+    if (retval == 0 && feof(fp)) break;
+    if (retval == 0) continue;   /* an empty line */
+
+    last = jj;
+    if (retval > 0 && (c = getc(fp)) == '-')
+    {
+      c = getc(fp);
+      ungetc(c, fp);
+      retval = (c >= '0' && c <= '9') ? next_number(fp, &last) : -1;
+    }
+    else if (retval > 0)
+    {
+      ungetc(c, fp);
+    }
+
+    if (retval < 0 || last < jj || last > ny - 1)
+    {
+      *status = D2Q9_ERR_FORMAT;
+      return 1;
+    }
+
+    /* the whole pair on this line, so an odd value out cannot take the next row's index */
+    while ((retval = next_number(fp, &start)) > 0)
+    {
+      if (next_number(fp, &end) <= 0 || end <= start || end > nx)
+      {
+        *status = D2Q9_ERR_FORMAT;
+        return 1;
+      }
+
+      for (int yy = jj; yy <= last; yy++)
+      {
+        for (int ii = start; ii < end; ii++) obstacles[ii + yy*nx] = 1;
+      }
+    }
+
+    if (retval < 0)
+    {
+      *status = D2Q9_ERR_FORMAT;
+      return 1;
+    }
+  }
+
+  return 1;
+}
+
+/* the next number on the current line of fp: 1, 0 at the end of the line
+** (which is read) or of the file, or -1 if anything else is next */
+int next_number(FILE* fp, int* value)
+{
+  int c;
+
+  while ((c = getc(fp)) == ' ' || c == '\t' || c == '\r');
+
+  if (c == '\n' || c == EOF) return 0;
+  if (c < '0' || c > '9') return -1;
+
+  for (*value = 0; c >= '0' && c <= '9'; c = getc(fp))
+  {
+    if (*value > (INT_MAX - (c - '0')) / 10) return -1;
+    *value = *value * 10 + (c - '0');
+  }
+
+  ungetc(c, fp);
+
+  return 1;
+}
+
+int d2q9_write_obstacles(const char* filename, const d2q9_params* params, const int* obstacles)
+{
+  FILE* fp;
+  int   ok;
+
+  if (filename == NULL || params == NULL || obstacles == NULL) return D2Q9_ERR_ARG;
+
+  fp = fopen(filename, "w");
+
+  if (fp == NULL) return D2Q9_ERR_OPEN;
+
+  ok = fprintf(fp, "%s %d %d\n", RLEMAGIC, params->nx, params->ny) > 0;
+
+  for (int jj = 0; ok && jj < params->ny; jj++)
+  {
+    const int* cells = obstacles + (size_t)jj * params->nx;
+    int row = 0;   /* whether the row's line has been started */
+    int last = jj; /* the last row the same as this one, which the line covers too */
+
+    while (last + 1 < params->ny && memcmp(cells, cells + (size_t)(last + 1 - jj) * params->nx, sizeof(int) * params->nx) == 0)
+    {
+      last++;
+    }
+
+    for (int ii = 0; ok && ii < params->nx; ii++)
+    {
+      int end = ii;
+
+      if (!obstacles[ii + jj*params->nx]) continue;
+
+      while (end < params->nx && obstacles[end + jj*params->nx]) end++;
+      ok = (row || fprintf(fp, (last > jj) ? "%d-%d" : "%d", jj, last) > 0) && fprintf(fp, " %d %d", ii, end) > 0;
+      row = 1;
+      ii = end;
+    }
+
+    if (ok && row) ok = fputc('\n', fp) != EOF;
+    jj = last;
+  }
+
+  if (fclose(fp) != 0) ok = 0;
+
+  return ok ? D2Q9_OK : D2Q9_ERR_WRITE;
+}
+
+int d2q9_create(const d2q9_params* params, const int* obstacles, d2q9_ctx** ctx)
+{
+  d2q9_ctx* c;
+  size_t    ncells;
+
+  if (params == NULL || obstacles == NULL || ctx == NULL) return D2Q9_ERR_ARG;
+  if (params->nx < 1 || params->ny < 3 || params->omega <= 0.f) return D2Q9_ERR_ARG;
+
+  *ctx = NULL;
+  ncells = (size_t)params->nx * params->ny;
+  c = (d2q9_ctx*)calloc(1, sizeof(d2q9_ctx));
+
+  if (c == NULL) return D2Q9_ERR_NOMEM;
+
+  c->params = *params;
+
+  if (alloc_lattice(c) != D2Q9_OK)
+  {
+    d2q9_destroy(c);
+    return D2Q9_ERR_NOMEM;
+  }
+
+  memcpy(c->obstacles, obstacles, sizeof(int) * ncells);
+
+  /* the obstacles never change, so fushion() is given them as a list once */
+  c->solid = (int*)malloc(sizeof(int) * solid_cells(params->nx, params->ny, obstacles, NULL));
+
+  if (c->solid == NULL)
+  {
+    d2q9_destroy(c);
+    return D2Q9_ERR_NOMEM;
+  }
+
+  solid_cells(params->nx, params->ny, obstacles, c->solid);
+  c->fixed = select_fushion(c->params);
+  c->kernel = find_kernel(c->fixed != NULL ? "fixed" : "soa");
+
+  /* initialise densities */
+  init_grid(c->params, c->grid);
+
+  *ctx = c;
+
+  return D2Q9_OK;
+}
+
+void d2q9_destroy(d2q9_ctx* ctx)
+{
+  if (ctx == NULL) return;
+
+  stop_pool(ctx->pool);
+  free_sparse(ctx->sparse);
+  free(ctx->blocks);
+  free(ctx->runs);
+  free(ctx->row_runs);
+  free(ctx->solid);
+  free_lattice(ctx);
+  if (ctx->jit_handle != NULL) dlclose(ctx->jit_handle);
+  free(ctx->cells);
+  free(ctx->tmp_cells);
+  free(ctx);
+}
+
+int d2q9_reset(d2q9_ctx* ctx, const d2q9_params* params)
+{
+  if (ctx == NULL || params == NULL) return D2Q9_ERR_ARG;
+  if (params->nx != ctx->params.nx || params->ny != ctx->params.ny || params->omega <= 0.f) return D2Q9_ERR_ARG;
+
+  if (ctx->jit != NULL && params->omega != ctx->params.omega)
+  {
+    if (ctx->kernel == find_kernel("jit")) ctx->kernel = find_kernel(ctx->fixed != NULL ? "fixed" : "soa");
+    dlclose(ctx->jit_handle);
+    ctx->jit_handle = NULL;
+    ctx->jit = NULL;
+  }
+
+  ctx->params = *params;
+  ctx->step = 0;
+  init_grid(ctx->params, ctx->grid);
+
+  return D2Q9_OK;
+}
+
+int d2q9_step(d2q9_ctx* ctx, int n, float* av_vels)
+{
+  float** swap_grid;
+
+  if (ctx == NULL || n < 0) return D2Q9_ERR_ARG;
+
+  if (ctx->kernel->steps != NULL)
+  {
+    ctx->kernel->steps(ctx, n, av_vels);
+    ctx->step += n;
+    return D2Q9_OK;
+  }
+
+  if (ctx->pool != NULL && ctx->kernel->blocks)
+  {
+    pool_steps(ctx, n, av_vels);
+  }
+  else
+  {
+    for (int tt = 0; tt < n; tt++)
+    {
+      timestep(ctx);
+
+      /* fushion() writes every cell of o_grid, so it becomes the state */
+      swap_grid = ctx->grid;
+      ctx->grid = ctx->o_grid;
+      ctx->o_grid = swap_grid;
+
+      if (av_vels != NULL) av_vels[tt] = av_velocity(ctx->params, ctx->obstacles, ctx->grid);
+    }
+  }
+
+  ctx->step += n;
+
+  /* an odd no. of swaps leaves the state in the other planes: copy it home */
+  if (n % 2 == 1)
+  {
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      memcpy(ctx->o_grid[kk], ctx->grid[kk], sizeof(float) * ctx->params.nx * ctx->params.ny);
+    }
+
+    swap_grid = ctx->grid;
+    ctx->grid = ctx->o_grid;
+    ctx->o_grid = swap_grid;
+  }
+
+  return D2Q9_OK;
+}
+
+int d2q9_steps_done(const d2q9_ctx* ctx)
+{
+  return ctx->step;
+}
+
+const d2q9_params* d2q9_get_params(const d2q9_ctx* ctx)
+{
+  return &ctx->params;
+}
+
+float** d2q9_speeds(d2q9_ctx* ctx)
+{
+  return ctx->grid;
+}
+
+int d2q9_moments(const d2q9_ctx* ctx, float* rho, float* u_x, float* u_y)
+{
+  const size_t ncells = (size_t)ctx->params.nx * ctx->params.ny;
+  float** grid = ctx->grid;
+
+  for (size_t ii = 0; ii < ncells; ii++)
+  {
+    float local_density = 0.f;
+    float ux = 0.f, uy = 0.f;
+
+    /* occupied cells read as fluid at rest, as in final_state.dat */
+    if (ctx->obstacles[ii])
+    {
+      local_density = ctx->params.density;
+    }
+    else
+    {
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        local_density += grid[kk][ii];
+      }
+
+      ux = (grid[1][ii] + grid[5][ii] + grid[8][ii]
+            - (grid[3][ii] + grid[6][ii] + grid[7][ii]))
+           / local_density;
+      uy = (grid[2][ii] + grid[5][ii] + grid[6][ii]
+            - (grid[4][ii] + grid[7][ii] + grid[8][ii]))
+           / local_density;
+    }
+
+    if (rho != NULL) rho[ii] = local_density;
+    if (u_x != NULL) u_x[ii] = ux;
+    if (u_y != NULL) u_y[ii] = uy;
+  }
+
+  return D2Q9_OK;
+}
+
+float d2q9_av_velocity(const d2q9_ctx* ctx)
+{
+  return av_velocity(ctx->params, ctx->obstacles, ctx->grid);
+}
+
+float d2q9_reynolds(const d2q9_ctx* ctx)
+{
+  return calc_reynolds(ctx->params, ctx->obstacles, ctx->grid);
+}
+
+float d2q9_total_density(const d2q9_ctx* ctx)
+{
+  return total_density(ctx->params, ctx->grid);
+}
+
+int d2q9_checkpoint(const d2q9_ctx* ctx, const char* filename)
+{
+  return d2q9_write_lattice(filename, ctx->params.nx, ctx->params.ny, ctx->step,
+                            (const float* const*)ctx->grid);
+}
+
+int d2q9_restore(d2q9_ctx* ctx, const char* filename)
+{
+  FILE*  fp;
+  char   magic[8];
+  int    header[4];
+  size_t ncells = (size_t)ctx->params.nx * ctx->params.ny;
+
+  if (filename == NULL) return D2Q9_ERR_ARG;
+
+  fp = fopen(filename, "rb");
+
+  if (fp == NULL) return D2Q9_ERR_OPEN;
+
+  if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, CHECKPOINTMAGIC, 8) != 0
+      || fread(header, sizeof(int), 4, fp) != 4
+      || header[0] != ctx->params.nx || header[1] != ctx->params.ny || header[3] != NSPEEDS)
+  {
+    fclose(fp);
+    return D2Q9_ERR_FORMAT;
+  }
+
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    if (fread(ctx->grid[kk], sizeof(float), ncells, fp) != ncells)
+    {
+      fclose(fp);
+      return D2Q9_ERR_FORMAT;
+    }
+  }
+
+  fclose(fp);
+  ctx->step = header[2];
+
+  return D2Q9_OK;
+}
+
+int d2q9_write_lattice(const char* filename, int nx, int ny, int step, const float* const* planes)
+{
+  FILE* fp;
+  char  tmpfile[1024];
+  const int header[4] = { nx, ny, step, NSPEEDS };
+  const size_t ncells = (size_t)nx * ny;
+  int   ok;
+
+  if (filename == NULL || planes == NULL || nx < 1 || ny < 1) return D2Q9_ERR_ARG;
+
+  /* write aside and rename, so a crash never leaves a torn checkpoint */
+  if (snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", filename) >= (int)sizeof(tmpfile)) return D2Q9_ERR_ARG;
+  fp = fopen(tmpfile, "wb");
+
+  if (fp == NULL) return D2Q9_ERR_OPEN;
+
+  ok = fwrite(CHECKPOINTMAGIC, 1, 8, fp) == 8
+       && fwrite(header, sizeof(int), 4, fp) == 4;
+
+  for (int kk = 0; ok && kk < NSPEEDS; kk++)
+  {
+    ok = fwrite(planes[kk], sizeof(float), ncells, fp) == ncells;
+  }
+
+  if (fclose(fp) != 0) ok = 0;
+
+  if (!ok || rename(tmpfile, filename) != 0)
+  {
+    remove(tmpfile);
+    return D2Q9_ERR_WRITE;
+  }
+
+  return D2Q9_OK;
+}
+
+int d2q9_lattice_info(const char* filename, int* nx, int* ny, int* step)
+{
+  FILE* fp;
+  char  magic[8];
+  int   header[4];
+  int   ok;
+
+  if (filename == NULL) return D2Q9_ERR_ARG;
+
+  fp = fopen(filename, "rb");
+
+  if (fp == NULL) return D2Q9_ERR_OPEN;
+
+  ok = fread(magic, 1, 8, fp) == 8 && memcmp(magic, CHECKPOINTMAGIC, 8) == 0
+       && fread(header, sizeof(int), 4, fp) == 4
+       && header[0] >= 1 && header[1] >= 1 && header[3] == NSPEEDS;
+  fclose(fp);
+
+  if (!ok) return D2Q9_ERR_FORMAT;
+
+  if (nx != NULL) *nx = header[0];
+  if (ny != NULL) *ny = header[1];
+  if (step != NULL) *step = header[2];
+
+  return D2Q9_OK;
+}
+
+int d2q9_jit(d2q9_ctx* ctx, const char* cachedir)
+{
+  const char* cc = getenv("D2Q9_JIT_CC");
+  unsigned long long key;
+  char  library[4096];
+  void* handle;
+  void* symbol;
+  int   status;
+
+  if (ctx == NULL || cachedir == NULL || strchr(cachedir, '\'') != NULL) return D2Q9_ERR_ARG;
+
+  /* everything the compiled code depends on goes into the cache key */
+  key = hash_string(14695981039346656037ULL, kernel_source);
+  key = hash_string(key, (cc != NULL) ? cc : JITCC);
+  key = hash_string(key, JITFLAGS);
+
+  if (snprintf(library, sizeof(library), "%s/fushion_%dx%d_%a_%016llx.so", cachedir,
+               ctx->params.nx, ctx->params.ny, ctx->params.omega, key) >= (int)sizeof(library))
+  {
+    return D2Q9_ERR_ARG;
+  }
+
+  if (access(library, R_OK) != 0)
+  {
+    status = jit_compile(ctx->params, cachedir, library);
+
+    if (status != D2Q9_OK) return status;
+  }
+
+  handle = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+
+  if (handle == NULL) return D2Q9_ERR_JIT;
+
+  symbol = dlsym(handle, JITSYMBOL);
+
+  if (symbol == NULL)
+  {
+    dlclose(handle);
+    return D2Q9_ERR_JIT;
+  }
+
+  if (ctx->jit_handle != NULL) dlclose(ctx->jit_handle);
+  ctx->jit_handle = handle;
+  /* POSIX guarantees a data pointer from dlsym() converts to a function pointer */
+  *(void**)&ctx->jit = symbol;
+  ctx->kernel = find_kernel("jit");
+
+  return D2Q9_OK;
+}
+
+const char* d2q9_kernel_name(int index)
+{
+  return (index >= 0 && index < NKERNELS) ? kernels[index].name : NULL;
+}
+
+const char* d2q9_kernel_about(int index)
+{
+  return (index >= 0 && index < NKERNELS) ? kernels[index].about : NULL;
+}
+
+int d2q9_set_kernel(d2q9_ctx* ctx, const char* name)
+{
+  const t_kernel* kernel;
+
+  if (ctx == NULL || name == NULL) return D2Q9_ERR_ARG;
+
+  kernel = find_kernel(name);
+
+  if (kernel == NULL) return D2Q9_ERR_ARG;
+  if (kernel->usable != NULL && !kernel->usable(ctx)) return (kernel->run == kernel_jit) ? D2Q9_ERR_JIT : D2Q9_ERR_ARG;
+  if (!kernel->blocks && ctx->pool != NULL && ctx->pool->nthreads > 1) return D2Q9_ERR_ARG;
+
+  if (kernel->run == kernel_aos && ctx->cells == NULL)
+  {
+    size_t ncells = (size_t)ctx->params.nx * ctx->params.ny;
+
+    ctx->cells     = (t_speed*)malloc(sizeof(t_speed) * ncells);
+    ctx->tmp_cells = (t_speed*)malloc(sizeof(t_speed) * ncells);
+
+    if (ctx->cells == NULL || ctx->tmp_cells == NULL)
+    {
+      free(ctx->cells);
+      free(ctx->tmp_cells);
+      ctx->cells = ctx->tmp_cells = NULL;
+      return D2Q9_ERR_NOMEM;
+    }
+  }
+
+  /* the obstacles never change, so the lists are built once */
+  if (kernel->steps == sparse_steps && ctx->sparse == NULL && build_sparse(ctx) != D2Q9_OK) return D2Q9_ERR_NOMEM;
+  if (kernel->run == kernel_blocksparse && ctx->blocks == NULL && build_blocks(ctx) != D2Q9_OK) return D2Q9_ERR_NOMEM;
+  if (kernel->run == kernel_runs && ctx->runs == NULL && build_runs(ctx) != D2Q9_OK) return D2Q9_ERR_NOMEM;
+
+  /* "sparse" steps its own arrays, and only gathers from and scatters to the state */
+  release_scratch(ctx, kernel->steps == sparse_steps);
+  ctx->kernel = kernel;
+
+  return D2Q9_OK;
+}
+
+const char* d2q9_get_kernel(const d2q9_ctx* ctx)
+{
+  return ctx->kernel->name;
+}
+
+size_t d2q9_memory(const d2q9_ctx* ctx, const char** backing)
+{
+  if (backing != NULL)
+  {
+    switch (ctx->arena_kind)
+    {
+      case ARENA_HUGETLB: *backing = "hugetlbfs huge pages"; break;
+      case ARENA_THP:     *backing = "transparent huge pages"; break;
+      case ARENA_MAPPED:  *backing = "mapped, huge page aligned"; break;
+      default:            *backing = "heap"; break;
+    }
+  }
+
+  return ctx->arena_bytes - ctx->released;
+}
+
+size_t d2q9_kernel_memory(const d2q9_ctx* ctx)
+{
+  if (ctx->kernel->run == kernel_aos) return 2 * sizeof(t_speed) * ctx->params.nx * ctx->params.ny;
+  if (ctx->kernel->steps == sparse_steps) return ctx->sparse->bytes;
+  if (ctx->kernel->run == kernel_blocksparse)
+  {
+    return (size_t)((ctx->params.nx + BLOCKSIZE - 1) / BLOCKSIZE) * ((ctx->params.ny + BLOCKSIZE - 1) / BLOCKSIZE);
+  }
+  if (ctx->kernel->run == kernel_runs)
+  {
+    return sizeof(t_run) * ctx->row_runs[ctx->params.ny] + sizeof(int) * (ctx->params.ny + 1);
+  }
+
+  return 0;
+}
+
+int d2q9_threads(d2q9_ctx* ctx, int nthreads, const char* pinning, const char* placement)
+{
+  const char* env = getenv("D2Q9_SPIN");
+  const char* sync = getenv("D2Q9_SYNC");
+  int         node_of[CPU_SETSIZE];
+  int*        cpus;
+  t_pool*     pool;
+  t_placement place;
+  const char* placed;
+  size_t      len;
+  int         spins;
+  cpu_set_t   allowed;
+
+  if (ctx == NULL || nthreads < 1) return D2Q9_ERR_ARG;
+
+  if (placement == NULL || strcmp(placement, "local") == 0) place = PLACE_LOCAL;
+  else if (strcmp(placement, "interleave") == 0) place = PLACE_INTERLEAVE;
+  else if (strcmp(placement, "none") == 0) place = PLACE_NONE;
+  else return D2Q9_ERR_ARG;
+
+  /* every block has at least one row */
+  if (nthreads > ctx->params.ny) nthreads = ctx->params.ny;
+
+  /* a kernel that only steps the whole lattice would leave the other threads idle */
+  if (nthreads > 1 && !ctx->kernel->blocks) return D2Q9_ERR_ARG;
+
+  pool = (t_pool*)calloc(1, sizeof(t_pool));
+  cpus = (int*)calloc(nthreads, sizeof(int));
+
+  /* sizeof(t_worker) is a multiple of its alignment, so each done has a line to itself */
+  if (pool != NULL) pool->workers = (t_worker*)aligned_alloc(PLANEALIGN, sizeof(t_worker) * nthreads);
+
+  if (pool == NULL || cpus == NULL || pool->workers == NULL || alloc_ring(pool, nthreads) != D2Q9_OK)
+  {
+    free_pool(pool);
+    free(cpus);
+    return D2Q9_ERR_NOMEM;
+  }
+
+  memset(pool->workers, 0, sizeof(t_worker) * nthreads);
+  pool->nnodes = cpu_nodes(node_of, CPU_SETSIZE);
+
+  if (choose_cpus(pinning, node_of, cpus, nthreads) != 0)
+  {
+    free_pool(pool);
+    free(cpus);
+    return D2Q9_ERR_ARG;
+  }
+
+  stop_pool(ctx->pool);
+  ctx->pool = NULL;
+
+  /* one thread left where it is needs no pool */
+  if (nthreads == 1 && cpus[0] < 0)
+  {
+    free_pool(pool);
+    free(cpus);
+    return D2Q9_OK;
+  }
+
+  pool->nthreads   = nthreads;
+  pool->neighbours = sync == NULL || strcmp(sync, "barrier") != 0;
+
+  for (int tt = 0; tt < nthreads; tt++)
+  {
+    t_worker* worker = &pool->workers[tt];
+
+    atomic_init(&worker->done, 0);
+    atomic_init(&worker->sleepers, 0);
+    atomic_init(&worker->ntasks, 0);
+    worker->ctx   = ctx;
+    worker->pool  = pool;
+    worker->index = tt;
+    worker->cpu   = cpus[tt];
+    worker->node  = (cpus[tt] >= 0) ? node_of[cpus[tt]] : -1;
+    worker->j0    = (int)((long)ctx->params.ny * tt / nthreads);
+    worker->j1    = (int)((long)ctx->params.ny * (tt + 1) / nthreads);
+    worker->accelerates = worker->j0 <= ctx->params.ny - 2 && ctx->params.ny - 2 < worker->j1;
+    pthread_mutex_init(&worker->deque, NULL);
+  }
+  free(cpus);
+
+  /* a thread spinning on a CPU it shares with the one it waits for only delays it */
+  spins = (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0 && nthreads > CPU_COUNT(&allowed)) ? 0 : SPINS;
+  if (env != NULL && env[0] != '\0') spins = atoi(env);
+  barrier_init(&pool->barrier, nthreads, (spins > 0) ? spins : 0);
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+
+  /* the caller steps the first block, and is put back where it was by stop_pool() */
+  if (pool->workers[0].cpu >= 0 && sched_getaffinity(0, sizeof(cpu_set_t), &pool->caller_cpus) == 0)
+  {
+    pool->pinned = pin_cpu(pool->workers[0].cpu) == 0;
+  }
+
+  while (pool->started < nthreads - 1
+         && pthread_create(&pool->workers[pool->started + 1].thread, NULL, worker_main, &pool->workers[pool->started + 1]) == 0)
+  {
+    pool->started++;
+  }
+
+  /* the workers wait for this before their first step, so a failure can still stop them */
+  pthread_mutex_lock(&pool->lock);
+  pool->go      = 1;
+  pool->running = pool->started == nthreads - 1;
+  pool->quit    = !pool->running;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  if (!pool->running)
+  {
+    stop_pool(pool);
+    return D2Q9_ERR_NOMEM;
+  }
+
+  ctx->pool = pool;
+  placed = place_lattice(ctx, place);
+
+  /* e.g. "4 threads pinned to CPUs 0 1 2 3 on nodes 0 0 1 1; 2 NUMA nodes, ..." */
+  len = (size_t)snprintf(pool->topology, sizeof(pool->topology), "%d thread%s", nthreads, (nthreads > 1) ? "s" : "");
+
+  if (pool->workers[0].cpu >= 0)
+  {
+    len += snprintf(pool->topology + len, sizeof(pool->topology) - len, " pinned (%s) to CPUs",
+                    (strcmp(pinning, "compact") == 0 || strcmp(pinning, "scatter") == 0) ? pinning : "list");
+    for (int tt = 0; tt < nthreads && len < sizeof(pool->topology); tt++)
+    {
+      len += snprintf(pool->topology + len, sizeof(pool->topology) - len, " %d", pool->workers[tt].cpu);
+    }
+    if (len < sizeof(pool->topology)) len += snprintf(pool->topology + len, sizeof(pool->topology) - len, " on nodes");
+    for (int tt = 0; tt < nthreads && len < sizeof(pool->topology); tt++)
+    {
+      len += snprintf(pool->topology + len, sizeof(pool->topology) - len, " %d", pool->workers[tt].node);
+    }
+  }
+  else
+  {
+    len += snprintf(pool->topology + len, sizeof(pool->topology) - len, ", not pinned");
+  }
+
+  if (len < sizeof(pool->topology))
+  {
+    len += snprintf(pool->topology + len, sizeof(pool->topology) - len, "; %d NUMA node%s, lattice %s",
+                    pool->nnodes, (pool->nnodes > 1) ? "s" : "", placed);
+  }
+  pool->placement = (len < sizeof(pool->topology)) ? len : sizeof(pool->topology) - 1;
+  describe_schedule(pool);
+
+  return D2Q9_OK;
+}
+
+int d2q9_tiles(d2q9_ctx* ctx, int rows)
+{
+  t_pool* pool;
+  t_tile* tiles = NULL;
+  t_task* tasks = NULL;
+  int     ntiles = 0;
+
+  if (ctx == NULL || rows < 0) return D2Q9_ERR_ARG;
+
+  pool = ctx->pool;
+
+  if (pool == NULL) return (rows == 0) ? D2Q9_OK : D2Q9_ERR_ARG;
+  if (rows > ctx->params.ny) rows = ctx->params.ny;
+
+  /* on failure the pool carries on as it was */
+  if (rows > 0)
+  {
+    ntiles = (ctx->params.ny + rows - 1) / rows;
+    tiles  = (t_tile*)aligned_alloc(PLANEALIGN, sizeof(t_tile) * ntiles);
+    tasks  = (t_task*)malloc(sizeof(t_task) * ntiles * pool->nthreads);
+
+    if (tiles == NULL || tasks == NULL || alloc_ring(pool, ntiles) != D2Q9_OK)
+    {
+      free(tiles);
+      free(tasks);
+      return D2Q9_ERR_NOMEM;
+    }
+  }
+  else
+  {
+    alloc_ring(pool, pool->nthreads);
+  }
+
+  free(pool->tiles);
+  free(pool->tasks);
+  pool->tiles     = tiles;
+  pool->tasks     = tasks;
+  pool->ntiles    = ntiles;
+  pool->tile_rows = rows;
+
+  for (int tt = 0; tt < ntiles; tt++)
+  {
+    t_tile* tile = &pool->tiles[tt];
+
+    tile->j0    = tt * rows;
+    tile->j1    = (tile->j0 + rows < ctx->params.ny) ? tile->j0 + rows : ctx->params.ny;
+    tile->deps  = (ntiles < 3) ? ntiles : 3;
+    tile->owner = 0;
+    tile->accelerates = tile->j0 <= ctx->params.ny - 2 && ctx->params.ny - 2 < tile->j1;
+    while (pool->workers[tile->owner].j1 <= tile->j0) tile->owner++;
+  }
+
+  for (int tt = 0; tt < pool->nthreads; tt++)
+  {
+    pool->workers[tt].tasks  = &pool->tasks[(size_t)tt * ntiles];
+    pool->workers[tt].first  = 0;
+    atomic_store(&pool->workers[tt].ntasks, 0);
+  }
+
+  describe_schedule(pool);
+
+  return D2Q9_OK;
+}
+
+long d2q9_steals(const d2q9_ctx* ctx, long* stepped)
+{
+  long steals = 0;
+
+  if (stepped != NULL) *stepped = 0;
+  if (ctx->pool == NULL) return 0;
+
+  for (int tt = 0; tt < ctx->pool->nthreads; tt++)
+  {
+    steals += ctx->pool->workers[tt].steals;
+    if (stepped != NULL) *stepped += ctx->pool->workers[tt].stepped;
+  }
+
+  return steals;
+}
+
+void describe_schedule(t_pool* pool)
+{
+  char* end = pool->topology + pool->placement;
+  const size_t room = sizeof(pool->topology) - pool->placement;
+
+  if (pool->tiles != NULL)
+  {
+    snprintf(end, room, "; %d tile%s of %d row%s with work stealing, spins %d", pool->ntiles, (pool->ntiles > 1) ? "s" : "",
+             pool->tile_rows, (pool->tile_rows > 1) ? "s" : "", pool->barrier.spins);
+  }
+  else
+  {
+    snprintf(end, room, "; %s, spins %d", pool->neighbours ? "waits for neighbours" : "barrier per step", pool->barrier.spins);
+  }
+}
+
+const char* d2q9_topology(const d2q9_ctx* ctx)
+{
+  return (ctx->pool != NULL) ? ctx->pool->topology : "1 thread, not pinned";
+}
+
+double d2q9_thread_wait(const d2q9_ctx* ctx)
+{
+  double wait = 0.0;
+
+  if (ctx->pool == NULL) return 0.0;
+
+  for (int tt = 0; tt < ctx->pool->nthreads; tt++) wait += ctx->pool->workers[tt].wait;
+
+  return wait;
+}
+
+const char* d2q9_strerror(int status)
+{
+  switch (status)
+  {
+    case D2Q9_OK:         return "success";
+    case D2Q9_ERR_ARG:    return "invalid argument";
+    case D2Q9_ERR_NOMEM:  return "out of memory";
+    case D2Q9_ERR_OPEN:   return "could not open file";
+    case D2Q9_ERR_FORMAT: return "malformed or mismatched file";
+    case D2Q9_ERR_WRITE:  return "could not write file";
+    case D2Q9_ERR_JIT:    return "could not compile or load the kernel";
+    default:              return "unknown error";
+  }
+}
+
+int timestep(d2q9_ctx* ctx)
+{
+  accelerate_flow(ctx->params, ctx->obstacles, ctx->grid);
+
+  ctx->kernel->run(ctx, ctx->grid, ctx->o_grid, 0, ctx->params.ny);
+
+
+  return EXIT_SUCCESS;
+}
+
+int kernel_aos(d2q9_ctx* ctx, float** grid, float** o_grid, int j0, int j1)
+{
+  const size_t ncells = (size_t)ctx->params.nx * ctx->params.ny;
+
+  /* always the whole lattice: see blocks in kernels[] */
+  (void)j0;
+  (void)j1;
+
+  for (size_t ii = 0; ii < ncells; ii++)
+  {
+    for (int kk = 0; kk < NSPEEDS; kk++) ctx->cells[ii].speeds[kk] = grid[kk][ii];
+  }
+
+  propagate(ctx->params, ctx->cells, ctx->tmp_cells);
+  rebound(ctx->params, ctx->cells, ctx->tmp_cells, ctx->obstacles);
+  collision(ctx->params, ctx->cells, ctx->tmp_cells, ctx->obstacles);
+
+  for (size_t ii = 0; ii < ncells; ii++)
+  {
+    for (int kk = 0; kk < NSPEEDS; kk++) o_grid[kk][ii] = ctx->cells[ii].speeds[kk];
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int kernel_soa(d2q9_ctx* ctx, float** grid, float** o_grid, int j0, int j1)
+{
+  fushion(ctx->params, j0, j1, ctx->solid, grid, ctx->tmp_grid, o_grid);
+
+  return EXIT_SUCCESS;
+}
+
+int kernel_fixed(d2q9_ctx* ctx, float** grid, float** o_grid, int j0, int j1)
+{
+  ctx->fixed(ctx->params, j0, j1, ctx->solid, grid, ctx->tmp_grid, o_grid);
+
+  return EXIT_SUCCESS;
+}
+
+int kernel_jit(d2q9_ctx* ctx, float** grid, float** o_grid, int j0, int j1)
+{
+  ctx->jit(j0, j1, ctx->solid, grid, ctx->tmp_grid, o_grid);
+
+  return EXIT_SUCCESS;
+}
+
+int sparse_steps(d2q9_ctx* ctx, int n, float* av_vels)
+{
+  t_sparse* sp = ctx->sparse;
+  float**   cur  = sp->speeds[0];
+  float**   next = sp->speeds[1];
+  float**   swap_grid;
+
+  /* the planes may have been written since the last call */
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    for (int ii = 0; ii < sp->ncompact; ii++) cur[kk][ii] = ctx->grid[kk][sp->cell[ii]];
+  }
+
+  for (int tt = 0; tt < n; tt++)
+  {
+    sparse_accelerate(ctx->params, sp, cur);
+    sparse_fushion(ctx->params.omega, sp, cur, next);
+
+    swap_grid = cur;
+    cur = next;
+    next = swap_grid;
+
+    if (av_vels != NULL) av_vels[tt] = sparse_velocity(sp, cur);
+  }
+
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    for (int ii = 0; ii < sp->ncompact; ii++) ctx->grid[kk][sp->cell[ii]] = cur[kk][ii];
+  }
+
+  /* both copies are only scratch between calls, so which is which need not be kept */
+  return EXIT_SUCCESS;
+}
+
+int build_sparse(d2q9_ctx* ctx)
+{
+  /* the offset speed kk moves a cell by */
+  static const int cx[NSPEEDS] = { 0, 1, 0, -1,  0, 1, -1, -1,  1 };
+  static const int cy[NSPEEDS] = { 0, 0, 1,  0, -1, 1,  1, -1, -1 };
+  const int    nx = ctx->params.nx;
+  const int    ny = ctx->params.ny;
+  const size_t ncells = (size_t)nx * ny;
+  t_sparse*    sp;
+  int*         compact;   /* compact index of each cell, or -1 */
+  size_t       stride;    /* floats in a plane, rounded up to a cache line */
+
+  sp = (t_sparse*)calloc(1, sizeof(t_sparse));
+  compact = (int*)malloc(sizeof(int) * ncells);
+
+  if (sp == NULL || compact == NULL)
+  {
+    free(sp);
+    free(compact);
+    return D2Q9_ERR_NOMEM;
+  }
+
+  /* the fluid cells in row order, so av_vels sums them as av_velocity() does */
+  for (int jj = 0; jj < ny; jj++)
+  {
+    if (jj == ny - 2) sp->accel0 = sp->nfluid;
+    for (int ii = 0; ii < nx; ii++)
+    {
+      compact[ii + jj*nx] = ctx->obstacles[ii + jj*nx] ? -1 : sp->nfluid++;
+    }
+    if (jj == ny - 2) sp->accel1 = sp->nfluid;
+  }
+
+  /* then the obstacle cells that some fluid cell streams from */
+  sp->ncompact = sp->nfluid;
+  for (int jj = 0; jj < ny; jj++)
+  {
+    for (int ii = 0; ii < nx; ii++)
+    {
+      int touches = 0;
+
+      if (!ctx->obstacles[ii + jj*nx]) continue;
+
+      for (int kk = 1; kk < NSPEEDS; kk++)
+      {
+        const int xx = (ii + cx[kk] + nx) % nx;
+        const int yy = (jj + cy[kk] + ny) % ny;
+
+        if (!ctx->obstacles[xx + yy*nx]) touches = 1;
+      }
+
+      if (touches) compact[ii + jj*nx] = sp->ncompact++;
+    }
+  }
+
+  stride = ((size_t)sp->ncompact + 16) / 16 * 16;
+  sp->cell  = (int*)malloc(sizeof(int) * (sp->ncompact + 1));
+  sp->links = (int*)malloc(sizeof(int) * (NSPEEDS - 1) * (sp->ncompact + 1));
+  sp->data  = (float*)aligned_alloc(PLANEALIGN, sizeof(float) * 2 * NSPEEDS * stride);
+
+  if (sp->cell == NULL || sp->links == NULL || sp->data == NULL)
+  {
+    free_sparse(sp);
+    free(compact);
+    return D2Q9_ERR_NOMEM;
+  }
+
+  sp->bytes = sizeof(int) * NSPEEDS * (size_t)(sp->ncompact + 1) + sizeof(float) * 2 * NSPEEDS * stride;
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    sp->source[kk]    = (kk > 0) ? sp->links + (size_t)(kk - 1) * (sp->ncompact + 1) : NULL;
+    sp->speeds[0][kk] = sp->data + kk * stride;
+    sp->speeds[1][kk] = sp->data + (NSPEEDS + kk) * stride;
+  }
+
+  for (int jj = 0; jj < ny; jj++)
+  {
+    for (int ii = 0; ii < nx; ii++)
+    {
+      const int cc = compact[ii + jj*nx];
+
+      if (cc < 0) continue;
+
+      sp->cell[cc] = ii + jj*nx;
+
+      for (int kk = 1; kk < NSPEEDS; kk++)
+      {
+        /* a fluid cell pulls speed kk from upstream, which is always listed; an
+        ** obstacle cell gets it back from downstream, or from itself if that is
+        ** not listed, since then nothing reads the result */
+        const int sign = (cc < sp->nfluid) ? -1 : 1;
+        const int from = compact[(ii + sign * cx[kk] + nx) % nx + ((jj + sign * cy[kk] + ny) % ny) * nx];
+
+        sp->source[kk][cc] = (from >= 0) ? from : cc;
+      }
+    }
+  }
+
+  free(compact);
+  ctx->sparse = sp;
+
+  return D2Q9_OK;
+}
+
+void free_sparse(t_sparse* sp)
+{
+  if (sp == NULL) return;
+
+  free(sp->cell);
+  free(sp->links);
+  free(sp->data);
+  free(sp);
+}
+
+int sparse_accelerate(const t_param params, const t_sparse* sp, float** restrict speeds)
+{
+  /* compute weighting factors */
+  float w1 = params.density * params.accel / 9.f;
+  float w2 = params.density * params.accel / 36.f;
+
+  /* the fluid cells of row ny - 2, as accelerate_flow() */
+  for (int ii = sp->accel0; ii < sp->accel1; ii++)
+  {
+    if ((speeds[3][ii] - w1) > 0.f
+        && (speeds[6][ii] - w2) > 0.f
+        && (speeds[7][ii] - w2) > 0.f)
+    {
+      /* increase 'east-side' densities */
+      speeds[1][ii] += w1;
+      speeds[5][ii] += w2;
+      speeds[8][ii] += w2;
+      /* decrease 'west-side' densities */
+      speeds[3][ii] -= w1;
+      speeds[6][ii] -= w2;
+      speeds[7][ii] -= w2;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int sparse_fushion(const float omega, const t_sparse* sp, float** restrict speeds, float** restrict o_speeds)
+{
+  static const int opposite[NSPEEDS] = { 0, 3, 4, 1, 2, 7, 8, 5, 6 };
+
+  /* propagate and collide, with the same arithmetic as fushion() so the results match bit for bit */
+  for (int ii = 0; ii < sp->nfluid; ii++)
+  {
+    float tmp[NSPEEDS];
+    float out[NSPEEDS];
+
+    tmp[0] = speeds[0][ii];
+    for (int kk = 1; kk < NSPEEDS; kk++) tmp[kk] = speeds[kk][sp->source[kk][ii]];
+
+    collide_cell(omega, tmp, out);
+    for (int kk = 0; kk < NSPEEDS; kk++) o_speeds[kk][ii] = out[kk];
+  }
+
+  /* the obstacle cells next to the fluid bounce back what streamed into them */
+  for (int ii = sp->nfluid; ii < sp->ncompact; ii++)
+  {
+    o_speeds[0][ii] = speeds[0][ii];
+    for (int kk = 1; kk < NSPEEDS; kk++) o_speeds[kk][ii] = speeds[opposite[kk]][sp->source[kk][ii]];
+  }
+
+  return EXIT_SUCCESS;
+}
+
+float sparse_velocity(const t_sparse* sp, float** speeds)
+{
+  float tot_u = 0.f;
+
+  /* the same sums as av_velocity_rows(), over the fluid cells in the same order */
+  for (int ii = 0; ii < sp->nfluid; ii++)
+  {
+    float local_density = 0.f;
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      local_density += speeds[kk][ii];
+    }
+
+    float u_x = (speeds[1][ii] + speeds[5][ii] + speeds[8][ii]
+                 - (speeds[3][ii] + speeds[6][ii] + speeds[7][ii]))
+                / local_density;
+    float u_y = (speeds[2][ii] + speeds[5][ii] + speeds[6][ii]
+                 - (speeds[4][ii] + speeds[7][ii] + speeds[8][ii]))
+                / local_density;
+
+    tot_u += sqrtf((u_x * u_x) + (u_y * u_y));
+  }
+
+  return tot_u / (float)sp->nfluid;
+}
+
+int kernel_blocksparse(d2q9_ctx* ctx, float** grid, float** o_grid, int j0, int j1)
+{
+  const int nx = ctx->params.nx;
+  const int bx = (nx + BLOCKSIZE - 1) / BLOCKSIZE;
+
+  for (int by = j0 / BLOCKSIZE; by * BLOCKSIZE < j1; by++)
+  {
+    /* the rows of this band of blocks inside the caller's */
+    const int y0 = (by * BLOCKSIZE > j0) ? by * BLOCKSIZE : j0;
+    const int y1 = ((by + 1) * BLOCKSIZE < j1) ? (by + 1) * BLOCKSIZE : j1;
+
+    for (int xx = 0; xx < bx; xx++)
+    {
+      const int x0 = xx * BLOCKSIZE;
+      const int x1 = (x0 + BLOCKSIZE < nx) ? x0 + BLOCKSIZE : nx;
+
+      switch (ctx->blocks[xx + by * bx])
+      {
+        case BLOCK_FLUID: fluid_block(ctx->params, y0, y1, x0, x1, grid, o_grid); break;
+        case BLOCK_MIXED: mixed_block(ctx->params, y0, y1, x0, x1, ctx->obstacles, grid, o_grid); break;
+        default: break;
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int build_blocks(d2q9_ctx* ctx)
+{
+  const int nx = ctx->params.nx;
+  const int ny = ctx->params.ny;
+  const int bx = (nx + BLOCKSIZE - 1) / BLOCKSIZE;
+  const int by = (ny + BLOCKSIZE - 1) / BLOCKSIZE;
+
+  ctx->blocks = (unsigned char*)malloc((size_t)bx * by);
+
+  if (ctx->blocks == NULL) return D2Q9_ERR_NOMEM;
+
+  for (int yy = 0; yy < by; yy++)
+  {
+    for (int xx = 0; xx < bx; xx++)
+    {
+      int fluid = 0;   /* cells of the block that are fluid */
+      int near = 0;    /* and of it and the cells around it */
+      int cells = 0;
+
+      /* a solid block with fluid beside it still bounces that fluid back */
+      for (int jj = yy * BLOCKSIZE - 1; jj <= (yy + 1) * BLOCKSIZE && jj <= ny; jj++)
+      {
+        for (int ii = xx * BLOCKSIZE - 1; ii <= (xx + 1) * BLOCKSIZE && ii <= nx; ii++)
+        {
+          const int inside = jj >= yy * BLOCKSIZE && jj < (yy + 1) * BLOCKSIZE && jj < ny
+                             && ii >= xx * BLOCKSIZE && ii < (xx + 1) * BLOCKSIZE && ii < nx;
+          const int open = !ctx->obstacles[(ii + nx) % nx + ((jj + ny) % ny) * nx];
+
+          near  += open;
+          fluid += inside && open;
+          cells += inside;
+        }
+      }
+
+      if (fluid == cells) ctx->blocks[xx + yy * bx] = BLOCK_FLUID;
+      else if (near == 0) ctx->blocks[xx + yy * bx] = BLOCK_SOLID;
+      else ctx->blocks[xx + yy * bx] = BLOCK_MIXED;
+    }
+  }
+
+  return D2Q9_OK;
+}
+
+int fluid_block(const t_param params, int j0, int j1, int i0, int i1, float** restrict grid, float** restrict o_grid)
+{
+  const int nx = params.nx;
+  const int ny = params.ny;
+  /* the columns whose neighbours do not wrap around */
+  const int lo = (i0 > 0) ? i0 : 1;
+  const int hi = (i1 < nx) ? i1 : nx - 1;
+
+  if (i0 < lo) edge_column(params, j0, j1, 0, grid, o_grid);
+  if (hi < i1) edge_column(params, j0, j1, nx - 1, grid, o_grid);
+
+  for (int jj = j0; jj < j1; jj++)
+  {
+    const int row   = jj * nx;
+    const int row_n = ((jj + 1) % ny) * nx;
+    const int row_s = ((jj == 0) ? ny - 1 : jj - 1) * nx;
+
+    /* no obstacles to test for, the streamed speeds stay in registers,
+    ** and the planes never overlap, so this vectorises */
+    #pragma GCC ivdep
+    for (int ii = lo; ii < hi; ii++)
+    {
+      float tmp[NSPEEDS];
+      float out[NSPEEDS];
+
+      tmp[0] = grid[0][ii + row];
+      tmp[1] = grid[1][ii - 1 + row];
+      tmp[2] = grid[2][ii + row_s];
+      tmp[3] = grid[3][ii + 1 + row];
+      tmp[4] = grid[4][ii + row_n];
+      tmp[5] = grid[5][ii - 1 + row_s];
+      tmp[6] = grid[6][ii + 1 + row_s];
+      tmp[7] = grid[7][ii + 1 + row_n];
+      tmp[8] = grid[8][ii - 1 + row_n];
+
+      collide_cell(params.omega, tmp, out);
+      for (int kk = 0; kk < NSPEEDS; kk++) o_grid[kk][ii + row] = out[kk];
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int mixed_block(const t_param params, int j0, int j1, int i0, int i1, const int* obstacles,
+                float** restrict grid, float** restrict o_grid)
+{
+  const int nx = params.nx;
+
+  /* collide every cell as if it were fluid, which vectorises, then
+  ** overwrite the obstacles with what bounces back off them */
+  fluid_block(params, j0, j1, i0, i1, grid, o_grid);
+
+  for (int jj = j0; jj < j1; jj++)
+  {
+    for (int ii = i0; ii < i1; ii++)
+    {
+      if (obstacles[ii + jj*nx]) bounce_cell(params, ii, jj, grid, o_grid);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/* what streams into obstacle cell ii, jj, mirrored, as rebound() */
+void bounce_cell(const t_param params, int ii, int jj, float** restrict grid, float** restrict o_grid)
+{
+  const int nx = params.nx;
+  const int ny = params.ny;
+  const int row   = jj * nx;
+  const int row_n = ((jj + 1) % ny) * nx;
+  const int row_s = ((jj == 0) ? ny - 1 : jj - 1) * nx;
+  const int x_e = (ii + 1 == nx) ? 0 : ii + 1;
+  const int x_w = (ii == 0) ? nx - 1 : ii - 1;
+
+  o_grid[0][ii + row] = grid[0][ii + row];
+  o_grid[1][ii + row] = grid[3][x_e + row];
+  o_grid[2][ii + row] = grid[4][ii + row_n];
+  o_grid[3][ii + row] = grid[1][x_w + row];
+  o_grid[4][ii + row] = grid[2][ii + row_s];
+  o_grid[5][ii + row] = grid[7][x_e + row_n];
+  o_grid[6][ii + row] = grid[8][x_w + row_n];
+  o_grid[7][ii + row] = grid[5][x_w + row_s];
+  o_grid[8][ii + row] = grid[6][x_e + row_s];
+}
+
+/* fluid column ii of rows j0 to j1 - 1, wrapping around to the other side for its neighbours */
+int edge_column(const t_param params, int j0, int j1, int ii, float** restrict grid, float** restrict o_grid)
+{
+  const int nx = params.nx;
+  const int ny = params.ny;
+  const int x_e = (ii + 1) % nx;
+  const int x_w = (ii == 0) ? nx - 1 : ii - 1;
+
+  for (int jj = j0; jj < j1; jj++)
+  {
+    const int row   = jj * nx;
+    const int row_n = ((jj + 1) % ny) * nx;
+    const int row_s = ((jj == 0) ? ny - 1 : jj - 1) * nx;
+    float tmp[NSPEEDS];
+    float out[NSPEEDS];
+
+    tmp[0] = grid[0][ii + row];
+    tmp[1] = grid[1][x_w + row];
+    tmp[2] = grid[2][ii + row_s];
+    tmp[3] = grid[3][x_e + row];
+    tmp[4] = grid[4][ii + row_n];
+    tmp[5] = grid[5][x_w + row_s];
+    tmp[6] = grid[6][x_e + row_s];
+    tmp[7] = grid[7][x_e + row_n];
+    tmp[8] = grid[8][x_w + row_n];
+
+    collide_cell(params.omega, tmp, out);
+    for (int kk = 0; kk < NSPEEDS; kk++) o_grid[kk][ii + row] = out[kk];
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int kernel_runs(d2q9_ctx* ctx, float** grid, float** o_grid, int j0, int j1)
+{
+  for (int jj = j0; jj < j1; jj++)
+  {
+    for (int rr = ctx->row_runs[jj]; rr < ctx->row_runs[jj + 1]; rr++)
+    {
+      const t_run run = ctx->runs[rr];
+
+      if (run.solid) solid_run(ctx->params, jj, run.start, run.end, grid, o_grid);
+      else fluid_block(ctx->params, jj, jj + 1, run.start, run.end, grid, o_grid);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int build_runs(d2q9_ctx* ctx)
+{
+  const int nx = ctx->params.nx;
+  const int ny = ctx->params.ny;
+  int nruns = 0;
+
+  /* a run starts at each cell that differs from the one before it in the row */
+  for (int jj = 0; jj < ny; jj++)
+  {
+    for (int ii = 0; ii < nx; ii++)
+    {
+      if (ii == 0 || ctx->obstacles[ii + jj*nx] != ctx->obstacles[ii - 1 + jj*nx]) nruns++;
+    }
+  }
+
+  ctx->runs     = (t_run*)malloc(sizeof(t_run) * nruns);
+  ctx->row_runs = (int*)malloc(sizeof(int) * (ny + 1));
+
+  if (ctx->runs == NULL || ctx->row_runs == NULL)
+  {
+    free(ctx->runs);
+    free(ctx->row_runs);
+    ctx->runs = NULL;
+    ctx->row_runs = NULL;
+    return D2Q9_ERR_NOMEM;
+  }
+
+  nruns = 0;
+  for (int jj = 0; jj < ny; jj++)
+  {
+    ctx->row_runs[jj] = nruns;
+    for (int ii = 0; ii < nx; ii++)
+    {
+      const int solid = ctx->obstacles[ii + jj*nx] != 0;
+
+      if (ii > 0 && solid == ctx->runs[nruns - 1].solid)
+      {
+        ctx->runs[nruns - 1].end = ii + 1;
+        continue;
+      }
+
+      ctx->runs[nruns].start = ii;
+      ctx->runs[nruns].end   = ii + 1;
+      ctx->runs[nruns].solid = solid;
+      nruns++;
+    }
+  }
+  ctx->row_runs[ny] = nruns;
+
+  return D2Q9_OK;
+}
+
+int solid_run(const t_param params, int jj, int i0, int i1, float** restrict grid, float** restrict o_grid)
+{
+  const int nx = params.nx;
+  const int ny = params.ny;
+  const int lo = (i0 > 0) ? i0 : 1;
+  const int hi = (i1 < nx) ? i1 : nx - 1;
+  const int row   = jj * nx;
+  const int row_n = ((jj + 1) % ny) * nx;
+  const int row_s = ((jj == 0) ? ny - 1 : jj - 1) * nx;
+
+  if (i0 < lo) bounce_cell(params, 0, jj, grid, o_grid);
+  if (hi < i1) bounce_cell(params, nx - 1, jj, grid, o_grid);
+
+  /* nine shifted copies, one per speed */
+  #pragma GCC ivdep
+  for (int ii = lo; ii < hi; ii++)
+  {
+    o_grid[0][ii + row] = grid[0][ii + row];
+    o_grid[1][ii + row] = grid[3][ii + 1 + row];
+    o_grid[2][ii + row] = grid[4][ii + row_n];
+    o_grid[3][ii + row] = grid[1][ii - 1 + row];
+    o_grid[4][ii + row] = grid[2][ii + row_s];
+    o_grid[5][ii + row] = grid[7][ii + 1 + row_n];
+    o_grid[6][ii + row] = grid[8][ii - 1 + row_n];
+    o_grid[7][ii + row] = grid[5][ii - 1 + row_s];
+    o_grid[8][ii + row] = grid[6][ii + 1 + row_s];
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/* the collision of fushion(), from a cell's streamed speeds tmp to its new ones in out */
+static inline void collide_cell(const float omega, const float* restrict tmp, float* restrict out)
+{
+  const float c_sq = 1.f / 3.f; /* square of speed of sound */
+  const float w0 = 4.f / 9.f;  /* weighting factor */
+  const float w1 = 1.f / 9.f;  /* weighting factor */
+  const float w2 = 1.f / 36.f; /* weighting factor */
+  float local_density = 0.f;
+
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    local_density += tmp[kk];
+  }
+
+  /* compute x velocity component */
+  const float u_x = (tmp[1] + tmp[5] + tmp[8] - (tmp[3] + tmp[6] + tmp[7])) / local_density;
+  /* compute y velocity component */
+  const float u_y = (tmp[2] + tmp[5] + tmp[6] - (tmp[4] + tmp[7] + tmp[8])) / local_density;
+  /* velocity squared */
+  const float u_sq = u_x * u_x + u_y * u_y;
+
+  /* directional velocity components */
+  float u[NSPEEDS];
+  u[1] =   u_x;        /* east */
+  u[2] =         u_y;  /* north */
+  u[3] = - u_x;        /* west */
+  u[4] =       - u_y;  /* south */
+  u[5] =   u_x + u_y;  /* north-east */
+  u[6] = - u_x + u_y;  /* north-west */
+  u[7] = - u_x - u_y;  /* south-west */
+  u[8] =   u_x - u_y;  /* south-east */
+
+  /* equilibrium densities */
+  float d_equ[NSPEEDS];
+  d_equ[0] = w0 * local_density
+             * (1.f - u_sq / (2.f * c_sq));
+  for (int kk = 1; kk < NSPEEDS; kk++)
+  {
+    const float w = (kk < 5) ? w1 : w2;
+
+    d_equ[kk] = w *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u[kk])+(u[kk]*u[kk])-(u_sq*c_sq))/(2.f*c_sq*c_sq);
+  }
+
+  /* relaxation step */
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    out[kk] = tmp[kk] + omega * (d_equ[kk] - tmp[kk]);
+  }
+}
+
+int pool_steps(d2q9_ctx* ctx, int n, float* av_vels)
+{
+  t_pool*   pool = ctx->pool;
+  t_worker* caller = &pool->workers[0];
+  float**   swap_grid;
+
+  if (n == 0) return EXIT_SUCCESS;
+
+  /* the blocks either side read the accelerated row, so it is done first */
+  accelerate_flow(ctx->params, ctx->obstacles, ctx->grid);
+  pool->nsteps  = n;
+  pool->av_vels = av_vels;
+  for (int tt = 0; tt < pool->nthreads; tt++) atomic_store(&pool->workers[tt].done, 0);
+
+  /* every tile's first step is ready, on the deque of the thread whose block holds it */
+  if (pool->tiles != NULL)
+  {
+    atomic_store(&pool->remaining, (long)pool->ntiles * n);
+    for (int tt = 0; tt < pool->ntiles; tt++)
+    {
+      t_task first = { tt, 0 };
+
+      atomic_store(&pool->tiles[tt].need[0], pool->tiles[tt].deps);
+      atomic_store(&pool->tiles[tt].need[1], pool->tiles[tt].deps);
+      push_task(&pool->workers[pool->tiles[tt].owner], first);
+    }
+  }
+
+  barrier_wait(&pool->barrier, &caller->sense);
+  if (pool->tiles != NULL) run_tiles(caller);
+  else run_steps(caller);
+
+  /* the last step of every block, or every thread out of the scheduler, before the caller reads the lattice */
+  for (int tt = 1; tt < pool->nthreads; tt++) wait_progress(caller, &pool->workers[tt], (pool->tiles != NULL) ? 1 : n);
+
+  if (n % 2 == 1)
+  {
+    swap_grid = ctx->grid;
+    ctx->grid = ctx->o_grid;
+    ctx->o_grid = swap_grid;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+void* worker_main(void* arg)
+{
+  t_worker* worker = (t_worker*)arg;
+  t_pool*   pool = worker->pool;
+  int       quit;
+
+  if (worker->cpu >= 0) pin_cpu(worker->cpu);
+
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->go) pthread_cond_wait(&pool->cond, &pool->lock);
+  quit = pool->quit;
+  pthread_mutex_unlock(&pool->lock);
+
+  while (!quit)
+  {
+    barrier_wait(&pool->barrier, &worker->sense);
+
+    if (pool->quit) break;
+
+    if (pool->tiles != NULL) run_tiles(worker);
+    else run_steps(worker);
+  }
+
+  return NULL;
+}
+
+int run_steps(t_worker* worker)
+{
+  t_pool*   pool = worker->pool;
+  d2q9_ctx* ctx  = worker->ctx;
+  t_worker* below = &pool->workers[(worker->index + pool->nthreads - 1) % pool->nthreads];
+  t_worker* above = &pool->workers[(worker->index + 1) % pool->nthreads];
+  const int nsteps = pool->nsteps;  /* the caller may set the next call's once the last step is published */
+  float**   grid   = ctx->grid;
+  float**   o_grid = ctx->o_grid;
+  float**   swap_grid;
+  double    tic;
+
+  for (int tt = 0; tt < nsteps; tt++)
+  {
+    /*
+    ** Step tt reads the rows either side of the block from grid, which
+    ** the neighbours wrote in their step tt - 1, and overwrites o_grid,
+    ** which they read in that step: both are done once they have
+    ** finished tt steps.
+    */
+    if (pool->neighbours)
+    {
+      wait_progress(worker, below, tt);
+      wait_progress(worker, above, tt);
+    }
+    else if (tt > 0)
+    {
+      tic = clock_seconds();
+      barrier_wait(&pool->barrier, &worker->sense);
+      worker->wait += clock_seconds() - tic;
+    }
+
+    ctx->kernel->run(ctx, grid, o_grid, worker->j0, worker->j1);
+
+    /* the block is still in cache: take its share of the diagnostics now */
+    if (pool->av_vels != NULL) add_velocity(pool, worker->index, worker->j0, worker->j1, o_grid, tt);
+
+    /* the next step's accelerated row, before anyone can read it */
+    if (worker->accelerates && tt + 1 < nsteps) accelerate_flow(ctx->params, ctx->obstacles, o_grid);
+
+    publish_progress(worker, tt + 1);
+
+    swap_grid = grid;
+    grid = o_grid;
+    o_grid = swap_grid;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+void add_velocity(t_pool* pool, int part, int j0, int j1, float** grid, int step)
+{
+  d2q9_ctx* ctx  = pool->workers[0].ctx;
+  const int slot = step % pool->nslots;
+  float*    tot_u = &pool->tot_u[(size_t)slot * pool->nparts];
+  int*      tot_cells = &pool->tot_cells[(size_t)slot * pool->nparts];
+
+  av_velocity_rows(ctx->params, ctx->obstacles, grid, j0, j1, &tot_u[part], &tot_cells[part]);
+
+  /* summed in row order whichever part is last, so the result does not depend on timing */
+  if (atomic_fetch_add(&pool->arrived[slot], 1) == pool->nparts - 1)
+  {
+    float sum_u = 0.f;
+    int   sum_cells = 0;
+
+    for (int tt = 0; tt < pool->nparts; tt++)
+    {
+      sum_u     += tot_u[tt];
+      sum_cells += tot_cells[tt];
+    }
+
+    pool->av_vels[step] = sum_u / (float)sum_cells;
+    atomic_store(&pool->arrived[slot], 0);
+  }
+}
+
+int alloc_ring(t_pool* pool, int nparts)
+{
+  const size_t nsums = (size_t)(nparts + 1) * nparts;
+  atomic_int*  arrived;
+  float*       tot_u;
+  int*         tot_cells;
+
+  /* the ring only grows, so going back to fewer parts cannot fail, and a failure keeps the old one */
+  if (nsums > pool->ring_sums)
+  {
+    arrived   = (atomic_int*)calloc(nparts + 1, sizeof(atomic_int));
+    tot_u     = (float*)calloc(nsums, sizeof(float));
+    tot_cells = (int*)calloc(nsums, sizeof(int));
+
+    if (arrived == NULL || tot_u == NULL || tot_cells == NULL)
+    {
+      free(arrived);
+      free(tot_u);
+      free(tot_cells);
+      return D2Q9_ERR_NOMEM;
+    }
+
+    free(pool->arrived);
+    free(pool->tot_u);
+    free(pool->tot_cells);
+    pool->arrived   = arrived;
+    pool->tot_u     = tot_u;
+    pool->tot_cells = tot_cells;
+    pool->ring_sums = nsums;
+  }
+
+  pool->nparts = nparts;
+  pool->nslots = nparts + 1;
+
+  return D2Q9_OK;
+}
+
+int run_tiles(t_worker* worker)
+{
+  t_pool* pool = worker->pool;
+  t_task  task;
+  int     posted;
+
+  for (;;)
+  {
+    /* read before looking, so a push while we look is not slept through */
+    posted = atomic_load(&pool->posted);
+
+    if (pop_task(worker, &task) || steal_task(worker, &task))
+    {
+      step_tile(worker, task);
+      continue;
+    }
+
+    if (atomic_load(&pool->remaining) == 0) break;
+
+    wait_task(worker, posted);
+  }
+
+  publish_progress(worker, 1);
+
+  return EXIT_SUCCESS;
+}
+
+void step_tile(t_worker* worker, t_task task)
+{
+  t_pool*   pool = worker->pool;
+  d2q9_ctx* ctx  = worker->ctx;
+  t_tile*   tile = &pool->tiles[task.tile];
+  float**   grid   = (task.step % 2 == 0) ? ctx->grid : ctx->o_grid;
+  float**   o_grid = (task.step % 2 == 0) ? ctx->o_grid : ctx->grid;
+  const int around[3] = { (task.tile + pool->ntiles - 1) % pool->ntiles, task.tile, (task.tile + 1) % pool->ntiles };
+
+  ctx->kernel->run(ctx, grid, o_grid, tile->j0, tile->j1);
+
+  if (pool->av_vels != NULL) add_velocity(pool, task.tile, tile->j0, tile->j1, o_grid, task.step);
+
+  worker->stepped++;
+
+  if (task.step + 1 < pool->nsteps)
+  {
+    if (tile->accelerates) accelerate_flow(ctx->params, ctx->obstacles, o_grid);
+
+    /* this tile's rows are what it and its neighbours read next: the last of the three to finish pushes the step */
+    for (int kk = 0; kk < 3; kk++)
+    {
+      t_tile* next = &pool->tiles[around[kk]];
+
+      if ((kk > 0 && around[kk] == around[0]) || (kk > 1 && around[kk] == around[1])) continue;
+
+      if (atomic_fetch_sub(&next->need[(task.step + 1) % 2], 1) == 1)
+      {
+        t_task ready = { around[kk], task.step + 1 };
+
+        /* no decrement for step + 3 can come before this tile has taken step + 1 */
+        atomic_store(&next->need[(task.step + 1) % 2], next->deps);
+        push_task(worker, ready);
+      }
+    }
+  }
+
+  /* the last tile of the call wakes everyone to leave */
+  if (atomic_fetch_sub(&pool->remaining, 1) == 1)
+  {
+    atomic_fetch_add(&pool->posted, 1);
+    if (atomic_load(&pool->idlers) > 0) futex_wake(&pool->posted);
+  }
+}
+
+void push_task(t_worker* worker, t_task task)
+{
+  t_pool* pool = worker->pool;
+  int     ntasks;
+
+  /* a tile has at most one step ready at a time, so ntiles always fit */
+  pthread_mutex_lock(&worker->deque);
+  ntasks = atomic_load_explicit(&worker->ntasks, memory_order_relaxed);
+  worker->tasks[(worker->first + ntasks) % pool->ntiles] = task;
+  atomic_store_explicit(&worker->ntasks, ntasks + 1, memory_order_relaxed);
+  pthread_mutex_unlock(&worker->deque);
+
+  atomic_fetch_add(&pool->posted, 1);
+  if (atomic_load(&pool->idlers) > 0) futex_wake(&pool->posted);
+}
+
+int pop_task(t_worker* worker, t_task* task)
+{
+  int ntasks;
+
+  /* the newest: its rows were just read by the step that made it ready */
+  pthread_mutex_lock(&worker->deque);
+  ntasks = atomic_load_explicit(&worker->ntasks, memory_order_relaxed);
+  if (ntasks > 0)
+  {
+    *task = worker->tasks[(worker->first + ntasks - 1) % worker->pool->ntiles];
+    atomic_store_explicit(&worker->ntasks, ntasks - 1, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&worker->deque);
+
+  return ntasks > 0;
+}
+
+int steal_task(t_worker* worker, t_task* task)
+{
+  t_pool* pool = worker->pool;
+
+  /* the oldest of the next thread that has any, so thieves spread out from their own block */
+  for (int tt = 1; tt < pool->nthreads; tt++)
+  {
+    t_worker* victim = &pool->workers[(worker->index + tt) % pool->nthreads];
+    int       ntasks, found;
+
+    /* only a hint; the count is read again under the lock */
+    if (atomic_load_explicit(&victim->ntasks, memory_order_relaxed) == 0) continue;
+
+    pthread_mutex_lock(&victim->deque);
+    ntasks = atomic_load_explicit(&victim->ntasks, memory_order_relaxed);
+    found = ntasks > 0;
+    if (found)
+    {
+      *task = victim->tasks[victim->first];
+      victim->first = (victim->first + 1) % pool->ntiles;
+      atomic_store_explicit(&victim->ntasks, ntasks - 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&victim->deque);
+
+    if (found)
+    {
+      worker->steals++;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+void wait_task(t_worker* worker, int posted)
+{
+  t_pool*      pool = worker->pool;
+  const double tic = clock_seconds();
+
+  for (int ii = 0; ii < pool->barrier.spins && atomic_load_explicit(&pool->posted, memory_order_acquire) == posted; ii++)
+  {
+    CPU_RELAX();
+  }
+
+  /* as at the barrier: counted before the last look */
+  atomic_fetch_add(&pool->idlers, 1);
+
+  while (atomic_load(&pool->posted) == posted) futex_wait(&pool->posted, posted);
+
+  atomic_fetch_sub(&pool->idlers, 1);
+  worker->wait += clock_seconds() - tic;
+}
+
+void stop_pool(t_pool* pool)
+{
+  if (pool == NULL) return;
+
+  if (pool->running)
+  {
+    pool->quit = 1;
+    barrier_wait(&pool->barrier, &pool->workers[0].sense);
+  }
+
+  for (int tt = 1; tt <= pool->started; tt++) pthread_join(pool->workers[tt].thread, NULL);
+
+  if (pool->pinned) sched_setaffinity(0, sizeof(cpu_set_t), &pool->caller_cpus);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->cond);
+  free_pool(pool);
+}
+
+void free_pool(t_pool* pool)
+{
+  if (pool == NULL) return;
+
+  for (int tt = 0; tt < pool->nthreads; tt++) pthread_mutex_destroy(&pool->workers[tt].deque);
+  free(pool->workers);
+  free(pool->tiles);
+  free(pool->tasks);
+  free(pool->arrived);
+  free(pool->tot_u);
+  free(pool->tot_cells);
+  free(pool);
+}
+
+void barrier_init(t_barrier* barrier, int nthreads, int spins)
+{
+  atomic_init(&barrier->count, nthreads);
+  atomic_init(&barrier->sense, 0);
+  atomic_init(&barrier->sleepers, 0);
+  barrier->nthreads = nthreads;
+  barrier->spins    = spins;
+}
+
+void barrier_wait(t_barrier* barrier, int* sense)
+{
+  const int mine = !*sense;
+
+  *sense = mine;
+
+  if (atomic_fetch_sub(&barrier->count, 1) == 1)
+  {
+    /* nobody can arrive again until the sense flips, so the count is safe to reset first */
+    atomic_store(&barrier->count, barrier->nthreads);
+    atomic_store(&barrier->sense, mine);
+
+    if (atomic_load(&barrier->sleepers) > 0) futex_wake(&barrier->sense);
+    return;
+  }
+
+  for (int ii = 0; ii < barrier->spins; ii++)
+  {
+    if (atomic_load_explicit(&barrier->sense, memory_order_acquire) == mine) return;
+    CPU_RELAX();
+  }
+
+  /* counted before the last look, so the last thread either sees us or we see the flip */
+  atomic_fetch_add(&barrier->sleepers, 1);
+
+  while (atomic_load(&barrier->sense) != mine) futex_wait(&barrier->sense, !mine);
+
+  atomic_fetch_sub(&barrier->sleepers, 1);
+}
+
+void publish_progress(t_worker* worker, int steps)
+{
+  atomic_store(&worker->done, steps);
+
+  if (atomic_load(&worker->sleepers) > 0) futex_wake(&worker->done);
+}
+
+void wait_progress(t_worker* worker, t_worker* other, int steps)
+{
+  const int spins = worker->pool->barrier.spins;
+  double    tic;
+  int       seen;
+
+  if (atomic_load_explicit(&other->done, memory_order_acquire) >= steps) return;
+
+  /* only waits that happen are timed, so a thread that is never held up pays nothing */
+  tic = clock_seconds();
+
+  for (int ii = 0; ii < spins; ii++)
+  {
+    if (atomic_load_explicit(&other->done, memory_order_acquire) >= steps)
+    {
+      worker->wait += clock_seconds() - tic;
+      return;
+    }
+    CPU_RELAX();
+  }
+
+  /* as at the barrier: counted before the last look */
+  atomic_fetch_add(&other->sleepers, 1);
+
+  while ((seen = atomic_load(&other->done)) < steps) futex_wait(&other->done, seen);
+
+  atomic_fetch_sub(&other->sleepers, 1);
+  worker->wait += clock_seconds() - tic;
+}
+
+void futex_wait(atomic_int* word, int value)
+{
+#if defined(__linux__) && defined(SYS_futex)
+  syscall(SYS_futex, (int*)word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+#else
+  (void)word;
+  (void)value;
+  sched_yield();
+#endif
+}
+
+void futex_wake(atomic_int* word)
+{
+#if defined(__linux__) && defined(SYS_futex)
+  syscall(SYS_futex, (int*)word, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+#else
+  (void)word;
+#endif
+}
+
+double clock_seconds(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (double)now.tv_sec + 1e-9 * (double)now.tv_nsec;
+}
+
+int pin_cpu(int cpu)
+{
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+
+  /* 0 is the calling thread, not the whole process */
+  return sched_setaffinity(0, sizeof(cpu_set_t), &set);
+}
+
+int has_fixed(const d2q9_ctx* ctx)
+{
+  return ctx->fixed != NULL;
+}
+
+int has_jit(const d2q9_ctx* ctx)
+{
+  return ctx->jit != NULL;
+}
+
+const t_kernel* find_kernel(const char* name)
+{
+  for (int kk = 0; kk < NKERNELS; kk++)
+  {
+    if (strcmp(kernels[kk].name, name) == 0) return &kernels[kk];
+  }
+
+  return NULL;
+}
+
+int accelerate_flow(const t_param params,  int* obstacles,float** restrict grid)
+{
+  /* compute weighting factors */
+  float w1 = params.density * params.accel / 9.f;
+  float w2 = params.density * params.accel / 36.f;
+
+  /* modify the 2nd row of the grid */
+  int jj = params.ny - 2;
+
+  for (int ii = 0; ii < params.nx; ii++)
+  {
+    /* if the cell is not occupied and
+    ** we don't send a negative density */
+    if (!obstacles[ii + jj*params.nx]
+        && (grid[3][ii + jj*params.nx] - w1) > 0.f
+        && (grid[6][ii + jj*params.nx] - w2) > 0.f
+        && (grid[7][ii + jj*params.nx] - w2) > 0.f)
+    {
+      /* increase 'east-side' densities */
+      grid[1][ii + jj*params.nx] += w1;
+      grid[5][ii + jj*params.nx] += w2;
+      grid[8][ii + jj*params.nx] += w2;
+      /* decrease 'west-side' densities */
+      grid[3][ii + jj*params.nx] -= w1;
+      grid[6][ii + jj*params.nx] -= w2;
+      grid[7][ii + jj*params.nx] -= w2;
+
+
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int propagate(const t_param params, t_speed* cells, t_speed* tmp_cells)
+{
+  /* loop over _all_ cells */
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      /* determine indices of axis-direction neighbours
+      ** respecting periodic boundary conditions (wrap around) */
+      int y_n = (jj + 1) % params.ny;
+      int x_e = (ii + 1) % params.nx;
+      int y_s = (jj == 0) ? (jj + params.ny - 1) : (jj - 1);
+      int x_w = (ii == 0) ? (ii + params.nx - 1) : (ii - 1);
+      /* propagate densities from neighbouring cells, following
+      ** appropriate directions of travel and writing into
+      ** scratch space grid */
+      tmp_cells[ii + jj*params.nx].speeds[0] = cells[ii + jj*params.nx].speeds[0]; /* central cell, no movement */
+      tmp_cells[ii + jj*params.nx].speeds[1] = cells[x_w + jj*params.nx].speeds[1]; /* east */
+      tmp_cells[ii + jj*params.nx].speeds[2] = cells[ii + y_s*params.nx].speeds[2]; /* north */
+      tmp_cells[ii + jj*params.nx].speeds[3] = cells[x_e + jj*params.nx].speeds[3]; /* west */
+      tmp_cells[ii + jj*params.nx].speeds[4] = cells[ii + y_n*params.nx].speeds[4]; /* south */
+      tmp_cells[ii + jj*params.nx].speeds[5] = cells[x_w + y_s*params.nx].speeds[5]; /* north-east */
+      tmp_cells[ii + jj*params.nx].speeds[6] = cells[x_e + y_s*params.nx].speeds[6]; /* north-west */
+      tmp_cells[ii + jj*params.nx].speeds[7] = cells[x_e + y_n*params.nx].speeds[7]; /* south-west */
+      tmp_cells[ii + jj*params.nx].speeds[8] = cells[x_w + y_n*params.nx].speeds[8]; /* south-east */
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int rebound(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+{
+  /* loop over the cells in the grid */
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      /* if the cell contains an obstacle */
+      if (obstacles[jj*params.nx + ii])
+      {
+        /* called after propagate, so taking values from scratch space
+        ** mirroring, and writing into main grid */
+        cells[ii + jj*params.nx].speeds[1] = tmp_cells[ii + jj*params.nx].speeds[3];
+        cells[ii + jj*params.nx].speeds[2] = tmp_cells[ii + jj*params.nx].speeds[4];
+        cells[ii + jj*params.nx].speeds[3] = tmp_cells[ii + jj*params.nx].speeds[1];
+        cells[ii + jj*params.nx].speeds[4] = tmp_cells[ii + jj*params.nx].speeds[2];
+        cells[ii + jj*params.nx].speeds[5] = tmp_cells[ii + jj*params.nx].speeds[7];
+        cells[ii + jj*params.nx].speeds[6] = tmp_cells[ii + jj*params.nx].speeds[8];
+        cells[ii + jj*params.nx].speeds[7] = tmp_cells[ii + jj*params.nx].speeds[5];
+        cells[ii + jj*params.nx].speeds[8] = tmp_cells[ii + jj*params.nx].speeds[6];
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int collision(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+{
+  const float c_sq = 1.f / 3.f; /* square of speed of sound */
+  const float w0 = 4.f / 9.f;  /* weighting factor */
+  const float w1 = 1.f / 9.f;  /* weighting factor */
+  const float w2 = 1.f / 36.f; /* weighting factor */
+
+  /* loop over the cells in the grid
+  ** NB the collision step is called after
+  ** the propagate step and so values of interest
+  ** are in the scratch-space grid */
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      /* don't consider occupied cells */
+      if (!obstacles[ii + jj*params.nx])
+      {
+        /* compute local density total */
+        float local_density = 0.f;
+
+        for (int kk = 0; kk < NSPEEDS; kk++)
+        {
+          local_density += tmp_cells[ii + jj*params.nx].speeds[kk];
+        }
+
+        /* compute x velocity component */
+        float u_x = (tmp_cells[ii + jj*params.nx].speeds[1]
+                      + tmp_cells[ii + jj*params.nx].speeds[5]
+                      + tmp_cells[ii + jj*params.nx].speeds[8]
+                      - (tmp_cells[ii + jj*params.nx].speeds[3]
+                         + tmp_cells[ii + jj*params.nx].speeds[6]
+                         + tmp_cells[ii + jj*params.nx].speeds[7]))
+                     / local_density;
+        /* compute y velocity component */
+        float u_y = (tmp_cells[ii + jj*params.nx].speeds[2]
+                      + tmp_cells[ii + jj*params.nx].speeds[5]
+                      + tmp_cells[ii + jj*params.nx].speeds[6]
+                      - (tmp_cells[ii + jj*params.nx].speeds[4]
+                         + tmp_cells[ii + jj*params.nx].speeds[7]
+                         + tmp_cells[ii + jj*params.nx].speeds[8]))
+                     / local_density;
+
+        /* velocity squared */
+        float u_sq = u_x * u_x + u_y * u_y;
+
+        /* directional velocity components */
+        float u[NSPEEDS];
+        u[1] =   u_x;        /* east */
+        u[2] =         u_y;  /* north */
+        u[3] = - u_x;        /* west */
+        u[4] =       - u_y;  /* south */
+        u[5] =   u_x + u_y;  /* north-east */
+        u[6] = - u_x + u_y;  /* north-west */
+        u[7] = - u_x - u_y;  /* south-west */
+        u[8] =   u_x - u_y;  /* south-east */
+
+        /* equilibrium densities */
+        float d_equ[NSPEEDS];
+        /* zero velocity density: weight w0 */
+        d_equ[0] = w0 * local_density
+                   * (1.f - u_sq / (2.f * c_sq));
+        /* axis speeds: weight w1 */
+        d_equ[1] = w1 * local_density * (1.f + u[1] / c_sq
+                                         + (u[1] * u[1]) / (2.f * c_sq * c_sq)
+                                         - u_sq / (2.f * c_sq));
+        d_equ[2] = w1 * local_density * (1.f + u[2] / c_sq
+                                         + (u[2] * u[2]) / (2.f * c_sq * c_sq)
+                                         - u_sq / (2.f * c_sq));
+        d_equ[3] = w1 * local_density * (1.f + u[3] / c_sq
+                                         + (u[3] * u[3]) / (2.f * c_sq * c_sq)
+                                         - u_sq / (2.f * c_sq));
+        d_equ[4] = w1 * local_density * (1.f + u[4] / c_sq
+                                         + (u[4] * u[4]) / (2.f * c_sq * c_sq)
+                                         - u_sq / (2.f * c_sq));
+        /* diagonal speeds: weight w2 */
+        d_equ[5] = w2 * local_density * (1.f + u[5] / c_sq
+                                         + (u[5] * u[5]) / (2.f * c_sq * c_sq)
+                                         - u_sq / (2.f * c_sq));
+        d_equ[6] = w2 * local_density * (1.f + u[6] / c_sq
+                                         + (u[6] * u[6]) / (2.f * c_sq * c_sq)
+                                         - u_sq / (2.f * c_sq));
+        d_equ[7] = w2 * local_density * (1.f + u[7] / c_sq
+                                         + (u[7] * u[7]) / (2.f * c_sq * c_sq)
+                                         - u_sq / (2.f * c_sq));
+        d_equ[8] = w2 * local_density * (1.f + u[8] / c_sq
+                                         + (u[8] * u[8]) / (2.f * c_sq * c_sq)
+                                         - u_sq / (2.f * c_sq));
+
+        /* relaxation step */
+        for (int kk = 0; kk < NSPEEDS; kk++)
+        {
+          cells[ii + jj*params.nx].speeds[kk] = tmp_cells[ii + jj*params.nx].speeds[kk]
+                                                  + params.omega
+                                                  * (d_equ[kk] - tmp_cells[ii + jj*params.nx].speeds[kk]);
+        }
+      }
+    }
+  }
+
+
+  return EXIT_SUCCESS;
+}
+
+float av_velocity(const t_param params, int* obstacles,float** grid)
+{
+  int    tot_cells = 0;  /* no. of cells used in calculation */
+  float tot_u;          /* accumulated magnitudes of velocity for each cell */
+
+  av_velocity_rows(params, obstacles, grid, 0, params.ny, &tot_u, &tot_cells);
+
+  return tot_u / (float)tot_cells;
+}
+
+void av_velocity_rows(const t_param params, int* obstacles, float** grid, int j0, int j1, float* tot_u_ptr, int* tot_cells_ptr)
+{
+  int    tot_cells = 0;  /* no. of cells used in calculation */
+  float tot_u;          /* accumulated magnitudes of velocity for each cell */
+
+  /* initialise */
+  tot_u = 0.f;
+
+  /* loop over all non-blocked cells */
+  for (int jj = j0; jj < j1; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      /* ignore occupied cells */
+      if (!obstacles[ii + jj*params.nx])
+      {
+        /* local density total */
+        float local_density = 0.f;
+
+        for (int kk = 0; kk < NSPEEDS; kk++)
+        {
+
+          local_density += grid[kk][ii + jj*params.nx];
+        }
+
+
+
+       /* x-component of velocity */
+       float u_x = (grid[1][ii + jj*params.nx]
+                     + grid[5][ii + jj*params.nx]
+                     + grid[8][ii + jj*params.nx]
+                     - (grid[3][ii + jj*params.nx]
+                        + grid[6][ii + jj*params.nx]
+                        + grid[7][ii + jj*params.nx]))
+                    / local_density;
+
+       /* compute y velocity component */
+       float u_y = (grid[2][ii + jj*params.nx]
+                     + grid[5][ii + jj*params.nx]
+                     + grid[6][ii + jj*params.nx]
+                     - (grid[4][ii + jj*params.nx]
+                        + grid[7][ii + jj*params.nx]
+                        + grid[8][ii + jj*params.nx]))
+                    / local_density;
+        /* accumulate the norm of x- and y- velocity components */
+        tot_u += sqrtf((u_x * u_x) + (u_y * u_y));
+        /* increase counter of inspected cells */
+        ++tot_cells;
+      }
+    }
+  }
+
+  *tot_u_ptr = tot_u;
+  *tot_cells_ptr = tot_cells;
+}
+void swap( t_speed **A, t_speed **B){
+    t_speed*temp = *A;
+    *A = *B;
+    *B = temp;
+}
+// void swap(t_speed *x,t_speed *y)
+// {
+//     t_speed t;
+//      t   = *x;
+//     *x   = *y;
+//     *y   =  t;
+// }
+float fushion(const t_param params, int j0, int j1, int* solid,float** restrict grid ,float** restrict tmp_grid ,float** restrict o_grid )
+{
+  return fushion_sized(params.nx, params.ny, params.omega, j0, j1, solid, grid, tmp_grid, o_grid);
+}
+
+#ifndef NO_FIXED_SIZES
+/* fushion() for one lattice size known at compile time */
+#define FUSHION_FIXED(NX, NY) \
+float fushion_##NX##x##NY(const t_param params, int j0, int j1, int* solid, float** restrict grid, float** restrict tmp_grid, float** restrict o_grid) \
+{ \
+  return fushion_sized(NX, NY, params.omega, j0, j1, solid, grid, tmp_grid, o_grid); \
+}
+
+FUSHION_FIXED(128, 128)
+FUSHION_FIXED(128, 256)
+FUSHION_FIXED(256, 256)
+FUSHION_FIXED(1024, 1024)
+
+static const struct
+{
+  int       nx;
+  int       ny;
+  t_fushion kernel;
+} fixed_sizes[] =
+{
+  { 128,  128,  fushion_128x128 },
+  { 128,  256,  fushion_128x256 },
+  { 256,  256,  fushion_256x256 },
+  { 1024, 1024, fushion_1024x1024 },
+};
+#endif
+
+t_fushion select_fushion(const t_param params)
+{
+#ifndef NO_FIXED_SIZES
+  for (size_t ss = 0; ss < sizeof(fixed_sizes) / sizeof(fixed_sizes[0]); ss++)
+  {
+    if (fixed_sizes[ss].nx == params.nx && fixed_sizes[ss].ny == params.ny) return fixed_sizes[ss].kernel;
+  }
+#endif
+
+  return NULL;
+}
+
+int jit_compile(const t_param params, const char* cachedir, const char* library)
+{
+  const char* cc = getenv("D2Q9_JIT_CC");
+  char  source[4200];
+  char  partial[4200];
+  char  command[12800];
+  FILE* fp;
+  int   ok;
+
+  if (make_dirs(cachedir) != 0) return D2Q9_ERR_WRITE;
+
+  /* a private name for each process, so concurrent runs do not collide */
+  snprintf(source, sizeof(source), "%s.%ld.c", library, (long)getpid());
+  snprintf(partial, sizeof(partial), "%s.%ld.tmp", library, (long)getpid());
+
+  fp = fopen(source, "w");
+
+  if (fp == NULL) return D2Q9_ERR_WRITE;
+
+  fprintf(fp, "/* generated by d2q9_jit() for a %dx%d lattice with omega %g */\n\n", params.nx, params.ny, params.omega);
+  fputs(kernel_source, fp);
+  fprintf(fp, "\nfloat %s(int j0, int j1, int* solid, float** restrict grid, float** restrict tmp_grid, float** restrict o_grid)\n", JITSYMBOL);
+  fprintf(fp, "{\n  return fushion_sized(%d, %d, %af, j0, j1, solid, grid, tmp_grid, o_grid);\n}\n", params.nx, params.ny, params.omega);
+  ok = !ferror(fp);
+  ok = (fclose(fp) == 0) && ok;
+
+  if (!ok)
+  {
+    remove(source);
+    return D2Q9_ERR_WRITE;
+  }
+
+  /* the compiler's messages are kept next to the library if it fails */
+  snprintf(command, sizeof(command), "%s %s '%s' -o '%s' > '%s.log' 2>&1",
+           (cc != NULL) ? cc : JITCC, JITFLAGS, source, partial, library);
+  ok = system(command) == 0;
+  remove(source);
+
+  if (!ok || rename(partial, library) != 0)
+  {
+    remove(partial);
+    return D2Q9_ERR_JIT;
+  }
+
+  snprintf(command, sizeof(command), "%s.log", library);
+  remove(command);
+
+  return D2Q9_OK;
+}
+
+int make_dirs(const char* path)
+{
+  char partial[4096];
+  size_t len = strlen(path);
+
+  if (len == 0 || len >= sizeof(partial)) return -1;
+
+  /* mkdir -p: create each missing component in turn */
+  for (size_t ii = 1; ii <= len; ii++)
+  {
+    if (path[ii] == '/' || path[ii] == '\0')
+    {
+      memcpy(partial, path, ii);
+      partial[ii] = '\0';
+
+      if (mkdir(partial, 0755) != 0 && errno != EEXIST) return -1;
+    }
+  }
+
+  return 0;
+}
+
+unsigned long long hash_string(unsigned long long hash, const char* text)
+{
+  /* FNV-1a */
+  for (const unsigned char* c = (const unsigned char*)text; *c != '\0'; c++)
+  {
+    hash = (hash ^ *c) * 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+int alloc_lattice(d2q9_ctx* ctx)
+{
+  const char* env = getenv("D2Q9_PLANE_STAGGER");
+  const size_t plane = ((sizeof(float) * ctx->params.nx * ctx->params.ny + PLANEALIGN - 1) / PLANEALIGN) * PLANEALIGN;
+  size_t bytes;
+
+  /* whole floats, so every plane stays float aligned */
+  ctx->stagger = (env != NULL && env[0] != '\0') ? (size_t)strtoul(env, NULL, 10) : PLANESTAGGER;
+  ctx->stagger -= ctx->stagger % sizeof(float);
+
+  /* plane p starts p * (plane + stagger) bytes in, and the obstacles after the last */
+  bytes = NGRIDS * NSPEEDS * (plane + ctx->stagger);
+  bytes = ((bytes + PLANEALIGN - 1) / PLANEALIGN) * PLANEALIGN;
+  ctx->arena = map_arena(bytes + sizeof(int) * ctx->params.nx * ctx->params.ny, getenv("D2Q9_HUGEPAGES"),
+                         &ctx->arena_kind, &ctx->arena_bytes);
+
+  if (ctx->arena == NULL) return D2Q9_ERR_NOMEM;
+
+  ctx->obstacles = (int*)((char*)ctx->arena + bytes);
+
+  for (int gg = 0; gg < NGRIDS; gg++)
+  {
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      const size_t p = (size_t)gg * NSPEEDS + kk;
+      ctx->planes[gg][kk] = (float*)((char*)ctx->arena + p * (plane + ctx->stagger));
+    }
+  }
+
+  ctx->grid     = ctx->planes[0];
+  ctx->tmp_grid = ctx->planes[1];
+  ctx->o_grid   = ctx->planes[2];
+
+  return D2Q9_OK;
+}
+
+void free_lattice(d2q9_ctx* ctx)
+{
+  if (ctx->arena == NULL) return;
+
+  if (ctx->arena_kind == ARENA_HEAP) free(ctx->arena);
+  else munmap(ctx->arena, ctx->arena_bytes);
+
+  ctx->arena = NULL;
+  ctx->obstacles = NULL;
+}
+
+void release_scratch(d2q9_ctx* ctx, int release)
+{
+  /* planes 1 and 2 run up to the obstacles; only whole pages inside them go */
+  const size_t page  = (ctx->arena_kind == ARENA_HUGETLB) ? HUGEPAGE : (size_t)sysconf(_SC_PAGESIZE);
+  const uintptr_t lo = ((uintptr_t)ctx->planes[1][0] + page - 1) & ~(uintptr_t)(page - 1);
+  const uintptr_t hi = (uintptr_t)ctx->obstacles & ~(uintptr_t)(page - 1);
+
+  if (hi <= lo || (release != 0) == (ctx->released != 0)) return;
+
+  if (release)
+  {
+    /* not huge pages either, or khugepaged would fill the holes again */
+#ifdef MADV_NOHUGEPAGE
+    if (ctx->arena_kind == ARENA_THP) madvise((void*)lo, hi - lo, MADV_NOHUGEPAGE);
+#endif
+    if (madvise((void*)lo, hi - lo, MADV_DONTNEED) == 0) ctx->released = hi - lo;
+  }
+  else
+  {
+    /* the pages fault back in as zeros on first touch; they only ever hold scratch */
+#ifdef MADV_HUGEPAGE
+    if (ctx->arena_kind == ARENA_THP) madvise((void*)lo, hi - lo, MADV_HUGEPAGE);
+#endif
+    ctx->released = 0;
+  }
+}
+
+void* map_arena(size_t bytes, const char* hugepages, t_arena_kind* kind, size_t* mapped)
+{
+  /* "off": never map; "explicit": try hugetlbfs first; anything else: transparent huge pages */
+  const int off      = hugepages != NULL && strcmp(hugepages, "off") == 0;
+  const int explicit = hugepages != NULL && strcmp(hugepages, "explicit") == 0;
+
+#ifdef MAP_ANONYMOUS
+  if (!off && bytes >= HUGEPAGE)
+  {
+    const size_t len = ((bytes + HUGEPAGE - 1) / HUGEPAGE) * HUGEPAGE;
+    char* base;
+
+#ifdef MAP_HUGETLB
+    if (explicit)
+    {
+      base = (char*)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+      if (base != MAP_FAILED)
+      {
+        *kind   = ARENA_HUGETLB;
+        *mapped = len;
+        return base;
+      }
+    }
+#endif
+
+    /* map a huge page too much, then trim both ends to a huge page boundary */
+    base = (char*)mmap(NULL, len + HUGEPAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (base != MAP_FAILED)
+    {
+      char* start = (char*)(((uintptr_t)base + HUGEPAGE - 1) & ~(uintptr_t)(HUGEPAGE - 1));
+
+      if (start > base) munmap(base, start - base);
+      munmap(start + len, base + HUGEPAGE - start);   /* never empty: start < base + HUGEPAGE */
+
+      *kind   = ARENA_MAPPED;
+      *mapped = len;
+#ifdef MADV_HUGEPAGE
+      if (madvise(start, len, MADV_HUGEPAGE) == 0) *kind = ARENA_THP;
+#endif
+      return start;
+    }
+  }
+#else
+  (void)off;
+  (void)explicit;
+#endif
+
+  *kind   = ARENA_HEAP;
+  *mapped = ((bytes + PLANEALIGN - 1) / PLANEALIGN) * PLANEALIGN;
+
+  return aligned_alloc(PLANEALIGN, *mapped);
+}
+
+int read_cpu_list(const char* text, int* cpus, int max)
+{
+  const char* p = text;
+  int n = 0;
+
+  /* "0-3,8,10-11", as in the kernel's cpulist files */
+  while (*p != '\0' && *p != '\n')
+  {
+    char* end;
+    long  lo = strtol(p, &end, 10);
+    long  hi = lo;
+
+    if (end == p || lo < 0 || lo >= CPU_SETSIZE) return -1;
+
+    if (*end == '-')
+    {
+      p  = end + 1;
+      hi = strtol(p, &end, 10);
+
+      if (end == p || hi < lo || hi >= CPU_SETSIZE) return -1;
+    }
+
+    for (long cc = lo; cc <= hi; cc++)
+    {
+      if (n == max) return -1;
+      cpus[n++] = (int)cc;
+    }
+
+    p = end;
+    if (*p == ',') p++;
+    else if (*p != '\0' && *p != '\n') return -1;
+  }
+
+  return n;
+}
+
+int cpu_nodes(int* node_of, int ncpus)
+{
+  int cpus[CPU_SETSIZE];
+  int nnodes = 0;
+
+  /* without NODEDIR everything is node 0 */
+  for (int cc = 0; cc < ncpus; cc++) node_of[cc] = 0;
+
+  for (int nn = 0; nn < MAXNODES; nn++)
+  {
+    char  path[64];
+    char  text[4096];
+    FILE* fp;
+    int   n;
+
+    snprintf(path, sizeof(path), "%s/node%d/cpulist", NODEDIR, nn);
+    fp = fopen(path, "r");
+
+    if (fp == NULL) continue;
+
+    if (fgets(text, sizeof(text), fp) != NULL && (n = read_cpu_list(text, cpus, CPU_SETSIZE)) > 0)
+    {
+      for (int ii = 0; ii < n; ii++)
+      {
+        if (cpus[ii] < ncpus) node_of[cpus[ii]] = nn;
+      }
+    }
+
+    fclose(fp);
+    nnodes++;
+  }
+
+  return (nnodes > 0) ? nnodes : 1;
+}
+
+int choose_cpus(const char* pinning, const int* node_of, int* cpus, int nthreads)
+{
+  int       order[CPU_SETSIZE];
+  int       n = 0;
+  cpu_set_t allowed;
+
+  if (pinning == NULL || strcmp(pinning, "none") == 0)
+  {
+    for (int tt = 0; tt < nthreads; tt++) cpus[tt] = -1;
+    return 0;
+  }
+
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0) return -1;
+
+  if (strcmp(pinning, "compact") == 0)
+  {
+    /* all of one node's CPUs before the next node's */
+    for (int nn = 0; nn < MAXNODES; nn++)
+    {
+      for (int cc = 0; cc < CPU_SETSIZE; cc++)
+      {
+        if (CPU_ISSET(cc, &allowed) && node_of[cc] == nn) order[n++] = cc;
+      }
+    }
+  }
+  else if (strcmp(pinning, "scatter") == 0)
+  {
+    /* the next CPU of each node in turn */
+    cpu_set_t left = allowed;
+
+    while (CPU_COUNT(&left) > 0)
+    {
+      for (int nn = 0; nn < MAXNODES; nn++)
+      {
+        for (int cc = 0; cc < CPU_SETSIZE; cc++)
+        {
+          if (CPU_ISSET(cc, &left) && node_of[cc] == nn)
+          {
+            order[n++] = cc;
+            CPU_CLR(cc, &left);
+            break;
+          }
+        }
+      }
+    }
+  }
+  else
+  {
+    n = read_cpu_list(pinning, order, CPU_SETSIZE);
+
+    for (int ii = 0; ii < n; ii++)
+    {
+      if (!CPU_ISSET(order[ii], &allowed)) return -1;
+    }
+  }
+
+  if (n <= 0) return -1;
+
+  /* more threads than CPUs share them, in the same order */
+  for (int tt = 0; tt < nthreads; tt++) cpus[tt] = order[tt % n];
+
+  return 0;
+}
+
+const char* place_lattice(const d2q9_ctx* ctx, t_placement placement)
+{
+  const t_pool* pool = ctx->pool;
+  const size_t  row = sizeof(float) * ctx->params.nx;   /* of a plane, and of the obstacles */
+  unsigned long nodes = 0;
+  int           failed = 0;
+
+  if (placement == PLACE_NONE) return "first touched";
+  if (pool->nnodes == 1) return "not placed";
+  if (ctx->arena_kind == ARENA_HEAP) return "on the heap, not placed";
+
+  for (int tt = 0; tt < pool->nthreads; tt++)
+  {
+    if (pool->workers[tt].node >= 0) nodes |= 1UL << pool->workers[tt].node;
+  }
+
+  if (nodes == 0) return "not placed (threads not pinned)";
+
+  if (placement == PLACE_INTERLEAVE)
+  {
+    failed = bind_pages(ctx->arena, (char*)ctx->arena + ctx->arena_bytes, MPOL_INTERLEAVE, &nodes) != 0;
+
+    return failed ? "not placed (mbind failed)" : "interleaved over the threads' nodes";
+  }
+
+  /* the pages already touched move; the rest follow the policy when first touched */
+  for (int tt = 0; tt < pool->nthreads; tt++)
+  {
+    const t_worker* worker = &pool->workers[tt];
+    const unsigned long node = 1UL << worker->node;
+
+    if (worker->node < 0) continue;
+
+    for (int gg = 0; gg < NGRIDS; gg++)
+    {
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        char* plane = (char*)ctx->planes[gg][kk];
+        failed |= bind_pages(plane + worker->j0 * row, plane + worker->j1 * row, MPOL_PREFERRED, &node) != 0;
+      }
+    }
+
+    failed |= bind_pages((char*)ctx->obstacles + worker->j0 * row, (char*)ctx->obstacles + worker->j1 * row,
+                         MPOL_PREFERRED, &node) != 0;
+  }
+
+  return failed ? "not placed (mbind failed)" : "local to each row block";
+}
+
+int bind_pages(void* start, void* end, int mode, const unsigned long* nodes)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+  /* whole pages: one shared by two blocks goes to the later one */
+  const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  const uintptr_t lo = (uintptr_t)start & ~(page - 1);
+  const uintptr_t hi = ((uintptr_t)end + page - 1) & ~(page - 1);
+
+  if (hi <= lo) return 0;
+
+  return (int)syscall(SYS_mbind, (void*)lo, hi - lo, mode, nodes, (unsigned long)MAXNODES + 1, MPOL_MF_MOVE);
+#else
+  (void)start;
+  (void)end;
+  (void)mode;
+  (void)nodes;
+
+  return -1;
+#endif
+}
+
+int init_grid(const t_param params, float** grid)
+{
+  float w0 = params.density * 4.f / 9.f;
+  float w1 = params.density      / 9.f;
+  float w2 = params.density      / 36.f;
+
+  //__assume_aligned((*grid_ptr), 64);
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      /* centre */
+      grid[0][ii + jj*params.nx] = w0;
+      /* axis directions */
+      grid[1][ii + jj*params.nx] = w1;
+      grid[2][ii + jj*params.nx] = w1;
+      grid[3][ii + jj*params.nx] = w1;
+      grid[4][ii + jj*params.nx] = w1;
+      /* diagonals */
+      grid[5][ii + jj*params.nx] = w2;
+      grid[6][ii + jj*params.nx] = w2;
+      grid[7][ii + jj*params.nx] = w2;
+      grid[8][ii + jj*params.nx] = w2;
+
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+float calc_reynolds(const t_param params, int* obstacles,float** grid)
+{
+  const float viscosity = 1.f / 6.f * (2.f / params.omega - 1.f);
+
+  return av_velocity(params,  obstacles,grid) * params.reynolds_dim / viscosity;
+}
+
+float total_density(const t_param params, float** grid)
+{
+  float total = 0.f;  /* accumulator */
+
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        total += grid[kk][ii + jj*params.nx];
+      }
+    }
+  }
+
+  return total;
+}
@@ -0,0 +1,211 @@
+/*
+** libd2q9: the d2q9-bgk lattice Boltzmann solver as a library.
+**
+** A context holds one lattice with its parameters and obstacle map.
+** It is created from values already in memory, stepped, read back
+** and checkpointed without going through the text output files:
+**
+**   d2q9_ctx* ctx;
+**   if (d2q9_create(&params, obstacles, &ctx) != D2Q9_OK) ...
+**   d2q9_step(ctx, 1000, av_vels);
+**   d2q9_moments(ctx, rho, u_x, u_y);
+**   d2q9_destroy(ctx);
+**
+** Every call returns a D2Q9_* status instead of exiting; d2q9_strerror()
+** turns one into a message. Cells are indexed ii + jj*nx, and the
+** speeds of a cell are numbered
+**
+**   6 2 5
+**    \|/
+**   3-0-1
+**    /|\
+**   7 4 8
+*/
+
+#ifndef D2Q9_H
+#define D2Q9_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define D2Q9_NSPEEDS 9
+
+/* status codes */
+#define D2Q9_OK          0
+#define D2Q9_ERR_ARG     1  /* bad argument or parameter value */
+#define D2Q9_ERR_NOMEM   2  /* out of memory */
+#define D2Q9_ERR_OPEN    3  /* could not open a file */
+#define D2Q9_ERR_FORMAT  4  /* malformed or mismatched file contents */
+#define D2Q9_ERR_WRITE   5  /* could not write a file */
+#define D2Q9_ERR_JIT     6  /* could not compile or load a specialised kernel */
+
+/* the values of a parameter file */
+typedef struct
+{
+  int    nx;            /* no. of cells in x-direction */
+  int    ny;            /* no. of cells in y-direction */
+  int    maxIters;      /* no. of iterations */
+  int    reynolds_dim;  /* dimension for Reynolds number */
+  float density;       /* density per link */
+  float accel;         /* density redistribution */
+  float omega;         /* relaxation parameter */
+} d2q9_params;
+
+typedef struct d2q9_ctx d2q9_ctx;
+
+/* read a parameter file, and an obstacle file into nx*ny ints (1 = blocked) */
+int d2q9_read_params(const char* paramfile, d2q9_params* params);
+int d2q9_read_obstacles(const char* obstaclefile, const d2q9_params* params, int* obstacles);
+
+/*
+** Obstacle files list a line "x y 1" for each blocked cell. They may
+** also be run-length encoded, as d2q9_write_obstacles() writes them:
+** "D2Q9RLE nx ny", then a line "y start end start end ..." for each
+** row with blocked cells, which are start to end - 1 of each pair. A
+** line "y0-y1 start end ..." stands for rows y0 to y1, all the same.
+** d2q9_read_obstacles() reads either kind.
+*/
+int d2q9_write_obstacles(const char* filename, const d2q9_params* params, const int* obstacles);
+
+/* a lattice at rest with the given parameters; the obstacles are copied */
+int  d2q9_create(const d2q9_params* params, const int* obstacles, d2q9_ctx** ctx);
+void d2q9_destroy(d2q9_ctx* ctx);
+
+/*
+** Bring the lattice back to rest with new parameters of the same nx
+** and ny (D2Q9_ERR_ARG otherwise), keeping its memory, kernel and
+** threads, and count steps from 0 again. A kernel from d2q9_jit()
+** is dropped if omega changes, since omega is compiled into it.
+*/
+int  d2q9_reset(d2q9_ctx* ctx, const d2q9_params* params);
+
+/* advance n steps, storing the average velocity after each in av_vels (may be NULL) */
+int d2q9_step(d2q9_ctx* ctx, int n, float* av_vels);
+
+/* steps taken since creation (or as restored from a checkpoint) */
+int d2q9_steps_done(const d2q9_ctx* ctx);
+const d2q9_params* d2q9_get_params(const d2q9_ctx* ctx);
+
+/*
+** The nine speed planes of nx*ny floats each. They are the context's
+** own storage: they stay at the same addresses for its lifetime and
+** may be read or written between calls to d2q9_step(), but the
+** plane pointers themselves must not be changed.
+*/
+float** d2q9_speeds(d2q9_ctx* ctx);
+
+/* density and velocity of every cell; any pointer may be NULL to skip that field */
+int d2q9_moments(const d2q9_ctx* ctx, float* rho, float* u_x, float* u_y);
+
+float d2q9_av_velocity(const d2q9_ctx* ctx);
+float d2q9_reynolds(const d2q9_ctx* ctx);
+float d2q9_total_density(const d2q9_ctx* ctx);
+
+/*
+** Checkpoint files hold "D2Q9CKPT", the ints nx, ny, step and 9, then
+** the nine planes. d2q9_restore() needs a file of the context's size.
+*/
+int d2q9_checkpoint(const d2q9_ctx* ctx, const char* filename);
+int d2q9_restore(d2q9_ctx* ctx, const char* filename);
+int d2q9_write_lattice(const char* filename, int nx, int ny, int step, const float* const* planes);
+int d2q9_lattice_info(const char* filename, int* nx, int* ny, int* step);
+
+/*
+** Step with a copy of the kernel compiled for this context's nx, ny
+** and omega, written into the code as literals. The shared library
+** is built once by the system compiler ($D2Q9_JIT_CC, default cc) in
+** cachedir, which is created if needed, and reused by later calls
+** with the same key. On any error the context keeps its built-in
+** kernel, so a failure here is safe to ignore. The results are
+** bit-identical either way.
+*/
+int d2q9_jit(d2q9_ctx* ctx, const char* cachedir);
+
+/*
+** The fused step can be any of a registry of kernels, listed by
+** index from 0 until d2q9_kernel_name() returns NULL. A context
+** starts with "fixed" when its size has one and "soa" otherwise, and
+** d2q9_jit() switches it to "jit". d2q9_set_kernel() returns
+** D2Q9_ERR_ARG for a name that is unknown or not usable here.
+*/
+const char* d2q9_kernel_name(int index);
+const char* d2q9_kernel_about(int index);
+int d2q9_set_kernel(d2q9_ctx* ctx, const char* name);
+const char* d2q9_get_kernel(const d2q9_ctx* ctx);
+
+/*
+** A context keeps its planes and obstacle map in one arena. When that
+** is at least a huge page (2 MB) it is mapped on a huge page boundary
+** and marked for transparent huge pages. $D2Q9_HUGEPAGES=explicit
+** tries hugetlbfs pages first, and =off always uses the heap. This
+** returns the arena's size and describes how it is backed. While
+** "sparse" is the kernel, the pages of the two planes of scratch are
+** given back to the system and left out of the size.
+*/
+size_t d2q9_memory(const d2q9_ctx* ctx, const char** backing);
+
+/*
+** What the kernel keeps besides the arena: the array of structs of
+** "aos", the map of blocks of "blocksparse", the runs of fluid and
+** obstacle along each row of "runs", or the cell lists of "sparse".
+** That one steps only the fluid cells and the obstacle cells next to
+** them, in two compact copies of their speeds. The planes of
+** d2q9_speeds() stay, since it hands them out, and each call gathers
+** from and scatters to them, so its memory is those planes and the
+** lists. After each call of "sparse" or "blocksparse" the planes hold
+** the same speeds in the fluid as any other kernel's, but inside the
+** obstacles, where nothing reaches the fluid, they are left as they
+** were.
+*/
+size_t d2q9_kernel_memory(const d2q9_ctx* ctx);
+
+/*
+** Step with nthreads threads (at most ny), each taking a block of
+** rows; the calling thread steps the first, and 1 goes back to
+** stepping alone. pinning is NULL or "none", "compact" (a NUMA node's
+** CPUs before the next node's), "scatter" (a CPU of each node in
+** turn) or a list such as "0-3,8", any of them reused in order when
+** there are more threads than CPUs. placement is NULL or "local"
+** (each block's pages on its thread's node), "interleave" (over the
+** threads' nodes) or "none", and needs pinned threads. The speeds
+** are the same for any number of threads; the average velocity is
+** summed block by block and may differ in the last bits. Each thread
+** waits only for the blocks either side of its own to finish a step
+** before starting the next, so within one call of d2q9_step() some
+** may run a few steps ahead of others ($D2Q9_SYNC=barrier makes them
+** all meet after every step instead). They wait by polling $D2Q9_SPIN
+** times (default 4000, or 0 when they outnumber the CPUs) and then
+** sleeping. d2q9_topology() describes the result, and
+** d2q9_thread_wait() is the seconds the threads have spent waiting for
+** each other while stepping, summed over all of them. "aos" and
+** "sparse" only step the whole lattice at once, on the calling thread,
+** so with either of them more than one thread is D2Q9_ERR_ARG, and so
+** is selecting either of them while there are.
+*/
+int d2q9_threads(d2q9_ctx* ctx, int nthreads, const char* pinning, const char* placement);
+const char* d2q9_topology(const d2q9_ctx* ctx);
+double d2q9_thread_wait(const d2q9_ctx* ctx);
+
+/*
+** Instead of a fixed block per thread, step the threads of
+** d2q9_threads() in tiles of rows rows (0 goes back to blocks). Each
+** step of a tile is a task, ready once the tile and the one either side
+** have finished the step before; a thread runs the tasks it made ready
+** itself and, with none left, steals from the other threads. Call it
+** after d2q9_threads(), which resets it. d2q9_steals() returns the
+** tasks stolen so far and sets *stepped (if not NULL) to all the tasks
+** run.
+*/
+int d2q9_tiles(d2q9_ctx* ctx, int rows);
+long d2q9_steals(const d2q9_ctx* ctx, long* stepped);
+
+const char* d2q9_strerror(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
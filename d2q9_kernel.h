@@ -0,0 +1,207 @@
+/*
+** The fused propagate, rebound and collide step of libd2q9.
+**
+** This header is included by d2q9.c, and its text is also embedded
+** in the library (as d2q9_kernel.inc) so that d2q9_jit() can
+** compile it again with nx, ny and omega written in as literals.
+** It must therefore stay self-contained.
+**
+** It steps rows j0 to j1 - 1 only, reading the rows either side, so
+** threads can each take a block of rows of the same step.
+**
+** Every cell is collided as if it were fluid, with no test of the
+** obstacle map, and the obstacle cells of the rows are then
+** overwritten with what bounced back off them. They come from a list
+** made once by solid_cells(): the obstacle cells of row jj are
+** solid[solid[jj]] to solid[solid[jj + 1] - 1], as ii + jj*nx.
+*/
+
+#ifndef D2Q9_KERNEL_H
+#define D2Q9_KERNEL_H
+
+#include <stdlib.h>
+
+#ifndef NSPEEDS
+#define NSPEEDS 9
+#endif
+
+/* fills solid (if not NULL) with the list of obstacles, and returns its length */
+static inline int solid_cells(const int nx, const int ny, const int* obstacles, int* solid)
+{
+  int len = ny + 1;   /* the row offsets come first */
+
+  for (int jj = 0; jj < ny; jj++)
+  {
+    if (solid != NULL) solid[jj] = len;
+    for (int ii = 0; ii < nx; ii++)
+    {
+      if (!obstacles[ii + jj*nx]) continue;
+      if (solid != NULL) solid[len] = ii + jj*nx;
+      len++;
+    }
+  }
+  if (solid != NULL) solid[ny] = len;
+
+  return len;
+}
+
+static inline float fushion_sized(const int nx, const int ny, const float omega, const int j0, const int j1, int* solid, float** restrict grid, float** restrict tmp_grid, float** restrict o_grid)
+{
+  //CONSTS FROM COLLISION
+  const float c_sq = 1.f / 3.f; /* square of speed of sound */
+  const float w0 = 4.f / 9.f;  /* weighting factor */
+  const float w1 = 1.f / 9.f;  /* weighting factor */
+  const float w2 = 1.f / 36.f; /* weighting factor */
+
+  #pragma omp simd
+  /* loop over all cells of the block */
+  for (int jj = j0; jj < j1; jj++)
+  {
+    for (int ii = 0; ii < nx; ii++)
+    {
+      //PROPAGATE
+      /* determine indices of axis-direction neighbours
+      ** respecting periodic boundary conditions (wrap around) */
+      int y_n = (jj + 1) % ny;
+      int x_e = (ii + 1) % nx;
+      int y_s = (jj == 0) ? (jj + ny - 1) : (jj - 1);
+      int x_w = (ii == 0) ? (ii + nx - 1) : (ii - 1);
+      /* propagate densities from neighbouring cells, following
+      ** appropriate directions of travel and writing into
+      ** scratch space grid */
+
+
+      tmp_grid[0][ii + jj*nx] = grid[0][ii + jj*nx]; /* central cell, no movement */
+      tmp_grid[1][ii + jj*nx] = grid[1][x_w + jj*nx]; /* east */
+      tmp_grid[2][ii + jj*nx] = grid[2][ii + y_s*nx]; /* north */
+      tmp_grid[3][ii + jj*nx] = grid[3][x_e + jj*nx]; /* west */
+      tmp_grid[4][ii + jj*nx] = grid[4][ii + y_n*nx]; /* south */
+      tmp_grid[5][ii + jj*nx] = grid[5][x_w + y_s*nx]; /* north-east */
+      tmp_grid[6][ii + jj*nx] = grid[6][x_e + y_s*nx]; /* north-west */
+      tmp_grid[7][ii + jj*nx] = grid[7][x_e + y_n*nx]; /* south-west */
+      tmp_grid[8][ii + jj*nx] = grid[8][x_w + y_n*nx]; /* south-east */
+    // }}
+    //
+    //   for (int jj = 0; jj < ny; jj++)
+    //   {
+    //     for (int ii = 0; ii < nx; ii++)
+    //     {
+
+      //COLLISION
+      /* obstacle cells too, since they are overwritten below */
+      {
+        /* compute local density total */
+        float local_density = 0.f;
+
+        for (int kk = 0; kk < NSPEEDS; kk++)
+        {
+          //local_density += tmp_cells[ii + jj*nx].speeds[kk];
+          local_density += tmp_grid[kk][ii + jj*nx];
+        }
+
+
+
+        /* compute x velocity component */
+       const float u_x = (tmp_grid[1][ii + jj*nx]
+                     + tmp_grid[5][ii + jj*nx]
+                     + tmp_grid[8][ii + jj*nx]
+                     - (tmp_grid[3][ii + jj*nx]
+                        + tmp_grid[6][ii + jj*nx]
+                        + tmp_grid[7][ii + jj*nx]))
+                    / local_density;
+
+
+        /* compute x velocity component */
+       const float u_y = (tmp_grid[2][ii + jj*nx]
+                     + tmp_grid[5][ii + jj*nx]
+                     + tmp_grid[6][ii + jj*nx]
+                     - (tmp_grid[4][ii + jj*nx]
+                        + tmp_grid[7][ii + jj*nx]
+                        + tmp_grid[8][ii + jj*nx]))
+                    / local_density;
+
+
+        /* velocity squared */
+        const float u_sq = u_x * u_x + u_y * u_y;
+
+        /* directional velocity components */
+        float u[NSPEEDS];
+        u[1] =   u_x;        /* east */
+        u[2] =         u_y;  /* north */
+        u[3] = - u_x;        /* west */
+        u[4] =       - u_y;  /* south */
+        u[5] =   u_x + u_y;  /* north-east */
+        u[6] = - u_x + u_y;  /* north-west */
+        u[7] = - u_x - u_y;  /* south-west */
+        u[8] =   u_x - u_y;  /* south-east */
+
+        /* equilibrium densities */
+        float d_equ[NSPEEDS];
+        /* zero velocity density: weight w0 */
+        d_equ[0] = w0 * local_density
+                   * (1.f - u_sq / (2.f * c_sq));
+        /* axis speeds: weight w1 */
+        d_equ[1] = w1 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u[1])+(u[1]*u[1])-(u_sq*c_sq))/(2.f*c_sq*c_sq);
+        d_equ[2] = w1 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u[2])+(u[2]*u[2])-(u_sq*c_sq))/(2.f*c_sq*c_sq);
+        d_equ[3] = w1 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u[3])+(u[3]*u[3])-(u_sq*c_sq))/(2.f*c_sq*c_sq);
+        d_equ[4] = w1 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u[4])+(u[4]*u[4])-(u_sq*c_sq))/(2.f*c_sq*c_sq);
+        d_equ[5] = w2 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u[5])+(u[5]*u[5])-(u_sq*c_sq))/(2.f*c_sq*c_sq);
+        d_equ[6] = w2 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u[6])+(u[6]*u[6])-(u_sq*c_sq))/(2.f*c_sq*c_sq);
+        d_equ[7] = w2 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u[7])+(u[7]*u[7])-(u_sq*c_sq))/(2.f*c_sq*c_sq);
+        d_equ[8] = w2 *local_density *((2.f*c_sq*c_sq)+(2.f*c_sq*u[8])+(u[8]*u[8])-(u_sq*c_sq))/(2.f*c_sq*c_sq);
+
+
+        /* relaxation step */
+        for (int kk = 0; kk < NSPEEDS; kk++)
+        {
+
+          o_grid[kk][ii + jj*nx] = tmp_grid[kk][ii + jj*nx]
+                                                  + omega
+                                                  * (d_equ[kk] - tmp_grid[kk][ii + jj*nx]);
+
+        }
+
+
+
+
+
+
+      }
+    }
+  }
+
+
+
+
+
+  //REBOUND
+  /* the obstacle cells: called after propagate, so taking values
+  ** from scratch space, mirroring, and writing into main grid */
+  for (int cc = solid[j0]; cc < solid[j1]; cc++)
+  {
+    const int cell = solid[cc];
+
+    o_grid[0][cell] = tmp_grid[0][cell];  //move the centre cell in
+    o_grid[1][cell] = tmp_grid[3][cell];
+    o_grid[2][cell] = tmp_grid[4][cell];
+    o_grid[3][cell] = tmp_grid[1][cell];
+    o_grid[4][cell] = tmp_grid[2][cell];
+    o_grid[5][cell] = tmp_grid[7][cell];
+    o_grid[6][cell] = tmp_grid[8][cell];
+    o_grid[7][cell] = tmp_grid[5][cell];
+    o_grid[8][cell] = tmp_grid[6][cell];
+  }
+
+return EXIT_SUCCESS;
+
+
+
+
+
+
+
+
+
+}
+
+#endif
@@ -0,0 +1,524 @@
+/*
+** Python bindings for libd2q9.
+**
+**   import numpy as np, d2q9
+**   lat = d2q9.Lattice("input_128x128.params", "obstacles_128x128.dat")
+**   lat.step(1000)                      # the GIL is released while stepping
+**   f = np.asarray(lat.speeds[1])       # (ny, nx) float32 view of the lattice
+**   u_x, u_y, p = map(np.asarray, lat.moments())
+**
+** Nothing is copied. Each plane and moment field is a small object
+** that exports the solver's own memory through the buffer protocol.
+** The lattice planes are writable. The moment fields are read-only
+** and are recomputed in place by every call to moments().
+*/
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <string.h>
+#include "d2q9.h"
+
+#define NSPEEDS  D2Q9_NSPEEDS
+#define NMOMENTS 3    /* u_x, u_y and pressure */
+
+typedef struct
+{
+  PyObject_HEAD
+  d2q9_ctx* ctx;
+  float*    moments;    /* NMOMENTS planes for moments(), allocated on first use */
+  float*    rho;        /* scratch for the density */
+  int       busy;       /* a call without the GIL is running */
+} t_lattice;
+
+/* one nx*ny plane of floats owned by a Lattice, kept alive by the reference */
+typedef struct
+{
+  PyObject_HEAD
+  t_lattice* owner;
+  float*     data;
+  int        readonly;
+} t_field;
+
+static PyTypeObject lattice_type;
+static PyTypeObject field_type;
+
+/* turn a library status into a Python exception */
+static PyObject* raise_status(int status, const char* filename)
+{
+  switch (status)
+  {
+    case D2Q9_ERR_NOMEM:
+      return PyErr_NoMemory();
+    case D2Q9_ERR_OPEN:
+    case D2Q9_ERR_WRITE:
+      return PyErr_Format(PyExc_OSError, "%s: %s", d2q9_strerror(status), filename ? filename : "");
+    default:
+      return PyErr_Format(PyExc_ValueError, "%s%s%s", d2q9_strerror(status),
+                          filename ? ": " : "", filename ? filename : "");
+  }
+}
+
+/* refuse to touch a lattice another thread is stepping */
+static int check_idle(t_lattice* self)
+{
+  if (self->busy)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "lattice is busy in another thread");
+    return -1;
+  }
+
+  return 0;
+}
+
+static PyObject* new_field(t_lattice* owner, float* data, int readonly)
+{
+  t_field* field = PyObject_New(t_field, &field_type);
+
+  if (field == NULL) return NULL;
+
+  Py_INCREF(owner);
+  field->owner    = owner;
+  field->data     = data;
+  field->readonly = readonly;
+
+  return (PyObject*)field;
+}
+
+static void field_dealloc(t_field* self)
+{
+  Py_XDECREF(self->owner);
+  PyObject_Free(self);
+}
+
+static int field_getbuffer(t_field* self, Py_buffer* view, int flags)
+{
+  const d2q9_params* params = d2q9_get_params(self->owner->ctx);
+  static char format[] = "f";
+
+  if (self->readonly && (flags & PyBUF_WRITABLE))
+  {
+    PyErr_SetString(PyExc_BufferError, "moment fields are read-only");
+    return -1;
+  }
+
+  view->obj        = (PyObject*)self;
+  view->buf        = self->data;
+  view->len        = (Py_ssize_t)sizeof(float) * params->nx * params->ny;
+  view->readonly   = self->readonly;
+  view->itemsize   = sizeof(float);
+  view->format     = (flags & PyBUF_FORMAT) ? format : NULL;
+  view->ndim       = 2;
+  view->shape      = NULL;
+  view->strides    = NULL;
+  view->suboffsets = NULL;
+  view->internal   = NULL;
+
+  /* rows of nx cells, ny of them, as the lattice is indexed ii + jj*nx */
+  if (flags & PyBUF_ND)
+  {
+    Py_ssize_t* dims = (Py_ssize_t*)PyMem_Malloc(4 * sizeof(Py_ssize_t));
+
+    if (dims == NULL)
+    {
+      PyErr_NoMemory();
+      return -1;
+    }
+    dims[0] = params->ny;
+    dims[1] = params->nx;
+    dims[2] = (Py_ssize_t)sizeof(float) * params->nx;
+    dims[3] = sizeof(float);
+    view->shape    = dims;
+    view->strides  = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? dims + 2 : NULL;
+    view->internal = dims;
+  }
+  else
+  {
+    view->ndim = 1;
+  }
+
+  Py_INCREF(self);
+
+  return 0;
+}
+
+static void field_releasebuffer(t_field* self, Py_buffer* view)
+{
+  PyMem_Free(view->internal);
+}
+
+static PyBufferProcs field_as_buffer =
+{
+  (getbufferproc)field_getbuffer,
+  (releasebufferproc)field_releasebuffer
+};
+
+static PyTypeObject field_type =
+{
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name      = "d2q9.Field",
+  .tp_basicsize = sizeof(t_field),
+  .tp_dealloc   = (destructor)field_dealloc,
+  .tp_as_buffer = &field_as_buffer,
+  .tp_flags     = Py_TPFLAGS_DEFAULT,
+  .tp_doc       = "An (ny, nx) float32 plane of a Lattice, for np.asarray() or memoryview().",
+};
+
+static int lattice_init(t_lattice* self, PyObject* args, PyObject* kwds)
+{
+  static char* kwlist[] = { "params", "obstacles", NULL };
+  const char*  paramfile;
+  PyObject*    obstacles_arg;
+  d2q9_params  params;
+  int*         obstacles;
+  int          status;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "sO", kwlist, &paramfile, &obstacles_arg)) return -1;
+
+  if (self->ctx != NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Lattice is already initialised");
+    return -1;
+  }
+
+  status = d2q9_read_params(paramfile, &params);
+
+  if (status != D2Q9_OK)
+  {
+    raise_status(status, paramfile);
+    return -1;
+  }
+
+  obstacles = (int*)PyMem_Malloc(sizeof(int) * params.nx * params.ny);
+
+  if (obstacles == NULL)
+  {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  /* the obstacles are a file name, or anything exporting nx*ny C ints */
+  if (PyUnicode_Check(obstacles_arg))
+  {
+    const char* obstaclefile = PyUnicode_AsUTF8(obstacles_arg);
+
+    status = (obstaclefile == NULL) ? D2Q9_ERR_ARG : d2q9_read_obstacles(obstaclefile, &params, obstacles);
+
+    if (status != D2Q9_OK)
+    {
+      if (!PyErr_Occurred()) raise_status(status, obstaclefile);
+      PyMem_Free(obstacles);
+      return -1;
+    }
+  }
+  else
+  {
+    Py_buffer view;
+
+    if (PyObject_GetBuffer(obstacles_arg, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0)
+    {
+      PyMem_Free(obstacles);
+      return -1;
+    }
+
+    if (view.itemsize != sizeof(int) || view.len != (Py_ssize_t)sizeof(int) * params.nx * params.ny
+        || (view.format != NULL && strchr("il", view.format[strlen(view.format) - 1]) == NULL))
+    {
+      PyBuffer_Release(&view);
+      PyMem_Free(obstacles);
+      PyErr_Format(PyExc_ValueError, "obstacles must be %d x %d C ints", params.ny, params.nx);
+      return -1;
+    }
+
+    memcpy(obstacles, view.buf, view.len);
+    PyBuffer_Release(&view);
+  }
+
+  status = d2q9_create(&params, obstacles, &self->ctx);
+  PyMem_Free(obstacles);
+
+  if (status != D2Q9_OK)
+  {
+    raise_status(status, NULL);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void lattice_dealloc(t_lattice* self)
+{
+  d2q9_destroy(self->ctx);
+  PyMem_Free(self->moments);
+  PyMem_Free(self->rho);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int check_ready(t_lattice* self)
+{
+  if (self->ctx == NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Lattice is not initialised");
+    return -1;
+  }
+
+  return check_idle(self);
+}
+
+static PyObject* lattice_step(t_lattice* self, PyObject* args, PyObject* kwds)
+{
+  static char* kwlist[] = { "n", "av_vels", NULL };
+  int        n = 1;
+  PyObject*  av_arg = Py_None;
+  Py_buffer  view;
+  float*     av_vels = NULL;
+  int        status;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iO", kwlist, &n, &av_arg)) return NULL;
+  if (check_ready(self) != 0) return NULL;
+
+  if (n < 0)
+  {
+    PyErr_SetString(PyExc_ValueError, "n must not be negative");
+    return NULL;
+  }
+
+  /* av_vels may be any writable float32 buffer of at least n values */
+  if (av_arg != Py_None)
+  {
+    if (PyObject_GetBuffer(av_arg, &view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) return NULL;
+
+    if (view.itemsize != sizeof(float) || view.len < (Py_ssize_t)sizeof(float) * n
+        || (view.format != NULL && strcmp(view.format, "f") != 0))
+    {
+      PyBuffer_Release(&view);
+      PyErr_Format(PyExc_ValueError, "av_vels must be a float32 buffer of at least %d values", n);
+      return NULL;
+    }
+    av_vels = (float*)view.buf;
+  }
+
+  self->busy = 1;
+  Py_BEGIN_ALLOW_THREADS
+  status = d2q9_step(self->ctx, n, av_vels);
+  Py_END_ALLOW_THREADS
+  self->busy = 0;
+
+  if (av_vels != NULL) PyBuffer_Release(&view);
+  if (status != D2Q9_OK) return raise_status(status, NULL);
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* lattice_moments(t_lattice* self, PyObject* unused)
+{
+  const d2q9_params* params;
+  size_t    ncells;
+  float*    u_x;
+  float*    u_y;
+  float*    pressure;
+  PyObject* fields;
+
+  if (check_ready(self) != 0) return NULL;
+
+  params = d2q9_get_params(self->ctx);
+  ncells = (size_t)params->nx * params->ny;
+
+  if (self->moments == NULL)
+  {
+    self->moments = (float*)PyMem_Malloc(sizeof(float) * NMOMENTS * ncells);
+    self->rho     = (float*)PyMem_Malloc(sizeof(float) * ncells);
+
+    /* both or neither, so the next call does not find one without the other */
+    if (self->moments == NULL || self->rho == NULL)
+    {
+      PyMem_Free(self->moments);
+      PyMem_Free(self->rho);
+      self->moments = NULL;
+      self->rho     = NULL;
+      return PyErr_NoMemory();
+    }
+  }
+
+  u_x      = self->moments;
+  u_y      = self->moments + ncells;
+  pressure = self->moments + 2 * ncells;
+
+  self->busy = 1;
+  Py_BEGIN_ALLOW_THREADS
+  d2q9_moments(self->ctx, self->rho, u_x, u_y);
+  for (size_t ii = 0; ii < ncells; ii++) pressure[ii] = self->rho[ii] / 3.f;
+  Py_END_ALLOW_THREADS
+  self->busy = 0;
+
+  fields = PyTuple_New(NMOMENTS);
+
+  if (fields == NULL) return NULL;
+
+  for (int mm = 0; mm < NMOMENTS; mm++)
+  {
+    PyObject* field = new_field(self, self->moments + mm * ncells, 1);
+
+    if (field == NULL)
+    {
+      Py_DECREF(fields);
+      return NULL;
+    }
+    PyTuple_SET_ITEM(fields, mm, field);
+  }
+
+  return fields;
+}
+
+static PyObject* lattice_get_speeds(t_lattice* self, void* closure)
+{
+  float**   planes;
+  PyObject* speeds;
+
+  if (check_ready(self) != 0) return NULL;
+
+  planes = d2q9_speeds(self->ctx);
+  speeds = PyTuple_New(NSPEEDS);
+
+  if (speeds == NULL) return NULL;
+
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    PyObject* field = new_field(self, planes[kk], 0);
+
+    if (field == NULL)
+    {
+      Py_DECREF(speeds);
+      return NULL;
+    }
+    PyTuple_SET_ITEM(speeds, kk, field);
+  }
+
+  return speeds;
+}
+
+static PyObject* lattice_av_velocity(t_lattice* self, PyObject* unused)
+{
+  if (check_ready(self) != 0) return NULL;
+
+  return PyFloat_FromDouble(d2q9_av_velocity(self->ctx));
+}
+
+static PyObject* lattice_reynolds(t_lattice* self, PyObject* unused)
+{
+  if (check_ready(self) != 0) return NULL;
+
+  return PyFloat_FromDouble(d2q9_reynolds(self->ctx));
+}
+
+static PyObject* lattice_checkpoint(t_lattice* self, PyObject* args)
+{
+  const char* filename;
+  int         status;
+
+  if (!PyArg_ParseTuple(args, "s", &filename)) return NULL;
+  if (check_ready(self) != 0) return NULL;
+
+  status = d2q9_checkpoint(self->ctx, filename);
+
+  if (status != D2Q9_OK) return raise_status(status, filename);
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* lattice_restore(t_lattice* self, PyObject* args)
+{
+  const char* filename;
+  int         status;
+
+  if (!PyArg_ParseTuple(args, "s", &filename)) return NULL;
+  if (check_ready(self) != 0) return NULL;
+
+  status = d2q9_restore(self->ctx, filename);
+
+  if (status != D2Q9_OK) return raise_status(status, filename);
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* lattice_get_int(t_lattice* self, void* closure)
+{
+  const char* name = (const char*)closure;
+  const d2q9_params* params;
+
+  if (self->ctx == NULL) return PyErr_Format(PyExc_RuntimeError, "Lattice is not initialised");
+
+  params = d2q9_get_params(self->ctx);
+
+  if (strcmp(name, "nx") == 0) return PyLong_FromLong(params->nx);
+  if (strcmp(name, "ny") == 0) return PyLong_FromLong(params->ny);
+
+  return PyLong_FromLong(d2q9_steps_done(self->ctx));
+}
+
+static PyMethodDef lattice_methods[] =
+{
+  { "step", (PyCFunction)(void(*)(void))lattice_step, METH_VARARGS | METH_KEYWORDS,
+    "step(n=1, av_vels=None): advance n steps without holding the GIL,\n"
+    "storing the average velocity after each in a float32 buffer if given." },
+  { "moments", (PyCFunction)lattice_moments, METH_NOARGS,
+    "moments(): recompute and return the (u_x, u_y, pressure) fields." },
+  { "av_velocity", (PyCFunction)lattice_av_velocity, METH_NOARGS, "Average velocity of the fluid cells." },
+  { "reynolds", (PyCFunction)lattice_reynolds, METH_NOARGS, "Reynolds number of the current state." },
+  { "checkpoint", (PyCFunction)lattice_checkpoint, METH_VARARGS, "checkpoint(filename): write a checkpoint." },
+  { "restore", (PyCFunction)lattice_restore, METH_VARARGS, "restore(filename): read a checkpoint of the same size." },
+  { NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef lattice_getset[] =
+{
+  { "speeds", (getter)lattice_get_speeds, NULL, "The nine writable speed planes.", NULL },
+  { "nx", (getter)lattice_get_int, NULL, "Cells in x.", "nx" },
+  { "ny", (getter)lattice_get_int, NULL, "Cells in y.", "ny" },
+  { "steps", (getter)lattice_get_int, NULL, "Steps taken.", "steps" },
+  { NULL, NULL, NULL, NULL, NULL }
+};
+
+static PyTypeObject lattice_type =
+{
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name      = "d2q9.Lattice",
+  .tp_basicsize = sizeof(t_lattice),
+  .tp_dealloc   = (destructor)lattice_dealloc,
+  .tp_flags     = Py_TPFLAGS_DEFAULT,
+  .tp_doc       = "Lattice(params, obstacles): a d2q9-bgk lattice at rest.\n"
+                  "params is a parameter file; obstacles is an obstacle file\n"
+                  "or an (ny, nx) array of C ints, 1 for blocked cells.",
+  .tp_methods   = lattice_methods,
+  .tp_getset    = lattice_getset,
+  .tp_init      = (initproc)lattice_init,
+  .tp_new       = PyType_GenericNew,
+};
+
+static struct PyModuleDef d2q9_module =
+{
+  PyModuleDef_HEAD_INIT,
+  .m_name = "d2q9",
+  .m_doc  = "The d2q9-bgk lattice Boltzmann solver, with zero-copy views of its fields.",
+  .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_d2q9(void)
+{
+  PyObject* module;
+
+  if (PyType_Ready(&lattice_type) < 0 || PyType_Ready(&field_type) < 0) return NULL;
+
+  module = PyModule_Create(&d2q9_module);
+
+  if (module == NULL) return NULL;
+
+  Py_INCREF(&lattice_type);
+  if (PyModule_AddObject(module, "Lattice", (PyObject*)&lattice_type) < 0)
+  {
+    Py_DECREF(&lattice_type);
+    Py_DECREF(module);
+    return NULL;
+  }
+
+  return module;
+}
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+
+# Checks of the d2q9 extension module: run from the top of the tree with
+# "make python-test", which builds the module first.
+
+import os
+import sys
+import threading
+
+import numpy as np
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import d2q9
+
+PARAMS = "input_128x128.params"
+OBSTACLES = "obstacles_128x128.dat"
+
+
+def check(cond, what):
+    if not cond:
+        sys.exit("FAIL: " + what)
+    print("ok   " + what)
+
+
+def test_shape_and_dtype():
+    lat = d2q9.Lattice(PARAMS, OBSTACLES)
+    check(len(lat.speeds) == 9, "nine speed planes")
+    for f in list(map(np.asarray, lat.speeds)) + list(map(np.asarray, lat.moments())):
+        if f.shape != (lat.ny, lat.nx) or f.dtype != np.float32:
+            check(False, "fields are (ny, nx) float32, got %s %s" % (f.shape, f.dtype))
+    check(True, "fields are (ny, nx) float32")
+
+    obstacles = np.zeros((lat.ny, lat.nx), np.intc)
+    obstacles[lat.ny // 2, :] = 1
+    check(d2q9.Lattice(PARAMS, obstacles).nx == lat.nx, "obstacles from an np.intc array")
+
+
+def test_zero_copy():
+    lat = d2q9.Lattice(PARAMS, OBSTACLES)
+    f = np.asarray(lat.speeds[1])
+    before = f.copy()
+    address = f.__array_interface__["data"][0]
+
+    lat.step(10)
+    g = np.asarray(lat.speeds[1])
+    check(g.__array_interface__["data"][0] == address, "speeds keep their address across step()")
+    check(not np.array_equal(f, before), "an earlier view sees the stepped values")
+    check(np.array_equal(f, g), "earlier and later views agree")
+
+    f[0, 0] = 42.0
+    check(np.asarray(lat.speeds[1])[0, 0] == 42.0, "writes through a view reach the lattice")
+
+
+def test_moments_read_only():
+    lat = d2q9.Lattice(PARAMS, OBSTACLES)
+    lat.step(10)
+    u_x = np.asarray(lat.moments()[0])
+    check(not u_x.flags.writeable, "moments() views are read-only")
+    try:
+        u_x[0, 0] = 1.0
+    except ValueError:
+        check(True, "assigning to a moment raises ValueError")
+    else:
+        check(False, "assigning to a moment raises ValueError")
+
+    av_vels = np.zeros(5, np.float32)
+    lat.step(5, av_vels)
+    check(abs(av_vels[-1] - lat.av_velocity()) <= 1e-6 * abs(av_vels[-1]) + 1e-12,
+          "step() fills av_vels up to the current state")
+
+
+def test_busy():
+    lat = d2q9.Lattice(PARAMS, OBSTACLES)
+    errors = []
+    stepper = threading.Thread(target=lat.step, args=(2000,))
+    stepper.start()
+    while stepper.is_alive() and not errors:
+        try:
+            lat.moments()
+        except RuntimeError as e:
+            errors.append(str(e))
+    stepper.join()
+    check(len(errors) > 0 and "busy" in errors[0], "a second call while stepping raises RuntimeError")
+    check(lat.steps == 2000, "the stepping thread finished its steps")
+
+
+if __name__ == "__main__":
+    test_shape_and_dtype()
+    test_zero_copy()
+    test_moments_read_only()
+    test_busy()
@@ -0,0 +1,102 @@
+/*
+** The helpers of tests/common.h.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+
+double wtime(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned next_random(unsigned* state)
+{
+  unsigned x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+
+  return x;
+}
+
+void* alloc_or_exit(size_t bytes)
+{
+  void* p = malloc(bytes);
+
+  if (p == NULL)
+  {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return p;
+}
+
+float** alloc_grid(size_t ncells)
+{
+  float** grid = (float**)calloc(D2Q9_NSPEEDS, sizeof(float*));
+
+  for (int kk = 0; grid != NULL && kk < D2Q9_NSPEEDS; kk++)
+  {
+    grid[kk] = (float*)malloc(sizeof(float) * ncells);
+
+    if (grid[kk] == NULL)
+    {
+      free_grid(grid);
+      grid = NULL;
+    }
+  }
+
+  if (grid == NULL)
+  {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return grid;
+}
+
+void free_grid(float** grid)
+{
+  for (int kk = 0; kk < D2Q9_NSPEEDS; kk++) free(grid[kk]);
+  free(grid);
+}
+
+d2q9_ctx* create_or_exit(const d2q9_params* params, const int* obstacles)
+{
+  d2q9_ctx* ctx;
+  const int status = d2q9_create(params, obstacles, &ctx);
+
+  if (status != D2Q9_OK)
+  {
+    fprintf(stderr, "d2q9_create: %s\n", d2q9_strerror(status));
+    exit(EXIT_FAILURE);
+  }
+
+  return ctx;
+}
+
+void take_speeds(d2q9_ctx* ctx, float** planes)
+{
+  const d2q9_params* params = d2q9_get_params(ctx);
+  float**            speeds = d2q9_speeds(ctx);
+
+  for (int kk = 0; kk < D2Q9_NSPEEDS; kk++)
+  {
+    memcpy(planes[kk], speeds[kk], sizeof(float) * params->nx * params->ny);
+  }
+
+  d2q9_destroy(ctx);
+}
@@ -0,0 +1,33 @@
+/*
+** What the programs in tests/ share: a clock, a random generator that
+** gives the same lattices everywhere for a seed, sets of nine planes to
+** copy results into, and contexts that are created and read back or
+** the program exits. Built as tests/common.o and linked into each.
+*/
+
+#ifndef TESTS_COMMON_H
+#define TESTS_COMMON_H
+
+#include <stddef.h>
+#include "d2q9.h"
+
+/* seconds on the monotonic clock */
+double wtime(void);
+
+/* xorshift32 */
+unsigned next_random(unsigned* state);
+
+/* malloc(), or "out of memory" and exit */
+void* alloc_or_exit(size_t bytes);
+
+/* nine planes of ncells floats, or "out of memory" and exit */
+float** alloc_grid(size_t ncells);
+void    free_grid(float** grid);
+
+/* d2q9_create(), or its error and exit */
+d2q9_ctx* create_or_exit(const d2q9_params* params, const int* obstacles);
+
+/* copy the speeds of ctx into planes, then destroy it */
+void take_speeds(d2q9_ctx* ctx, float** planes);
+
+#endif
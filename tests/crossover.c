@@ -0,0 +1,203 @@
+/*
+** Where the "sparse" kernel overtakes the dense one.
+**
+** The dense kernels visit every cell of the lattice each step, fluid
+** or not; "sparse" visits only the fluid and the obstacle cells beside
+** it, but looks up where each speed comes from instead of reading the
+** next cell along. "blocksparse" is in between: it skips blocks with
+** no fluid near them and visits the rest densely. This fills lattices
+** with random disks down to a range of fluid fractions and times, per
+** step:
+**
+**   dense        the lattice's default kernel
+**   sparse       d2q9_set_kernel(ctx, "sparse")
+**   blocksparse  d2q9_set_kernel(ctx, "blocksparse")
+**
+** with the memory each holds, and checks that all give the
+** same average velocities and the same speeds in the fluid. The
+** crossover is the largest fraction at which sparse is faster than
+** dense.
+**
+**   make crossover
+**   ./tests/crossover --size=1024 --steps=200
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "d2q9.h"
+#include "common.h"
+
+#define MODES 3
+
+static const char* const modes[MODES] = { "dense", "sparse", "blocksparse" };
+
+float    porous_lattice(int size, float fluid, unsigned seed, d2q9_params* params, int** obstacles_ptr);
+double   run_kernel(const d2q9_params* params, const int* obstacles, const char* kernel, int steps,
+                    float* av_vels, float** planes, double* megabytes);
+
+int main(int argc, char* argv[])
+{
+  static const float fractions[] = { 1.f, .9f, .8f, .7f, .6f, .5f, .4f, .3f, .2f, .1f, .05f };
+  int      size = 512;
+  int      steps = 100;
+  unsigned seed = 1;
+  float    crossover = 0.f;
+  int      failures = 0;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (sscanf(argv[i], "--size=%d", &size) == 1) continue;
+    if (sscanf(argv[i], "--steps=%d", &steps) == 1) continue;
+    if (sscanf(argv[i], "--seed=%u", &seed) == 1) continue;
+
+    fprintf(stderr, "Usage: %s [--size=N] [--steps=N] [--seed=S]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (size < 16 || steps < 1)
+  {
+    fprintf(stderr, "%s: needs --size of at least 16 and --steps of at least 1\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  printf("%-9s %6s", "lattice", "fluid");
+  for (int mm = 0; mm < MODES; mm++) printf(" %11s %6s", modes[mm], "MB");
+  printf("   (us per step)\n");
+
+  for (size_t ff = 0; ff < sizeof(fractions) / sizeof(fractions[0]); ff++)
+  {
+    d2q9_params  params;
+    int*         obstacles;
+    const size_t ncells = (size_t)size * size;
+    const float  fluid = porous_lattice(size, fractions[ff], seed, &params, &obstacles);
+    float*       av_vels[MODES];
+    float**      planes[MODES];
+    double       elapsed[MODES];
+    double       megabytes[MODES];
+    int          agree = 1;
+
+    for (int mm = 0; mm < MODES; mm++)
+    {
+      av_vels[mm] = (float*)alloc_or_exit(sizeof(float) * steps);
+      planes[mm]  = alloc_grid(ncells);
+      elapsed[mm] = run_kernel(&params, obstacles, (mm == 0) ? NULL : modes[mm], steps,
+                               av_vels[mm], planes[mm], &megabytes[mm]);
+    }
+
+    /* all sum the fluid in the same order, so even av_vels must be identical */
+    for (int mm = 1; mm < MODES; mm++)
+    {
+      if (memcmp(av_vels[mm], av_vels[0], sizeof(float) * steps) != 0) agree = 0;
+      for (int kk = 0; kk < D2Q9_NSPEEDS; kk++)
+      {
+        for (size_t ii = 0; ii < ncells; ii++)
+        {
+          if (!obstacles[ii] && memcmp(&planes[mm][kk][ii], &planes[0][kk][ii], sizeof(float)) != 0) agree = 0;
+        }
+      }
+    }
+
+    printf("%4dx%-4d %6.3f", size, size, fluid);
+    for (int mm = 0; mm < MODES; mm++) printf(" %11.2f %6.1f", 1e6 * elapsed[mm] / steps, megabytes[mm]);
+    printf("%s\n", agree ? "" : "   DIFFER");
+
+    if (!agree) failures++;
+    if (crossover == 0.f && elapsed[1] < elapsed[0]) crossover = fluid;
+
+    for (int mm = 0; mm < MODES; mm++)
+    {
+      free(av_vels[mm]);
+      free_grid(planes[mm]);
+    }
+    free(obstacles);
+  }
+
+  if (crossover > 0.f) printf("sparse is faster from a fluid fraction of %.3f down\n", crossover);
+  else printf("sparse is not faster at any of these fluid fractions\n");
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* walls top and bottom, then disks (wrapping in x) until at most fluid of the
+** cells are left open; returns the fraction that is */
+float porous_lattice(int size, float fluid, unsigned seed, d2q9_params* params, int** obstacles_ptr)
+{
+  const size_t ncells = (size_t)size * size;
+  int*         obstacles = (int*)calloc(ncells, sizeof(int));
+  unsigned     state = seed ? seed : 1;
+  size_t       open = ncells;
+
+  if (obstacles == NULL)
+  {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  params->nx           = size;
+  params->ny           = size;
+  params->maxIters     = 0;
+  params->reynolds_dim = size;
+  params->density      = 0.1f;
+  params->accel        = 0.005f;
+  params->omega        = 1.85f;
+
+  for (int ii = 0; ii < size; ii++)
+  {
+    obstacles[ii] = 1;
+    obstacles[ii + (size - 1) * size] = 1;
+  }
+  open -= 2 * size;
+
+  while (open > fluid * ncells)
+  {
+    const int r  = 2 + next_random(&state) % (size / 16);
+    const int x0 = next_random(&state) % size;
+    const int y0 = next_random(&state) % size;
+
+    for (int jj = y0 - r; jj <= y0 + r; jj++)
+    {
+      if (jj < 0 || jj >= size) continue;
+
+      for (int ii = x0 - r; ii <= x0 + r; ii++)
+      {
+        const size_t cell = (size_t)((ii + size) % size) + (size_t)jj * size;
+
+        if ((ii - x0) * (ii - x0) + (jj - y0) * (jj - y0) > r * r || obstacles[cell]) continue;
+
+        obstacles[cell] = 1;
+        open--;
+      }
+    }
+  }
+
+  *obstacles_ptr = obstacles;
+
+  return (float)open / ncells;
+}
+
+/* steps of kernel (NULL = the default) in one call, copied into planes */
+double run_kernel(const d2q9_params* params, const int* obstacles, const char* kernel, int steps,
+                  float* av_vels, float** planes, double* megabytes)
+{
+  d2q9_ctx* ctx = create_or_exit(params, obstacles);
+  double    tic, toc;
+
+  if (kernel != NULL && d2q9_set_kernel(ctx, kernel) != D2Q9_OK)
+  {
+    fprintf(stderr, "d2q9_set_kernel(%s) failed\n", kernel);
+    exit(EXIT_FAILURE);
+  }
+
+  /* all the kernel holds: the arena, less the planes sparse gives back, and its own lists */
+  *megabytes = (d2q9_memory(ctx, NULL) + d2q9_kernel_memory(ctx)) / 1e6;
+
+  tic = wtime();
+  d2q9_step(ctx, steps, av_vels);
+  toc = wtime();
+
+  take_speeds(ctx, planes);
+
+  return toc - tic;
+}
+
@@ -0,0 +1,556 @@
+/*
+** Differential test of the libd2q9 kernels.
+**
+** Each trial makes a random lattice: odd and even sizes, obstacles
+** touching the edges, walls at the top and bottom, blocks on the
+** accelerated row ny-2. It steps it with the reference kernel, the
+** original propagate(), rebound() and collision() ("aos"), and with
+** every other kernel the lattice can use, and compares the speeds.
+**
+** The fused kernels must agree with each other bit for bit, and with
+** the reference to within a number of ULPs, since collision() writes
+** the equilibrium in a different (algebraically equal) form. A run
+** is also split into steps of random lengths, another into blocks of
+** rows on several threads, and another into tiles that the threads
+** steal from each other, none of which may change the result, nor
+** may stepping a lattice reused through d2q9_reset() after a case
+** with other parameters. The
+** kernels in FLUID_ONLY do not keep the speeds inside the obstacles,
+** so only the fluid cells are compared for them. Each obstacle map
+** must also come back the same from a run-length encoded file, which
+** is written under $TMPDIR, and malformed files must be refused.
+**
+**   make test
+**   ./tests/differential --trials=200 --steps=500 --seed=7 --jit=/tmp/jit
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include "d2q9.h"
+#include "common.h"
+
+#define NSPEEDS   D2Q9_NSPEEDS
+#define REFERENCE "aos"
+#define BASELINE  "soa"   /* the fused kernels are compared bit for bit with this */
+#define FLUID_ONLY "sparse blocksparse"
+#define PACKED     "d2q9-differential-XXXXXX"   /* under $TMPDIR, rewritten by each trial */
+
+/* options */
+typedef struct
+{
+  int         trials;
+  int         steps;
+  unsigned    seed;
+  long        max_ulps;   /* allowed distance from the reference */
+  const char* jit_dir;    /* also test a compiled kernel (NULL = don't) */
+  int         verbose;
+} t_opts;
+
+/* the difference between two lattices */
+typedef struct
+{
+  long  ulps;             /* largest distance in units in the last place */
+  float abs;              /* largest absolute difference */
+  int   kk, ii;           /* where the largest distance is */
+} t_diff;
+
+float    uniform(unsigned* state, float lo, float hi);
+void     random_lattice(unsigned* state, d2q9_params* params, int** obstacles_ptr);
+int      run_kernel(const t_opts opts, const d2q9_params* params, const int* obstacles,
+                    const char* kernel, unsigned* split, int threads, int tile, float** planes);
+int      run_reused(const t_opts opts, const d2q9_params* params, const int* obstacles,
+                    int threads, float** planes);
+void     report(const t_opts opts, int trial, const d2q9_params* params, const char* name,
+                const char* how, const t_diff diff, int* failures);
+t_diff   compare(const d2q9_params* params, const int* obstacles, float** a, float** b);
+int      temp_file(char* path, size_t size);
+int      repack(const char* path, const d2q9_params* params, const int* obstacles, int* same);
+int      malformed(const char* path, int* runs);
+int      listed(const char* list, const char* name);
+long     ulp_distance(float a, float b);
+
+int main(int argc, char* argv[])
+{
+  t_opts   opts = { 100, 300, 1, 1024, NULL, 0 };
+  unsigned state;
+  int      failures = 0;
+  int      runs = 0;
+  char     packed[4096];   /* the file of repack(), or "" if none could be made */
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (sscanf(argv[i], "--trials=%d", &opts.trials) == 1) continue;
+    if (sscanf(argv[i], "--steps=%d", &opts.steps) == 1) continue;
+    if (sscanf(argv[i], "--seed=%u", &opts.seed) == 1) continue;
+    if (sscanf(argv[i], "--max-ulps=%ld", &opts.max_ulps) == 1) continue;
+    if (strncmp(argv[i], "--jit=", 6) == 0) { opts.jit_dir = argv[i] + 6; continue; }
+    if (strcmp(argv[i], "--verbose") == 0) { opts.verbose = 1; continue; }
+
+    fprintf(stderr, "Usage: %s [--trials=N] [--steps=N] [--seed=S] [--max-ulps=N] [--jit=DIR] [--verbose]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  state = opts.seed ? opts.seed : 1;
+
+  if (!temp_file(packed, sizeof(packed)))
+  {
+    fprintf(stderr, "%s: cannot make a file in %s: not testing run-length encoded obstacles\n", argv[0], packed);
+    packed[0] = '\0';
+  }
+  else
+  {
+    failures += malformed(packed, &runs);
+  }
+
+  for (int trial = 0; trial < opts.trials; trial++)
+  {
+    d2q9_params params;
+    int*        obstacles;
+    float**     reference;
+    float**     baseline;
+    float**     other;
+    unsigned    split = next_random(&state);
+    const int   threads = 2 + split % 7;
+    const int   tile = 1 + split % 9;
+    const char* name;
+    t_diff      diff;
+    size_t      ncells;
+    int         status, same;
+
+    random_lattice(&state, &params, &obstacles);
+    ncells = (size_t)params.nx * params.ny;
+
+    if (packed[0] != '\0')
+    {
+      status = repack(packed, &params, obstacles, &same);
+      runs++;
+
+      if (status != D2Q9_OK)
+      {
+        printf("trial %d: %dx%d: writing or reading %s: %s: FAIL\n", trial, params.nx, params.ny, packed, d2q9_strerror(status));
+        failures++;
+      }
+      else if (!same)
+      {
+        printf("trial %d: %dx%d: obstacles differ after d2q9_write_obstacles(): FAIL\n", trial, params.nx, params.ny);
+        failures++;
+      }
+    }
+    reference = alloc_grid(ncells);
+    baseline  = alloc_grid(ncells);
+    other     = alloc_grid(ncells);
+
+    run_kernel(opts, &params, obstacles, REFERENCE, NULL, 1, 0, reference);
+    run_kernel(opts, &params, obstacles, BASELINE, NULL, 1, 0, baseline);
+
+    diff = compare(&params, NULL, reference, baseline);
+    runs++;
+
+    if (opts.verbose || diff.ulps > opts.max_ulps)
+    {
+      printf("trial %d: %dx%d omega %g: %s vs %s: %ld ulps (%.3E) at speed %d cell %d%s\n",
+             trial, params.nx, params.ny, params.omega, BASELINE, REFERENCE,
+             diff.ulps, diff.abs, diff.kk, diff.ii, diff.ulps > opts.max_ulps ? ": FAIL" : "");
+    }
+    if (diff.ulps > opts.max_ulps) failures++;
+
+    /* every other kernel in uneven pieces, starting with the baseline */
+    for (int kernel = -1; (name = (kernel < 0) ? BASELINE : d2q9_kernel_name(kernel)) != NULL; kernel++)
+    {
+      if (kernel >= 0 && (strcmp(name, REFERENCE) == 0 || strcmp(name, BASELINE) == 0)) continue;
+
+      if (run_kernel(opts, &params, obstacles, name, &split, 1, 0, other) != D2Q9_OK) continue;
+
+      diff = compare(&params, listed(FLUID_ONLY, name) ? obstacles : NULL, baseline, other);
+      runs++;
+      report(opts, trial, &params, name, (kernel < 0) ? " (split)" : "", diff, &failures);
+    }
+
+    /* the lattice's own kernel, a block of rows per thread */
+    run_kernel(opts, &params, obstacles, NULL, NULL, threads, 0, other);
+    diff = compare(&params, NULL, baseline, other);
+    runs++;
+    report(opts, trial, &params, "default", " (threads)", diff, &failures);
+
+    /* and in tiles, over calls of uneven lengths */
+    run_kernel(opts, &params, obstacles, NULL, &split, threads, tile, other);
+    diff = compare(&params, NULL, baseline, other);
+    runs++;
+    report(opts, trial, &params, "default", " (tiles)", diff, &failures);
+
+    /* and on a lattice that has already run another case */
+    if (run_reused(opts, &params, obstacles, threads, other) != D2Q9_OK)
+    {
+      printf("trial %d: %dx%d: d2q9_reset() did not start again from step 0: FAIL\n", trial, params.nx, params.ny);
+      failures++;
+    }
+    diff = compare(&params, NULL, baseline, other);
+    runs++;
+    report(opts, trial, &params, "default", " (reset)", diff, &failures);
+
+    free_grid(reference);
+    free_grid(baseline);
+    free_grid(other);
+    free(obstacles);
+  }
+
+  if (packed[0] != '\0') remove(packed);
+
+  printf("%d comparisons over %d lattices of %d steps: %d failed\n", runs, opts.trials, opts.steps, failures);
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+float uniform(unsigned* state, float lo, float hi)
+{
+  return lo + (hi - lo) * (float)(next_random(state) >> 8) / (float)(1 << 24);
+}
+
+void random_lattice(unsigned* state, d2q9_params* params, int** obstacles_ptr)
+{
+  static const int sizes[][2] = { { 128, 128 }, { 128, 256 }, { 256, 256 } };
+  int* obstacles;
+  float fill;
+
+  /* mostly small and odd-shaped, sometimes a standard size for the "fixed" kernel */
+  if (next_random(state) % 8 == 0)
+  {
+    const int ss = next_random(state) % (sizeof(sizes) / sizeof(sizes[0]));
+    params->nx = sizes[ss][0];
+    params->ny = sizes[ss][1];
+  }
+  else
+  {
+    params->nx = 1 + next_random(state) % 48;
+    params->ny = 3 + next_random(state) % 48;
+  }
+  params->maxIters     = 0;
+  params->reynolds_dim = params->nx;
+  params->density      = uniform(state, 0.05f, 0.2f);
+  params->accel        = uniform(state, 0.f, 0.02f);
+  params->omega        = uniform(state, 0.5f, 1.9f);
+
+  obstacles = (int*)calloc((size_t)params->nx * params->ny, sizeof(int));
+
+  if (obstacles == NULL)
+  {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* scattered cells, at any density from none to most */
+  fill = uniform(state, 0.f, 1.f);
+  fill = fill * fill * 0.6f;
+
+  for (int ii = 0; ii < params->nx * params->ny; ii++)
+  {
+    obstacles[ii] = uniform(state, 0.f, 1.f) < fill;
+  }
+
+  /* walls along the bottom and top, as in the reference cases */
+  if (next_random(state) % 2)
+  {
+    for (int ii = 0; ii < params->nx; ii++)
+    {
+      obstacles[ii] = 1;
+      obstacles[ii + (params->ny - 1) * params->nx] = 1;
+    }
+  }
+
+  /* a few blocks, which may wrap around either edge */
+  for (int bb = next_random(state) % 4; bb > 0; bb--)
+  {
+    const int x0 = next_random(state) % params->nx;
+    const int y0 = next_random(state) % params->ny;
+    const int w  = 1 + next_random(state) % (params->nx / 2 + 1);
+    const int h  = 1 + next_random(state) % (params->ny / 2 + 1);
+
+    for (int jj = y0; jj < y0 + h; jj++)
+    {
+      for (int ii = x0; ii < x0 + w; ii++)
+      {
+        obstacles[ii % params->nx + (jj % params->ny) * params->nx] = 1;
+      }
+    }
+  }
+
+  /* part of the accelerated row */
+  if (next_random(state) % 2)
+  {
+    const int jj = params->ny - 2;
+
+    for (int ii = next_random(state) % params->nx; ii < params->nx; ii += 1 + next_random(state) % 3)
+    {
+      obstacles[ii + jj * params->nx] = 1;
+    }
+  }
+
+  *obstacles_ptr = obstacles;
+}
+
+/* opts.steps of kernel (NULL = the default) from rest, copied into planes;
+** split != NULL steps in random pieces */
+int run_kernel(const t_opts opts, const d2q9_params* params, const int* obstacles,
+               const char* kernel, unsigned* split, int threads, int tile, float** planes)
+{
+  d2q9_ctx* ctx = create_or_exit(params, obstacles);
+  int       status;
+
+  if (kernel == NULL) status = D2Q9_OK;
+  else if (strcmp(kernel, "jit") == 0) status = (opts.jit_dir != NULL) ? d2q9_jit(ctx, opts.jit_dir) : D2Q9_ERR_JIT;
+  else status = d2q9_set_kernel(ctx, kernel);
+
+  if (status == D2Q9_OK && threads > 1) status = d2q9_threads(ctx, threads, NULL, NULL);
+  if (status == D2Q9_OK && tile > 0) status = d2q9_tiles(ctx, tile);
+
+  /* a kernel this lattice cannot use is not an error */
+  if (status != D2Q9_OK)
+  {
+    d2q9_destroy(ctx);
+    return status;
+  }
+
+  if (split == NULL)
+  {
+    d2q9_step(ctx, opts.steps, NULL);
+  }
+  else
+  {
+    for (int done = 0, n; done < opts.steps; done += n)
+    {
+      n = 1 + next_random(split) % 37;
+      if (n > opts.steps - done) n = opts.steps - done;
+      d2q9_step(ctx, n, NULL);
+    }
+  }
+
+  take_speeds(ctx, planes);
+
+  return D2Q9_OK;
+}
+
+/* opts.steps of the default kernel on threads, after as many steps of a
+** case with other omega, accel and density (and the compiled kernel, if
+** there is one, which the new omega drops) and a d2q9_reset() */
+int run_reused(const t_opts opts, const d2q9_params* params, const int* obstacles,
+               int threads, float** planes)
+{
+  d2q9_params before = *params;
+  d2q9_ctx*   ctx;
+  int         status;
+
+  before.omega   = (params->omega < 1.2f) ? params->omega + 0.5f : params->omega - 0.5f;
+  before.accel   = params->accel * 2.f;
+  before.density = params->density * 1.5f;
+
+  ctx = create_or_exit(&before, obstacles);
+
+  if (opts.jit_dir != NULL) d2q9_jit(ctx, opts.jit_dir);
+  d2q9_threads(ctx, threads, NULL, NULL);
+  d2q9_step(ctx, opts.steps, NULL);
+
+  status = d2q9_reset(ctx, params);
+
+  if (status == D2Q9_OK)
+  {
+    d2q9_step(ctx, opts.steps, NULL);
+    if (d2q9_steps_done(ctx) != opts.steps) status = D2Q9_ERR_ARG;
+  }
+
+  take_speeds(ctx, planes);
+
+  return status;
+}
+
+/* a fused kernel against the baseline, which must be bit for bit the same */
+void report(const t_opts opts, int trial, const d2q9_params* params, const char* name,
+            const char* how, const t_diff diff, int* failures)
+{
+  if (opts.verbose || diff.ulps > 0)
+  {
+    printf("trial %d: %dx%d omega %g: %s%s vs %s: %ld ulps (%.3E) at speed %d cell %d%s\n",
+           trial, params->nx, params->ny, params->omega, name, how,
+           BASELINE, diff.ulps, diff.abs, diff.kk, diff.ii, diff.ulps > 0 ? ": FAIL" : "");
+  }
+  if (diff.ulps > 0) (*failures)++;
+}
+
+/* every cell, or only those not in obstacles if that is not NULL */
+t_diff compare(const d2q9_params* params, const int* obstacles, float** a, float** b)
+{
+  const size_t ncells = (size_t)params->nx * params->ny;
+  t_diff diff = { 0, 0.f, 0, 0 };
+
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    for (size_t ii = 0; ii < ncells; ii++)
+    {
+      if (obstacles != NULL && obstacles[ii]) continue;
+
+      const long ulps = ulp_distance(a[kk][ii], b[kk][ii]);
+
+      if (ulps > diff.ulps)
+      {
+        diff.ulps = ulps;
+        diff.abs  = fabsf(a[kk][ii] - b[kk][ii]);
+        diff.kk   = kk;
+        diff.ii   = (int)ii;
+      }
+    }
+  }
+
+  return diff;
+}
+
+/* a new empty file of this process's own under $TMPDIR (or /tmp), so that
+** runs side by side do not share it; 0 with its directory in path if not */
+int temp_file(char* path, size_t size)
+{
+  const char* dir = getenv("TMPDIR");
+  int         fd;
+
+  if (dir == NULL || dir[0] == '\0') dir = "/tmp";
+  if (snprintf(path, size, "%s/%s", dir, PACKED) >= (int)size) return 0;
+
+  fd = mkstemp(path);
+
+  if (fd < 0)
+  {
+    snprintf(path, size, "%s", dir);
+    return 0;
+  }
+
+  close(fd);
+
+  return 1;
+}
+
+/* failures reading hand-written run-length encoded files in path, which
+** d2q9_read_obstacles() must refuse, or read as the cells listed */
+int malformed(const char* path, int* runs)
+{
+  static const struct
+  {
+    const char* text;
+    int         status;
+    const char* blocked;   /* "x,y ..." when it is read */
+  } cases[] =
+  {
+    { "D2Q9RLE 16 12\n5 1 3 8 9\n\n9 10 12", D2Q9_OK, "1,5 2,5 8,5 10,9 11,9" },
+    { "D2Q9RLE 16 12\n2-4 0 1 15 16\n11 3 4", D2Q9_OK, "0,2 15,2 0,3 15,3 0,4 15,4 3,11" },
+    { "D2Q9RLE 16 12\n5 1 3 2\n9 10 12\n",   D2Q9_ERR_FORMAT, NULL },   /* an end on the next line */
+    { "D2Q9RLE 16 12\n4-2 0 1\n",             D2Q9_ERR_FORMAT, NULL },
+    { "D2Q9RLE 16 12\n2- 4 0 1\n",            D2Q9_ERR_FORMAT, NULL },
+    { "D2Q9RLE 16 12\n2-12 0 1\n",            D2Q9_ERR_FORMAT, NULL },
+    { "D2Q9RLE 16 12\n5 1 3 2",                D2Q9_ERR_FORMAT, NULL },
+    { "D2Q9RLE 16 12\n5 3 3\n",               D2Q9_ERR_FORMAT, NULL },
+    { "D2Q9RLE 16 12\n5 1 17\n",              D2Q9_ERR_FORMAT, NULL },
+    { "D2Q9RLE 16 12\n12 1 2\n",              D2Q9_ERR_FORMAT, NULL },
+    { "D2Q9RLE 16 12\n-1 1 2\n",              D2Q9_ERR_FORMAT, NULL },
+    { "D2Q9RLE 16 12\n5 1 x\n",               D2Q9_ERR_FORMAT, NULL },
+    { "D2Q9RLE 16 12 5 1 2\n",                D2Q9_ERR_FORMAT, NULL },
+    { "D2Q9RLE 16 13\n",                      D2Q9_ERR_FORMAT, NULL },
+  };
+  const d2q9_params params = { 16, 12, 0, 16, 0.1f, 0.005f, 1.85f };
+  int obstacles[16 * 12], expected[16 * 12];
+  int failures = 0;
+
+  for (size_t cc = 0; cc < sizeof(cases) / sizeof(cases[0]); cc++)
+  {
+    FILE* fp = fopen(path, "w");
+    int   status;
+
+    if (fp == NULL || fputs(cases[cc].text, fp) == EOF || fclose(fp) != 0)
+    {
+      fprintf(stderr, "cannot write %s\n", path);
+      exit(EXIT_FAILURE);
+    }
+
+    memset(expected, 0, sizeof(expected));
+    for (const char* p = cases[cc].blocked; p != NULL && *p != '\0'; )
+    {
+      int xx, yy, n;
+
+      if (sscanf(p, "%d,%d%n", &xx, &yy, &n) != 2) break;
+      expected[xx + yy * params.nx] = 1;
+      p += n;
+    }
+
+    status = d2q9_read_obstacles(path, &params, obstacles);
+    (*runs)++;
+
+    if (status != cases[cc].status
+        || (status == D2Q9_OK && memcmp(obstacles, expected, sizeof(expected)) != 0))
+    {
+      printf("run-length encoded file \"");
+      for (const char* p = cases[cc].text; *p != '\0'; p++)
+      {
+        if (*p == '\n') fputs("\\n", stdout);
+        else putchar(*p);
+      }
+      printf("\": %s: FAIL\n", (status == D2Q9_OK) ? "read wrong" : d2q9_strerror(status));
+      failures++;
+    }
+  }
+
+  return failures;
+}
+
+/* the status of writing the obstacles to path with d2q9_write_obstacles()
+** and reading them back, and if that worked whether they are the same */
+int repack(const char* path, const d2q9_params* params, const int* obstacles, int* same)
+{
+  const size_t ncells = (size_t)params->nx * params->ny;
+  int* unpacked = (int*)alloc_or_exit(sizeof(int) * ncells);
+  int  status;
+
+  status = d2q9_write_obstacles(path, params, obstacles);
+  if (status == D2Q9_OK) status = d2q9_read_obstacles(path, params, unpacked);
+
+  *same = status == D2Q9_OK && memcmp(unpacked, obstacles, sizeof(int) * ncells) == 0;
+  free(unpacked);
+
+  return status;
+}
+
+/* 1 if name is one of the words of list, not just part of one */
+int listed(const char* list, const char* name)
+{
+  const size_t len = strlen(name);
+
+  for (const char* word = list + strspn(list, " "); *word != '\0'; )
+  {
+    const size_t n = strcspn(word, " ");
+
+    if (n == len && strncmp(word, name, len) == 0) return 1;
+    word += n;
+    word += strspn(word, " ");
+  }
+
+  return 0;
+}
+
+/* floats apart, counting through zero; any NaN is as far as it gets, even
+** against another, so two kernels that both blow up do not agree */
+long ulp_distance(float a, float b)
+{
+  int32_t ia, ib;
+
+  if (isnan(a) || isnan(b)) return INT32_MAX;
+
+  memcpy(&ia, &a, sizeof(float));
+  memcpy(&ib, &b, sizeof(float));
+
+  /* make the bit patterns ordered like the values */
+  if (ia < 0) ia = INT32_MIN - ia;
+  if (ib < 0) ib = INT32_MIN - ib;
+
+  return labs((long)ia - (long)ib);
+}
+
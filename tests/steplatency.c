@@ -0,0 +1,310 @@
+/*
+** Step latency of the libd2q9 thread pool against OpenMP.
+**
+** On small lattices a step is only a few microseconds of work per
+** thread, so what it costs to start and join the threads matters as
+** much as the kernel. This times, per step, on lattices from 32x32
+** to 256x256:
+**
+**   serial   d2q9_step() on one thread
+**   pool     d2q9_threads(): persistent threads, each waiting on its neighbours
+**   futex    the same pool with $D2Q9_SPIN=0, so every wait sleeps
+**   openmp   the same kernel (d2q9_kernel.h) in an OpenMP parallel
+**            region per kernel per step, with the flow accelerated
+**            and the average velocity summed as the pool does
+**
+** and checks that every version ends with the same speeds.
+**
+**   make bench
+**   ./tests/steplatency --threads=8 --cells=50000000
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <omp.h>
+#include "d2q9.h"
+#include "d2q9_kernel.h"
+#include "common.h"
+
+#define MODES 4
+
+static const char* const modes[MODES] = { "serial", "pool", "futex", "openmp" };
+
+void     make_lattice(int nx, int ny, d2q9_params* params, int** obstacles_ptr);
+double   run_library(const d2q9_params* params, const int* obstacles, int steps, int threads,
+                     const char* spin, float* av_vels, float** planes);
+double   run_openmp(const d2q9_params* params, int* obstacles, int steps, int threads,
+                    float* av_vels, float** planes);
+void     accelerate(const d2q9_params* params, const int* obstacles, float** grid);
+void     block_velocity(const d2q9_params* params, const int* obstacles, float** grid,
+                        int j0, int j1, float* tot_u, int* tot_cells);
+
+int main(int argc, char* argv[])
+{
+  static const int sizes[][2] = { { 32, 32 }, { 64, 64 }, { 128, 128 }, { 256, 256 } };
+  int    max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  double cells = 2e7;     /* cells stepped per measurement */
+  int    failures = 0;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (sscanf(argv[i], "--threads=%d", &max_threads) == 1) continue;
+    if (sscanf(argv[i], "--cells=%lf", &cells) == 1) continue;
+
+    fprintf(stderr, "Usage: %s [--threads=N] [--cells=N]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (max_threads < 1) max_threads = 1;
+
+  printf("%-9s %7s %6s", "lattice", "threads", "steps");
+  for (int mm = 0; mm < MODES; mm++) printf(" %11s", modes[mm]);
+  printf("   (us per step)\n");
+
+  for (size_t ss = 0; ss < sizeof(sizes) / sizeof(sizes[0]); ss++)
+  {
+    d2q9_params params;
+    int*        obstacles;
+    const size_t ncells = (size_t)sizes[ss][0] * sizes[ss][1];
+    const int   steps = (int)(cells / ncells);
+
+    make_lattice(sizes[ss][0], sizes[ss][1], &params, &obstacles);
+
+    /* 1, 2, 4, ... and max_threads itself */
+    for (int threads = 1; ; threads = (threads * 2 < max_threads) ? threads * 2 : max_threads)
+    {
+      float*  av_vels[MODES];
+      float** planes[MODES];
+      double  elapsed[MODES];
+      int     agree = 1;
+
+      for (int mm = 0; mm < MODES; mm++)
+      {
+        av_vels[mm] = (float*)alloc_or_exit(sizeof(float) * steps);
+        planes[mm]  = alloc_grid(ncells);
+      }
+
+      elapsed[0] = run_library(&params, obstacles, steps, 1, NULL, av_vels[0], planes[0]);
+      elapsed[1] = run_library(&params, obstacles, steps, threads, NULL, av_vels[1], planes[1]);
+      elapsed[2] = run_library(&params, obstacles, steps, threads, "0", av_vels[2], planes[2]);
+      elapsed[3] = run_openmp(&params, obstacles, steps, threads, av_vels[3], planes[3]);
+
+      /* every version must step the same lattice; av_vels are summed as the pool does */
+      for (int mm = 1; mm < MODES; mm++)
+      {
+        for (int kk = 0; kk < D2Q9_NSPEEDS; kk++)
+        {
+          if (memcmp(planes[mm][kk], planes[0][kk], sizeof(float) * ncells) != 0) agree = 0;
+        }
+        if (mm > 1 && memcmp(av_vels[mm], av_vels[1], sizeof(float) * steps) != 0) agree = 0;
+      }
+
+      printf("%4dx%-4d %7d %6d", sizes[ss][0], sizes[ss][1], threads, steps);
+      for (int mm = 0; mm < MODES; mm++) printf(" %11.2f", 1e6 * elapsed[mm] / steps);
+      printf("%s\n", agree ? "" : "   DIFFER");
+
+      if (!agree) failures++;
+
+      for (int mm = 0; mm < MODES; mm++)
+      {
+        free(av_vels[mm]);
+        free_grid(planes[mm]);
+      }
+
+      if (threads == max_threads) break;
+    }
+
+    free(obstacles);
+  }
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* walls top and bottom and a block in the middle, like the standard cases */
+void make_lattice(int nx, int ny, d2q9_params* params, int** obstacles_ptr)
+{
+  int* obstacles = (int*)calloc((size_t)nx * ny, sizeof(int));
+
+  if (obstacles == NULL)
+  {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  params->nx           = nx;
+  params->ny           = ny;
+  params->maxIters     = 0;
+  params->reynolds_dim = nx;
+  params->density      = 0.1f;
+  params->accel        = 0.005f;
+  params->omega        = 1.85f;
+
+  for (int ii = 0; ii < nx; ii++)
+  {
+    obstacles[ii] = 1;
+    obstacles[ii + (ny - 1) * nx] = 1;
+  }
+
+  for (int jj = ny / 4; jj < ny / 2; jj++)
+  {
+    for (int ii = nx / 4; ii < nx / 2; ii++) obstacles[ii + jj * nx] = 1;
+  }
+
+  *obstacles_ptr = obstacles;
+}
+
+double run_library(const d2q9_params* params, const int* obstacles, int steps, int threads,
+                   const char* spin, float* av_vels, float** planes)
+{
+  d2q9_ctx* ctx = create_or_exit(params, obstacles);
+  double    tic, toc;
+
+  if (spin != NULL) setenv("D2Q9_SPIN", spin, 1);
+  if (threads > 1 && d2q9_threads(ctx, threads, NULL, NULL) != D2Q9_OK)
+  {
+    fprintf(stderr, "d2q9_threads failed\n");
+    exit(EXIT_FAILURE);
+  }
+  if (spin != NULL) unsetenv("D2Q9_SPIN");
+
+  /* a step at a time, as d2q9-bgk does, so each call pays for waking the threads */
+  tic = wtime();
+  for (int tt = 0; tt < steps; tt++) d2q9_step(ctx, 1, &av_vels[tt]);
+  toc = wtime();
+
+  take_speeds(ctx, planes);
+
+  return toc - tic;
+}
+
+double run_openmp(const d2q9_params* params, int* obstacles, int steps, int threads,
+                  float* av_vels, float** planes)
+{
+  const size_t ncells = (size_t)params->nx * params->ny;
+  float**  grid     = alloc_grid(ncells);
+  float**  tmp_grid = alloc_grid(ncells);
+  float**  o_grid   = alloc_grid(ncells);
+  float*   tot_u     = (float*)alloc_or_exit(sizeof(float) * threads);
+  int*     tot_cells = (int*)alloc_or_exit(sizeof(int) * threads);
+  int*     solid     = (int*)alloc_or_exit(sizeof(int) * solid_cells(params->nx, params->ny, obstacles, NULL));
+  double   tic, toc;
+
+  solid_cells(params->nx, params->ny, obstacles, solid);
+
+  /* the same blocks of rows as the pool, so the results are comparable bit for bit */
+  for (size_t ii = 0; ii < ncells; ii++)
+  {
+    grid[0][ii] = params->density * 4.f / 9.f;
+    for (int kk = 1; kk < 5; kk++) grid[kk][ii] = params->density / 9.f;
+    for (int kk = 5; kk < 9; kk++) grid[kk][ii] = params->density / 36.f;
+  }
+
+  tic = wtime();
+  for (int tt = 0; tt < steps; tt++)
+  {
+    float** swap_grid;
+    float   sum_u = 0.f;
+    int     sum_cells = 0;
+
+    accelerate(params, obstacles, grid);
+
+    #pragma omp parallel for num_threads(threads) schedule(static, 1)
+    for (int bb = 0; bb < threads; bb++)
+    {
+      const int j0 = (int)((long)params->ny * bb / threads);
+      const int j1 = (int)((long)params->ny * (bb + 1) / threads);
+
+      fushion_sized(params->nx, params->ny, params->omega, j0, j1, solid, grid, tmp_grid, o_grid);
+    }
+
+    #pragma omp parallel for num_threads(threads) schedule(static, 1)
+    for (int bb = 0; bb < threads; bb++)
+    {
+      const int j0 = (int)((long)params->ny * bb / threads);
+      const int j1 = (int)((long)params->ny * (bb + 1) / threads);
+
+      block_velocity(params, obstacles, o_grid, j0, j1, &tot_u[bb], &tot_cells[bb]);
+    }
+
+    for (int bb = 0; bb < threads; bb++)
+    {
+      sum_u     += tot_u[bb];
+      sum_cells += tot_cells[bb];
+    }
+    av_vels[tt] = sum_u / (float)sum_cells;
+
+    swap_grid = grid;
+    grid = o_grid;
+    o_grid = swap_grid;
+  }
+  toc = wtime();
+
+  for (int kk = 0; kk < D2Q9_NSPEEDS; kk++) memcpy(planes[kk], grid[kk], sizeof(float) * ncells);
+
+  free_grid(grid);
+  free_grid(tmp_grid);
+  free_grid(o_grid);
+  free(tot_u);
+  free(tot_cells);
+  free(solid);
+
+  return toc - tic;
+}
+
+/* accelerate_flow() of the library, which does not export it */
+void accelerate(const d2q9_params* params, const int* obstacles, float** grid)
+{
+  const float w1 = params->density * params->accel / 9.f;
+  const float w2 = params->density * params->accel / 36.f;
+  const int   jj = params->ny - 2;
+
+  for (int ii = 0; ii < params->nx; ii++)
+  {
+    const int cell = ii + jj * params->nx;
+
+    if (!obstacles[cell] && (grid[3][cell] - w1) > 0.f && (grid[6][cell] - w2) > 0.f && (grid[7][cell] - w2) > 0.f)
+    {
+      grid[1][cell] += w1;
+      grid[5][cell] += w2;
+      grid[8][cell] += w2;
+      grid[3][cell] -= w1;
+      grid[6][cell] -= w2;
+      grid[7][cell] -= w2;
+    }
+  }
+}
+
+/* av_velocity() over rows j0 to j1 - 1, summed in the library's order */
+void block_velocity(const d2q9_params* params, const int* obstacles, float** grid,
+                    int j0, int j1, float* tot_u, int* tot_cells)
+{
+  *tot_u = 0.f;
+  *tot_cells = 0;
+
+  for (int jj = j0; jj < j1; jj++)
+  {
+    for (int ii = 0; ii < params->nx; ii++)
+    {
+      const int cell = ii + jj * params->nx;
+      float local_density = 0.f;
+
+      if (obstacles[cell]) continue;
+
+      for (int kk = 0; kk < D2Q9_NSPEEDS; kk++) local_density += grid[kk][cell];
+
+      const float u_x = (grid[1][cell] + grid[5][cell] + grid[8][cell]
+                         - (grid[3][cell] + grid[6][cell] + grid[7][cell])) / local_density;
+      const float u_y = (grid[2][cell] + grid[5][cell] + grid[6][cell]
+                         - (grid[4][cell] + grid[7][cell] + grid[8][cell])) / local_density;
+
+      *tot_u += sqrtf((u_x * u_x) + (u_y * u_y));
+      ++*tot_cells;
+    }
+  }
+}
+